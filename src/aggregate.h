@@ -0,0 +1,205 @@
+#pragma once
+#include <bit>
+#include <tuple>
+#include <type_traits>
+#include "comp_time_read.h"
+#include "comp_time_write.h"
+
+// Aggregates are serialized field by field in declaration order, exactly like
+// the equivalent tuple, without building one. Fields are found with
+// structured bindings (up to 16), structs with nested aggregates or C arrays
+// confuse the field count and should list their members instead:
+//
+//     struct player
+//     {
+//         uint32_t id;
+//         std::string name;
+//         static constexpr auto netlib_fields = std::make_tuple(&player::id, &player::name);
+//     };
+namespace netlib
+{
+    template<typename S>
+    concept has_field_list = requires { S::netlib_fields; };
+
+    // Wrapper types with their own codec opt out with a netlib_codec typedef
+    template<typename S>
+    concept has_codec = requires { typename S::netlib_codec; };
+
+    template<typename S>
+    concept wire_struct = std::is_aggregate_v<S> && std::is_class_v<S> && !std::is_same_v<S, char_size> && !std::is_same_v<S, packet> && !has_codec<S>;
+
+    struct any_field
+    {
+        template<typename T>
+        operator T() const;
+    };
+
+    template<typename S, typename ...A>
+    constexpr size_t count_fields()
+    {
+        if constexpr (requires { S{A{}..., any_field{}}; })
+            return count_fields<S, A..., any_field>();
+        else
+            return sizeof...(A);
+    }
+
+    template<typename S>
+    constexpr size_t field_count()
+    {
+        if constexpr (has_field_list<S>)
+            return std::tuple_size_v<std::remove_cvref_t<decltype(S::netlib_fields)>>;
+        else
+            return count_fields<S>();
+    }
+
+    // Tuple of references to the fields of value, const if value is
+    template<typename S>
+    auto field_tie(S &value)
+    {
+        using plain = std::remove_cv_t<S>;
+        if constexpr (has_field_list<plain>)
+            return std::apply([&](auto ...member) { return std::tie(value.*member...); }, plain::netlib_fields);
+        else
+        {
+            constexpr size_t N = field_count<plain>();
+            static_assert(N > 0 && N <= 16, "use netlib_fields for this struct");
+            if constexpr (N == 1) { auto &[a] = value; return std::tie(a); }
+            else if constexpr (N == 2) { auto &[a, b] = value; return std::tie(a, b); }
+            else if constexpr (N == 3) { auto &[a, b, c] = value; return std::tie(a, b, c); }
+            else if constexpr (N == 4) { auto &[a, b, c, d] = value; return std::tie(a, b, c, d); }
+            else if constexpr (N == 5) { auto &[a, b, c, d, e] = value; return std::tie(a, b, c, d, e); }
+            else if constexpr (N == 6) { auto &[a, b, c, d, e, f] = value; return std::tie(a, b, c, d, e, f); }
+            else if constexpr (N == 7) { auto &[a, b, c, d, e, f, g] = value; return std::tie(a, b, c, d, e, f, g); }
+            else if constexpr (N == 8) { auto &[a, b, c, d, e, f, g, h] = value; return std::tie(a, b, c, d, e, f, g, h); }
+            else if constexpr (N == 9) { auto &[a, b, c, d, e, f, g, h, i] = value; return std::tie(a, b, c, d, e, f, g, h, i); }
+            else if constexpr (N == 10) { auto &[a, b, c, d, e, f, g, h, i, j] = value; return std::tie(a, b, c, d, e, f, g, h, i, j); }
+            else if constexpr (N == 11) { auto &[a, b, c, d, e, f, g, h, i, j, k] = value; return std::tie(a, b, c, d, e, f, g, h, i, j, k); }
+            else if constexpr (N == 12) { auto &[a, b, c, d, e, f, g, h, i, j, k, l] = value; return std::tie(a, b, c, d, e, f, g, h, i, j, k, l); }
+            else if constexpr (N == 13) { auto &[a, b, c, d, e, f, g, h, i, j, k, l, m] = value; return std::tie(a, b, c, d, e, f, g, h, i, j, k, l, m); }
+            else if constexpr (N == 14) { auto &[a, b, c, d, e, f, g, h, i, j, k, l, m, n] = value; return std::tie(a, b, c, d, e, f, g, h, i, j, k, l, m, n); }
+            else if constexpr (N == 15) { auto &[a, b, c, d, e, f, g, h, i, j, k, l, m, n, o] = value; return std::tie(a, b, c, d, e, f, g, h, i, j, k, l, m, n, o); }
+            else { auto &[a, b, c, d, e, f, g, h, i, j, k, l, m, n, o, p] = value; return std::tie(a, b, c, d, e, f, g, h, i, j, k, l, m, n, o, p); }
+        }
+    }
+
+    template<typename S>
+    using field_types = decltype(field_tie(std::declval<S &>()));
+
+    template<typename S, size_t I>
+    using field_type = std::remove_cvref_t<std::tuple_element_t<I, field_types<S>>>;
+
+    template<typename S, typename Order, size_t ...I>
+    constexpr bool same_layout(std::index_sequence<I...>)
+    {
+        constexpr bool fields_fit = ((arithmetic<field_type<S, I>> && (host_order<Order> || sizeof(field_type<S, I>) == 1)) && ...);
+        return fields_fit && (sizeof(field_type<S, I>) + ... + 0) == sizeof(S);
+    }
+
+    // True when the struct in memory is byte for byte its wire encoding
+    template<typename S, typename Order = wire_order>
+    constexpr bool same_layout()
+    {
+        if constexpr (!std::is_trivially_copyable_v<S>)
+            return false;
+        else
+            return same_layout<S, Order>(std::make_index_sequence<field_count<S>()>{});
+    }
+
+    template<typename S, typename Order = wire_order>
+    void write_struct(char_size *v, const S &value)
+    {
+        if constexpr (same_layout<S, Order>())
+        {
+            if (v->consumed_size + sizeof(S) >= (size_t)v->max_size)
+            {
+                v->max_size += sizeof(S) + 1024;
+                v->start_data = (char *)realloc(v->start_data, v->max_size);
+                v->data = v->start_data + v->consumed_size;
+            }
+            std::memcpy(v->data, &value, sizeof(S));
+            v->data += sizeof(S);
+            v->consumed_size += sizeof(S);
+        }
+        else
+        {
+            auto fields = field_tie(value);
+            write_comp_pkt(std::tuple_size_v<decltype(fields)>, *v, fields, Order);
+        }
+    }
+
+    template<typename S, typename Order = wire_order>
+    void read_struct(char_size *v, S &value)
+    {
+        if constexpr (same_layout<S, Order>())
+        {
+            if (sizeof(S) + v->consumed_size > (size_t)v->max_size)
+                return;
+            std::memcpy(&value, v->data, sizeof(S));
+            v->data += sizeof(S);
+            v->consumed_size += sizeof(S);
+        }
+        else
+        {
+            auto fields = field_tie(value);
+            const_for_<std::tuple_size_v<decltype(fields)>>([&](auto i)
+            {
+                std::get<i.value>(fields) = read_var<std::remove_cvref_t<std::tuple_element_t<i.value, decltype(fields)>>, Order>::call(v);
+            });
+        }
+    }
+
+    template<typename Order = wire_order, typename S>
+    char_size encode_struct(const S &value)
+    {
+        char *buffer = (char *)malloc(1024 * sizeof(char));
+        char_size buff = {buffer, 0, 1024, buffer};
+        write_struct<S, Order>(&buff, value);
+        if (buff.failed)
+        {
+            free(buff.start_data);
+            return {nullptr, 0, 0, nullptr, true};
+        }
+        return buff;
+    }
+
+    template<typename Order = wire_order, typename S>
+    int send_struct(const S &value, int sock)
+    {
+        char_size buff = encode_struct<Order>(value);
+        if (!buff.start_data)
+            return -1;
+        int ret = send_whole(sock, buff.start_data, buff.consumed_size, 0);
+        free(buff.start_data);
+        return ret;
+    }
+
+    // Decodes pkt into out in place, returns how many bytes were consumed
+    template<typename Order = wire_order, typename S>
+    int read_struct(S &out, struct packet pkt)
+    {
+        char_size buff = {.data = pkt.data, .consumed_size = 0, .max_size = (int)pkt.size, .start_data = pkt.data};
+        read_struct<S, Order>(&buff, out);
+        return buff.consumed_size;
+    }
+}
+
+// Aggregates nest inside tuples, vectors and other aggregates
+template<netlib::wire_struct S, typename Order>
+struct write_var<S, Order>
+{
+    static void call(char_size *v, const S &value)
+    {
+        netlib::write_struct<S, Order>(v, value);
+    }
+};
+
+template<netlib::wire_struct S, typename Order>
+struct read_var<S, Order>
+{
+    static S call(char_size *v)
+    {
+        S ret{};
+        netlib::read_struct<S, Order>(v, ret);
+        return ret;
+    }
+};
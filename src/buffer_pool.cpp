@@ -0,0 +1,117 @@
+#include "buffer_pool.h"
+#include <cstdlib>
+#include <cstring>
+
+netlib::buffer_pool::buffer_pool()
+{
+    in_use = 0;
+    cached = 0;
+    acquired = 0;
+    reused = 0;
+}
+
+netlib::buffer_pool::~buffer_pool()
+{
+    for (auto &free_list : free_lists)
+        for (char *data : free_list)
+            free(data);
+}
+
+// -1 past the largest class, those are allocated and freed directly
+int netlib::buffer_pool::class_of(size_t size)
+{
+    size_t class_size = POOL_MIN_CLASS;
+    for (int index = 0; index < POOL_CLASSES; index++)
+    {
+        if (size <= class_size)
+            return index;
+        class_size <<= 1;
+    }
+    return -1;
+}
+
+char *netlib::buffer_pool::acquire(size_t size, size_t &capacity)
+{
+    int index = class_of(size);
+    capacity = index == -1 ? size : (size_t)POOL_MIN_CLASS << index;
+    std::lock_guard<std::mutex> lock(sync);
+    acquired++;
+    in_use += capacity;
+    if (index != -1 && !free_lists[index].empty())
+    {
+        char *data = free_lists[index].back();
+        free_lists[index].pop_back();
+        cached -= capacity;
+        reused++;
+        return data;
+    }
+    return (char *)malloc(capacity);
+}
+
+void netlib::buffer_pool::release(char *data, size_t capacity)
+{
+    if (!data)
+        return;
+    int index = class_of(capacity);
+    std::lock_guard<std::mutex> lock(sync);
+    in_use -= capacity;
+    if (index == -1 || ((size_t)POOL_MIN_CLASS << index) != capacity || free_lists[index].size() >= POOL_MAX_CACHED)
+    {
+        free(data);
+        return;
+    }
+    free_lists[index].push_back(data);
+    cached += capacity;
+}
+
+bool netlib::buffer_pool::grow(char *&data, size_t &capacity, size_t used, size_t needed)
+{
+    if (needed <= capacity)
+        return true;
+    size_t new_capacity = 0;
+    char *new_data = acquire(needed > capacity * 2 ? needed : capacity * 2, new_capacity);
+    if (!new_data)
+        return false;
+    if (used > 0)
+        memcpy(new_data, data, used);
+    release(data, capacity);
+    data = new_data;
+    capacity = new_capacity;
+    return true;
+}
+
+void netlib::buffer_pool::trim(char *&data, size_t &capacity, size_t used)
+{
+    if (!data)
+        return;
+    if (used == 0)
+    {
+        release(data, capacity);
+        data = nullptr;
+        capacity = 0;
+        return;
+    }
+    if (capacity <= POOL_MIN_CLASS || used * 4 >= capacity)
+        return;
+    size_t new_capacity = 0;
+    char *new_data = acquire(used * 2, new_capacity);
+    if (!new_data)
+        return;
+    memcpy(new_data, data, used);
+    release(data, capacity);
+    data = new_data;
+    capacity = new_capacity;
+}
+
+netlib::buffer_pool_stats netlib::buffer_pool::stats()
+{
+    std::lock_guard<std::mutex> lock(sync);
+    return {in_use, cached, acquired, reused};
+}
+
+netlib::buffer_pool &netlib::default_pool()
+{
+    // Never destroyed so connections torn down during exit can still return buffers
+    static buffer_pool *pool = new buffer_pool;
+    return *pool;
+}
@@ -0,0 +1,63 @@
+#pragma once
+#include <cstddef>
+#include <mutex>
+#include <vector>
+
+#ifndef POOL_MIN_CLASS
+#define POOL_MIN_CLASS 256
+#endif
+#ifndef POOL_CLASSES
+#define POOL_CLASSES 10
+#endif
+#ifndef POOL_MAX_CACHED
+#define POOL_MAX_CACHED 64
+#endif
+
+// Receive buffers in power of two size classes from POOL_MIN_CLASS up,
+// POOL_MAX_CACHED free buffers kept per class. Connections only hold one
+// while they have unconsumed bytes, so idle ones cost nothing
+namespace netlib
+{
+    struct buffer_pool_stats
+    {
+        size_t in_use;
+        size_t cached;
+        size_t acquired;
+        size_t reused;
+    };
+
+    struct connection_memory
+    {
+        size_t buffered;
+        size_t capacity;
+        size_t outbound;
+    };
+
+    class buffer_pool
+    {
+        public:
+            buffer_pool();
+            ~buffer_pool();
+            buffer_pool(const buffer_pool &) = delete;
+            buffer_pool &operator=(const buffer_pool &) = delete;
+            char *acquire(size_t size, size_t &capacity);
+            void release(char *data, size_t capacity);
+            // Makes room for needed bytes keeping the first used, at least
+            // doubling so a busy connection grows in a few steps
+            bool grow(char *&data, size_t &capacity, size_t used, size_t needed);
+            // Returns a drained buffer, moves one under a quarter full down
+            void trim(char *&data, size_t &capacity, size_t used);
+            buffer_pool_stats stats();
+        private:
+            static int class_of(size_t size);
+            std::vector<char *> free_lists[POOL_CLASSES];
+            size_t in_use;
+            size_t cached;
+            size_t acquired;
+            size_t reused;
+            std::mutex sync;
+    };
+
+    // Shared by connections that aren't owned by a server
+    buffer_pool &default_pool();
+}
@@ -0,0 +1,56 @@
+#pragma once
+#include <bit>
+#include <concepts>
+#include <cstring>
+#include <cstdint>
+
+// Wire byte order policies for the codec templates. Big endian is the
+// default, peers that are all little endian can use little_endian (or
+// native_endian) to skip byteswaps and let fixed layouts become memcpys.
+// The default can be changed for a whole build with NETLIB_WIRE_ORDER
+namespace netlib
+{
+    struct big_endian
+    {
+        static constexpr std::endian value = std::endian::big;
+    };
+
+    struct little_endian
+    {
+        static constexpr std::endian value = std::endian::little;
+    };
+
+    struct native_endian
+    {
+        static constexpr std::endian value = std::endian::native;
+    };
+
+#ifndef NETLIB_WIRE_ORDER
+#define NETLIB_WIRE_ORDER netlib::big_endian
+#endif
+    using wire_order = NETLIB_WIRE_ORDER;
+
+    template<typename Order>
+    constexpr bool host_order = Order::value == std::endian::native;
+
+    template<typename T>
+    using same_size_uint = std::conditional_t<sizeof(T) == 1, uint8_t,
+                           std::conditional_t<sizeof(T) == 2, uint16_t,
+                           std::conditional_t<sizeof(T) == 4, uint32_t, uint64_t>>>;
+
+    // Converts between host and Order, the same operation both ways
+    template<typename Order, typename T>
+    T swap_order(T value)
+    {
+        if constexpr (host_order<Order> || sizeof(T) == 1)
+            return value;
+        else
+        {
+            same_size_uint<T> raw;
+            std::memcpy(&raw, &value, sizeof(T));
+            raw = std::byteswap(raw);
+            std::memcpy(&value, &raw, sizeof(T));
+            return value;
+        }
+    }
+}
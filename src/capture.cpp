@@ -0,0 +1,310 @@
+#include "capture.h"
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <chrono>
+#include <cstring>
+#include <map>
+#include <print>
+#include <thread>
+#include "comp_time_read.h"
+#include "comp_time_write.h"
+
+// Monotonic, replay only looks at the gaps between records
+static uint64_t capture_now()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+netlib::capture_writer::capture_writer()
+{
+    fd = -1;
+    segment = nullptr;
+    segment_size = 0;
+    segment_offset = 0;
+    segment_used = 0;
+}
+
+netlib::capture_writer::~capture_writer()
+{
+    close();
+}
+
+bool netlib::capture_writer::open(const std::string &path, size_t size)
+{
+    std::lock_guard<std::mutex> lock(sync);
+    if (fd != -1)
+        return false;
+    fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1)
+    {
+        std::println("Couldn't open capture {}: {}", path, strerror(errno));
+        return false;
+    }
+    size_t page = sysconf(_SC_PAGESIZE);
+    segment_size = (size + page - 1) / page * page;
+    segment_offset = 0;
+    if (!map_segment())
+    {
+        ::close(fd);
+        fd = -1;
+        return false;
+    }
+    return true;
+}
+
+// Grows the file by a segment and maps it at segment_offset
+bool netlib::capture_writer::map_segment()
+{
+    segment_used = 0;
+    if (ftruncate(fd, segment_offset + segment_size) == -1)
+    {
+        std::println("Couldn't grow capture: {}", strerror(errno));
+        segment = nullptr;
+        return false;
+    }
+    void *mapped = mmap(nullptr, segment_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, segment_offset);
+    if (mapped == MAP_FAILED)
+    {
+        std::println("Couldn't map capture: {}", strerror(errno));
+        segment = nullptr;
+        return false;
+    }
+    segment = (char *)mapped;
+    return true;
+}
+
+void netlib::capture_writer::append(const char *data, size_t size)
+{
+    while (size > 0 && segment)
+    {
+        size_t room = segment_size - segment_used;
+        size_t chunk = size < room ? size : room;
+        memcpy(segment + segment_used, data, chunk);
+        segment_used += chunk;
+        data += chunk;
+        size -= chunk;
+        if (segment_used == segment_size)
+        {
+            munmap(segment, segment_size);
+            segment_offset += segment_size;
+            map_segment();
+        }
+    }
+}
+
+void netlib::capture_writer::record(int connection, capture_direction direction, const char *data, size_t size)
+{
+    char header[capture_header_size];
+    write_type<uint64_t>(header, capture_now());
+    write_type<uint32_t>(header + 8, (uint32_t)connection);
+    header[12] = (char)direction;
+    write_type<uint32_t>(header + 13, (uint32_t)size);
+
+    std::lock_guard<std::mutex> lock(sync);
+    if (!segment)
+        return;
+    append(header, capture_header_size);
+    append(data, size);
+}
+
+size_t netlib::capture_writer::size()
+{
+    std::lock_guard<std::mutex> lock(sync);
+    return segment_offset + segment_used;
+}
+
+// Cuts the file down to what was written
+void netlib::capture_writer::close()
+{
+    std::lock_guard<std::mutex> lock(sync);
+    if (fd == -1)
+        return;
+    if (segment)
+        munmap(segment, segment_size);
+    segment = nullptr;
+    if (ftruncate(fd, segment_offset + segment_used) == -1)
+        std::println("Couldn't truncate capture: {}", strerror(errno));
+    ::close(fd);
+    fd = -1;
+}
+
+netlib::capture_reader::capture_reader()
+{
+    fd = -1;
+    map = nullptr;
+    map_size = 0;
+    position = 0;
+}
+
+netlib::capture_reader::~capture_reader()
+{
+    close();
+}
+
+bool netlib::capture_reader::open(const std::string &path)
+{
+    close();
+    fd = ::open(path.c_str(), O_RDONLY);
+    if (fd == -1)
+    {
+        std::println("Couldn't open capture {}: {}", path, strerror(errno));
+        return false;
+    }
+    struct stat info;
+    if (fstat(fd, &info) == -1)
+    {
+        close();
+        return false;
+    }
+    map_size = info.st_size;
+    position = 0;
+    if (map_size == 0)
+        return true;
+    void *mapped = mmap(nullptr, map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (mapped == MAP_FAILED)
+    {
+        std::println("Couldn't map capture: {}", strerror(errno));
+        close();
+        return false;
+    }
+    map = (char *)mapped;
+    madvise(map, map_size, MADV_SEQUENTIAL);
+    return true;
+}
+
+bool netlib::capture_reader::next(capture_record &out)
+{
+    if (!map || position + capture_header_size > map_size)
+        return false;
+    char *header = map + position;
+    uint64_t timestamp = read_type<uint64_t>(header);
+    uint32_t size = read_type<uint32_t>(header + 13);
+    if (timestamp == 0 || position + capture_header_size + size > map_size)
+        return false;
+    out.timestamp = timestamp;
+    out.connection = read_type<uint32_t>(header + 8);
+    out.direction = (capture_direction)header[12];
+    out.data = std::string_view(header + capture_header_size, size);
+    position += capture_header_size + size;
+    return true;
+}
+
+void netlib::capture_reader::rewind()
+{
+    position = 0;
+}
+
+void netlib::capture_reader::close()
+{
+    if (map)
+        munmap(map, map_size);
+    map = nullptr;
+    map_size = 0;
+    if (fd != -1)
+        ::close(fd);
+    fd = -1;
+}
+
+netlib::replay::replay(std::string replay_address, short replay_port)
+:address(replay_address), port(replay_port)
+{
+    speed = 1;
+}
+
+void netlib::replay::set_speed(double factor)
+{
+    speed = factor;
+}
+
+int netlib::replay::connect_one()
+{
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr = {0};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    inet_pton(AF_INET, address.c_str(), &addr.sin_addr);
+    if (connect(sock, (sockaddr *)&addr, sizeof(addr)) == -1)
+    {
+        std::println("Replay couldn't connect: {}", strerror(errno));
+        ::close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+netlib::replay_stats netlib::replay::run(const std::string &path)
+{
+    replay_stats stats = {0, 0, 0, 0};
+    capture_reader reader;
+    if (!reader.open(path))
+        return stats;
+
+    std::map<uint32_t, int> sockets;
+    capture_record current;
+    uint64_t first = 0;
+    auto start = std::chrono::steady_clock::now();
+    while (reader.next(current))
+    {
+        if (current.direction != capture_direction::INBOUND)
+            continue;
+        if (first == 0)
+            first = current.timestamp;
+        // Writers stamp before taking the lock, a record can land behind one
+        // stamped after it
+        if (speed > 0 && current.timestamp > first)
+        {
+            auto due = start + std::chrono::nanoseconds((uint64_t)((current.timestamp - first) / speed));
+            std::this_thread::sleep_until(due);
+        }
+        auto sock_test = sockets.find(current.connection);
+        if (sock_test == sockets.end())
+        {
+            sock_test = sockets.emplace(current.connection, connect_one()).first;
+            stats.connections++;
+        }
+        int sock = sock_test->second;
+        if (sock == -1)
+            continue;
+        size_t sent = 0;
+        while (sent < current.data.size())
+        {
+            int status = send(sock, current.data.data() + sent, current.data.size() - sent, MSG_NOSIGNAL);
+            if (status == -1)
+            {
+                if (errno == EINTR)
+                    continue;
+                std::println("Replay send failed: {}", strerror(errno));
+                ::close(sock);
+                sock_test->second = -1;
+                break;
+            }
+            sent += status;
+        }
+        stats.records++;
+        stats.bytes += sent;
+    }
+
+    // Half close and wait for the server to hang up so nothing in flight is lost
+    for (auto &[connection, sock] : sockets)
+        if (sock != -1)
+            shutdown(sock, SHUT_WR);
+    for (auto &[connection, sock] : sockets)
+    {
+        if (sock == -1)
+            continue;
+        timeval wait = {1, 0};
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &wait, sizeof(wait));
+        char drain[4096];
+        while (recv(sock, drain, sizeof(drain), 0) > 0)
+            ;
+        ::close(sock);
+    }
+    stats.elapsed_ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+    return stats;
+}
@@ -0,0 +1,99 @@
+#pragma once
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <string_view>
+
+#ifndef CAPTURE_SEGMENT_SIZE
+#define CAPTURE_SEGMENT_SIZE (64 * 1024 * 1024)
+#endif
+
+// Capture files are a run of records, each
+// [uint64 steady clock ns][uint32 connection][uint8 direction][uint32 size][bytes]
+// with the header in the library's wire byte order. The file grows a mapped
+// segment at a time and is cut to the bytes used on close, a record with a
+// zero timestamp marks the end of a capture that wasn't closed cleanly
+namespace netlib
+{
+    enum class capture_direction : uint8_t
+    {
+        INBOUND,
+        OUTBOUND
+    };
+
+    struct capture_record
+    {
+        uint64_t timestamp;
+        uint32_t connection;
+        capture_direction direction;
+        std::string_view data;
+    };
+
+    constexpr size_t capture_header_size = sizeof(uint64_t) + sizeof(uint32_t) + sizeof(uint8_t) + sizeof(uint32_t);
+
+    // Append only, safe to share between a server's threads
+    class capture_writer
+    {
+        public:
+            capture_writer();
+            ~capture_writer();
+            capture_writer(const capture_writer &) = delete;
+            capture_writer &operator=(const capture_writer &) = delete;
+            bool open(const std::string &path, size_t segment_size = CAPTURE_SEGMENT_SIZE);
+            void record(int connection, capture_direction direction, const char *data, size_t size);
+            void close();
+            size_t size();
+        private:
+            bool map_segment();
+            void append(const char *data, size_t size);
+            int fd;
+            char *segment;
+            size_t segment_size;
+            size_t segment_offset;
+            size_t segment_used;
+            std::mutex sync;
+    };
+
+    class capture_reader
+    {
+        public:
+            capture_reader();
+            ~capture_reader();
+            capture_reader(const capture_reader &) = delete;
+            capture_reader &operator=(const capture_reader &) = delete;
+            bool open(const std::string &path);
+            // The record's data points into the mapping, valid until close
+            bool next(capture_record &out);
+            void rewind();
+            void close();
+        private:
+            int fd;
+            char *map;
+            size_t map_size;
+            size_t position;
+    };
+
+    struct replay_stats
+    {
+        size_t records;
+        size_t bytes;
+        size_t connections;
+        uint64_t elapsed_ms;
+    };
+
+    // Streams the inbound side of a capture back at a server, one loopback
+    // connection per captured connection. speed 1 keeps the original timing,
+    // 2 plays twice as fast, 0 sends flat out
+    class replay
+    {
+        public:
+            replay(std::string address, short port);
+            void set_speed(double factor);
+            replay_stats run(const std::string &path);
+        private:
+            int connect_one();
+            std::string address;
+            short port;
+            double speed;
+    };
+}
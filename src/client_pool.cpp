@@ -0,0 +1,393 @@
+#include "client_pool.h"
+#include <format>
+#include <random>
+
+#define POOL_VIRTUAL_NODES 64
+
+static uint64_t fnv1a(const char *data, size_t size)
+{
+    uint64_t hash = 1469598103934665603ULL;
+    for (size_t i = 0; i < size; i++)
+    {
+        hash ^= (unsigned char)data[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+static uint64_t mix_key(uint64_t key)
+{
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    key *= 0xc4ceb9fe1a85ec53ULL;
+    key ^= key >> 33;
+    return key;
+}
+
+netlib::client_pool::client_pool(int reactor_threads)
+{
+    connect_timeout = 3000;
+    backoff_min = 100;
+    backoff_max = 10000;
+    if (reactor_threads < 1)
+        reactor_threads = 1;
+    for (int i = 0; i < reactor_threads; i++)
+    {
+        auto reactor = std::make_unique<pool_reactor>();
+        reactor->poll_set = default_transport().open_poller({});
+        pool_reactor *current = reactor.get();
+        reactor->thread = std::thread([this, current]() { this->reactor_th(*current); });
+        reactors.push_back(std::move(reactor));
+    }
+}
+
+netlib::client_pool::~client_pool()
+{
+    for (auto &reactor : reactors)
+    {
+        reactor->threads = false;
+        reactor->commands.push({.type = command_type::SHUTDOWN});
+        reactor->poll_set->wake();
+    }
+    for (auto &reactor : reactors)
+    {
+        if (reactor->thread.joinable())
+            reactor->thread.join();
+    }
+    for (auto &backend : backends)
+    {
+        if (backend->fd != -1)
+            close(backend->fd);
+    }
+}
+
+netlib::pool_backend *netlib::client_pool::find(int backend)
+{
+    std::lock_guard<std::mutex> lock(sync);
+    if (backend < 0 || backend >= (int)backends.size())
+        return nullptr;
+    return backends[backend].get();
+}
+
+int netlib::client_pool::add_backend(std::string address, short port)
+{
+    std::unique_lock<std::mutex> lock(sync);
+    int id = backends.size();
+    auto backend = std::make_unique<pool_backend>(id, address, port);
+    backend->reactor = id % reactors.size();
+    backend->backoff_ms = backoff_min;
+    std::string name = std::format("{}:{}", address, port);
+    for (int i = 0; i < POOL_VIRTUAL_NODES; i++)
+    {
+        std::string virtual_node = std::format("{}#{}", name, i);
+        ring[fnv1a(virtual_node.c_str(), virtual_node.size())] = id;
+    }
+    pool_backend *current = backend.get();
+    pool_reactor &reactor = *reactors[current->reactor];
+    backends.push_back(std::move(backend));
+    lock.unlock();
+    reactor.commands.push({.type = command_type::CALL, .callback = [this, current]() { start_connect(*current); }});
+    reactor.poll_set->wake();
+    return id;
+}
+
+void netlib::client_pool::set_connect_timeout(uint64_t timeout_ms)
+{
+    connect_timeout = timeout_ms;
+}
+
+void netlib::client_pool::set_backoff(uint64_t min_ms, uint64_t max_ms)
+{
+    backoff_min = min_ms;
+    backoff_max = max_ms < min_ms ? min_ms : max_ms;
+}
+
+// Least outstanding requests among the connected backends, -1 if none is up
+int netlib::client_pool::pick()
+{
+    std::lock_guard<std::mutex> lock(sync);
+    int best = -1;
+    size_t best_outstanding = 0;
+    for (auto &backend : backends)
+    {
+        if (backend->state != backend_state::CONNECTED)
+            continue;
+        size_t outstanding = backend->outstanding;
+        if (best == -1 || outstanding < best_outstanding)
+        {
+            best = backend->id;
+            best_outstanding = outstanding;
+        }
+    }
+    return best;
+}
+
+// Consistent hash, keys of a backend that is down move to the next one on the ring
+int netlib::client_pool::pick(uint64_t key)
+{
+    std::lock_guard<std::mutex> lock(sync);
+    if (ring.empty())
+        return -1;
+    auto it = ring.lower_bound(mix_key(key));
+    for (size_t i = 0; i < ring.size(); i++, it++)
+    {
+        if (it == ring.end())
+            it = ring.begin();
+        if (backends[it->second]->state == backend_state::CONNECTED)
+            return it->second;
+    }
+    return -1;
+}
+
+bool netlib::client_pool::healthy(int backend)
+{
+    pool_backend *current = find(backend);
+    return current && current->state == backend_state::CONNECTED;
+}
+
+netlib::backend_stats netlib::client_pool::stats(int backend)
+{
+    pool_backend *current = find(backend);
+    if (!current)
+        return backend_stats{backend_state::BACKOFF, 0, 0, 0, 0};
+    std::lock_guard<std::mutex> lock(sync);
+    return backend_stats{current->state, current->outstanding, current->connects, current->failures, current->backoff_ms};
+}
+
+int netlib::client_pool::send(int backend, char *data, size_t size)
+{
+    pool_backend *current = find(backend);
+    if (!current || current->state != backend_state::CONNECTED)
+        return -1;
+    char *copy = (char *)malloc(size);
+    memcpy(copy, data, size);
+    current->outstanding++;
+    reactors[current->reactor]->commands.push({.type = command_type::SEND, .fd = backend, .data = copy, .size = size});
+    reactors[current->reactor]->poll_set->wake();
+    return size;
+}
+
+char *netlib::client_pool::receive_data(int backend, size_t size)
+{
+    pool_backend *current = find(backend);
+    if (!current)
+        return nullptr;
+    // The reactor appends and drops data under sync
+    std::lock_guard<std::mutex> lock(current->conn.sync);
+    if (current->conn.readable == false)
+        return nullptr;
+    size = std::min(size, current->conn.data_size);
+    char *ret = (char *)calloc(size + 1, sizeof(char));
+    memcpy(ret, current->conn.data, size);
+    current->conn.drop_data(size);
+    return ret;
+}
+
+// Waits until the backend has buffered data, timeout 0 waits forever
+bool netlib::client_pool::wait_readable(int backend, uint64_t timeout_ms)
+{
+    pool_backend *current = find(backend);
+    if (!current)
+        return false;
+    std::unique_lock<std::mutex> lock(sync);
+    auto ready = [current]() { return current->conn.readable == true; };
+    if (timeout_ms == 0)
+    {
+        current->readable_cv.wait(lock, ready);
+        return true;
+    }
+    return current->readable_cv.wait_for(lock, std::chrono::milliseconds(timeout_ms), ready);
+}
+
+void netlib::client_pool::request_done(int backend)
+{
+    pool_backend *current = find(backend);
+    if (!current)
+        return;
+    size_t outstanding = current->outstanding;
+    while (outstanding > 0 && !current->outstanding.compare_exchange_weak(outstanding, outstanding - 1))
+        ;
+}
+
+void netlib::client_pool::set_interest(pool_backend &backend, bool writable)
+{
+    reactors[backend.reactor]->poll_set->watch(backend.fd, TRANSPORT_READ | (writable ? TRANSPORT_WRITE : 0));
+    backend.conn.write_interest = writable;
+}
+
+void netlib::client_pool::start_connect(pool_backend &backend)
+{
+    pool_reactor &reactor = *reactors[backend.reactor];
+    sockaddr_in addr = {0};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(backend.port);
+    if (inet_pton(AF_INET, backend.address.c_str(), &(addr.sin_addr)) != 1)
+    {
+        fail(backend, "invalid address");
+        return;
+    }
+    backend.fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (backend.fd == -1)
+    {
+        fail(backend, strerror(errno));
+        return;
+    }
+    fcntl(backend.fd, F_SETFL, fcntl(backend.fd, F_GETFL) | O_NONBLOCK);
+    backend.conn.fd = backend.fd;
+    backend.state = backend_state::CONNECTING;
+    reactor.by_fd[backend.fd] = &backend;
+    if (connect(backend.fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) == 0)
+    {
+        connected(backend);
+        return;
+    }
+    if (errno != EINPROGRESS)
+    {
+        fail(backend, strerror(errno));
+        return;
+    }
+    // Writable means the handshake finished, one way or the other
+    set_interest(backend, true);
+    backend.connect_timer.callback = [this, &backend]()
+    {
+        if (backend.state == backend_state::CONNECTING)
+            fail(backend, "connect timeout");
+    };
+    reactor.timers.arm(&backend.connect_timer, connect_timeout);
+}
+
+void netlib::client_pool::connected(pool_backend &backend)
+{
+    pool_reactor &reactor = *reactors[backend.reactor];
+    reactor.timers.cancel(&backend.connect_timer);
+    std::unique_lock<std::mutex> lock(sync);
+    backend.state = backend_state::CONNECTED;
+    backend.connects++;
+    backend.backoff_ms = backoff_min;
+    lock.unlock();
+    std::println("Backend {}:{} connected", backend.address, backend.port);
+    set_interest(backend, !backend.conn.outbound.empty());
+    if (!backend.conn.outbound.empty())
+        flush(backend);
+}
+
+void netlib::client_pool::fail(pool_backend &backend, const char *reason)
+{
+    pool_reactor &reactor = *reactors[backend.reactor];
+    std::println("Backend {}:{} failed: {}", backend.address, backend.port, reason);
+    reactor.timers.cancel(&backend.connect_timer);
+    if (backend.fd != -1)
+    {
+        reactor.by_fd.erase(backend.fd);
+        reactor.poll_set->watch(backend.fd, 0);
+        close(backend.fd);
+        backend.fd = -1;
+    }
+    backend.conn.outbound.clear();
+    backend.conn.write_interest = false;
+    {
+        // Left over bytes would read as the start of the next connection's
+        std::lock_guard<std::mutex> conn_lock(backend.conn.sync);
+        backend.conn.pool->trim(backend.conn.data, backend.conn.alloc_size, 0);
+        backend.conn.data_size = 0;
+        backend.conn.readable = false;
+    }
+
+    std::unique_lock<std::mutex> lock(sync);
+    backend.state = backend_state::BACKOFF;
+    backend.outstanding = 0;
+    backend.failures++;
+    // Jitter so backends that failed together dont reconnect together
+    static thread_local std::minstd_rand jitter(std::random_device{}());
+    uint64_t delay = backend.backoff_ms / 2 + jitter() % (backend.backoff_ms / 2 + 1);
+    backend.backoff_ms = std::min(backend.backoff_ms * 2, backoff_max);
+    lock.unlock();
+    backend.readable_cv.notify_all();
+    backend.retry_timer.callback = [this, &backend]() { start_connect(backend); };
+    reactor.timers.arm(&backend.retry_timer, delay);
+}
+
+// The outbound queue is only ever touched by the backend's reactor thread
+void netlib::client_pool::flush(pool_backend &backend)
+{
+    pool_reactor &reactor = *reactors[backend.reactor];
+    if (flush_outbound(backend.conn.outbound, backend.fd, default_transport(), *reactor.poll_set, backend.conn.write_interest) == -1)
+        fail(backend, strerror(errno));
+}
+
+// Backends only take sends once connected, the hooks run on their reactor
+netlib::command_handlers netlib::client_pool::command_hooks()
+{
+    return {
+        .outbound = [this](int backend) -> outbound_queue *
+        {
+            pool_backend *current = find(backend);
+            if (!current || current->state != backend_state::CONNECTED)
+                return nullptr;
+            return &current->conn.outbound;
+        },
+        .flush = [this](int backend) { flush(*find(backend)); }
+    };
+}
+
+void netlib::client_pool::reactor_th(pool_reactor &reactor)
+{
+    command_handlers handlers = command_hooks();
+    int events_ready = 0;
+    transport_event events[1024];
+    char *buffer = (char *)malloc(RECV_SCRATCH_SIZE);
+    while (reactor.threads == true)
+    {
+        int wait_ms = reactor.timers.next_timeout(reactor.timers.now_ms());
+        events_ready = reactor.poll_set->wait(events, 1024, wait_ms);
+        if (events_ready == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            std::println("Epoll/kqueue failed {}", strerror(errno));
+            break;
+        }
+        for (int i = 0; i < events_ready; i++)
+        {
+            int current_fd = events[i].fd;
+            bool writable = events[i].writable;
+            bool read_event = events[i].readable;
+            auto found = reactor.by_fd.find(current_fd);
+            if (found == reactor.by_fd.end())
+                continue;
+            pool_backend &backend = *found->second;
+            if (backend.state == backend_state::CONNECTING)
+            {
+                int error = 0;
+                socklen_t error_size = sizeof(error);
+                getsockopt(current_fd, SOL_SOCKET, SO_ERROR, &error, &error_size);
+                if (error != 0)
+                    fail(backend, strerror(error));
+                else if (writable)
+                    connected(backend);
+                continue;
+            }
+            if (writable)
+                flush(backend);
+            if (!read_event || backend.fd != current_fd)
+                continue;
+            int status = recv(current_fd, buffer, RECV_SCRATCH_SIZE, 0);
+            if (status == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                continue;
+            if (status == -1 || status == 0)
+            {
+                fail(backend, status == 0 ? "connection closed" : strerror(errno));
+                continue;
+            }
+            backend.conn.add_data(buffer, status);
+            std::lock_guard<std::mutex> lock(sync);
+            backend.conn.readable = true;
+            backend.readable_cv.notify_all();
+        }
+        reactor.timers.advance(reactor.timers.now_ms());
+        if (!run_commands(reactor.commands, handlers))
+            reactor.threads = false;
+    }
+    free(buffer);
+}
@@ -0,0 +1,139 @@
+#pragma once
+#include "netlib.h"
+#include <deque>
+#include <memory>
+
+namespace netlib
+{
+    enum class backend_state
+    {
+        CONNECTING,
+        CONNECTED,
+        BACKOFF
+    };
+
+    struct backend_stats
+    {
+        backend_state state;
+        size_t outstanding;
+        size_t connects;
+        size_t failures;
+        uint64_t backoff_ms;
+    };
+
+    struct pool_backend
+    {
+        pool_backend(int backend_id, std::string addr, short backend_port)
+        :id(backend_id), address(addr), port(backend_port)
+        {
+            fd = -1;
+            reactor = 0;
+            state = backend_state::BACKOFF;
+            outstanding = 0;
+            connects = 0;
+            failures = 0;
+            backoff_ms = 0;
+        }
+        int id;
+        std::string address;
+        short port;
+        int fd;
+        int reactor;
+        std::atomic<backend_state> state;
+        std::atomic_size_t outstanding;
+        size_t connects;
+        size_t failures;
+        uint64_t backoff_ms;
+        cli_raw conn;
+        std::condition_variable readable_cv;
+        timer_node connect_timer;
+        timer_node retry_timer;
+    };
+
+    // One event loop shared by many backends
+    struct pool_reactor
+    {
+        std::unique_ptr<poller> poll_set;
+        timer_wheel timers;
+        mpsc_queue<command> commands;
+        std::map<int, pool_backend *> by_fd;
+        std::atomic_bool threads = true;
+        std::thread thread;
+    };
+
+    // Many outbound connections on a few reactor threads. Connects are non
+    // blocking with a timeout, broken backends reconnect with exponential
+    // backoff. send_packet/read_packet behave like client_raw's per backend
+    class client_pool
+    {
+        public:
+            client_pool(int reactor_threads = 1);
+            ~client_pool();
+            int add_backend(std::string address, short port);
+            void set_connect_timeout(uint64_t timeout_ms);
+            void set_backoff(uint64_t min_ms, uint64_t max_ms);
+            int pick();
+            int pick(uint64_t key);
+            bool healthy(int backend);
+            backend_stats stats(int backend);
+            template<typename Order = wire_order, typename ...T>
+            int send_packet(std::tuple<T...> packet, int backend);
+            int send(int backend, char *data, size_t size);
+            char *receive_data(int backend, size_t size);
+            template<typename Order = wire_order, typename ...T>
+            std::optional<std::tuple<T...>> read_packet(int backend, std::tuple<T...> packet);
+            bool wait_readable(int backend, uint64_t timeout_ms = 0);
+            void request_done(int backend);
+        private:
+            void reactor_th(pool_reactor &reactor);
+            void start_connect(pool_backend &backend);
+            void connected(pool_backend &backend);
+            void fail(pool_backend &backend, const char *reason);
+            void set_interest(pool_backend &backend, bool writable);
+            void flush(pool_backend &backend);
+            command_handlers command_hooks();
+            pool_backend *find(int backend);
+            std::vector<std::unique_ptr<pool_reactor>> reactors;
+            std::deque<std::unique_ptr<pool_backend>> backends;
+            std::map<uint64_t, int> ring;
+            std::mutex sync;
+            uint64_t connect_timeout;
+            uint64_t backoff_min;
+            uint64_t backoff_max;
+    };
+
+    template <typename Order, typename... T>
+    inline int client_pool::send_packet(std::tuple<T...> packet, int backend)
+    {
+        pool_backend *current = find(backend);
+        if (!current || current->state != backend_state::CONNECTED)
+            return -1;
+        char_size buff = netlib::encode_packet<Order>(packet);
+        if (!buff.start_data)
+            return -1;
+        int ret = buff.consumed_size;
+        current->outstanding++;
+        reactors[current->reactor]->commands.push({.type = command_type::SEND, .fd = backend, .data = buff.start_data, .size = (size_t)buff.consumed_size});
+        reactors[current->reactor]->poll_set->wake();
+        return ret;
+    }
+
+    template <typename Order, typename... T>
+    inline std::optional<std::tuple<T...>> client_pool::read_packet(int backend, std::tuple<T...> packet)
+    {
+        using layout = fixed_layout<std::tuple<T...>>;
+
+        pool_backend *current = find(backend);
+        if (!current)
+            return std::nullopt;
+        {
+            std::lock_guard<std::mutex> lock(current->conn.sync);
+            if (current->conn.data_size < layout::size)
+                return std::nullopt;
+            layout::template load<Order>(current->conn.data, packet);
+            current->conn.drop_data(layout::size);
+        }
+        request_done(backend);
+        return packet;
+    }
+}
@@ -0,0 +1,297 @@
+#include "command_queue.h"
+#include <cstring>
+#include <print>
+
+void netlib::waker::open(int reactor_fd)
+{
+    epfd = reactor_fd;
+    #if defined(__APPLE__) || defined(__FreeBSD__)
+    struct kevent ev;
+    EV_SET(&ev, 0, EVFILT_USER, EV_ADD | EV_CLEAR, 0, 0, 0);
+    kevent(epfd, &ev, 1, NULL, 0, NULL);
+    #elif defined(__linux__)
+    fd = eventfd(0, EFD_NONBLOCK);
+    epoll_event event;
+    event.data.fd = fd;
+    event.events = EPOLLIN;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &event);
+    #endif
+}
+
+void netlib::waker::wake()
+{
+    if (epfd == -1)
+        return;
+    #if defined(__APPLE__) || defined(__FreeBSD__)
+    struct kevent ev;
+    EV_SET(&ev, 0, EVFILT_USER, 0, NOTE_TRIGGER, 0, 0);
+    kevent(epfd, &ev, 1, NULL, 0, NULL);
+    #elif defined(__linux__)
+    uint64_t one = 1;
+    write(fd, &one, sizeof(one));
+    #endif
+}
+
+void netlib::waker::drain()
+{
+    #if defined(__linux__)
+    uint64_t wakes = 0;
+    read(fd, &wakes, sizeof(wakes));
+    #endif
+}
+
+netlib::shared_buffer *netlib::make_shared_buffer(char *data, size_t size)
+{
+    shared_buffer *buffer = new shared_buffer;
+    buffer->refs = 1;
+    buffer->data = data;
+    buffer->size = size;
+    return buffer;
+}
+
+void netlib::retain_buffer(shared_buffer *buffer)
+{
+    buffer->refs.fetch_add(1, std::memory_order_relaxed);
+}
+
+void netlib::release_buffer(shared_buffer *buffer)
+{
+    if (buffer->refs.fetch_sub(1, std::memory_order_acq_rel) != 1)
+        return;
+    free(buffer->data);
+    delete buffer;
+}
+
+netlib::command netlib::file_command(int fd, char *header, size_t header_size, int file_fd, uint64_t offset, size_t length)
+{
+    command cmd = {.type = command_type::SEND_FILE, .fd = fd, .data = header, .size = header_size};
+    cmd.file_fd = dup(file_fd);
+    if (cmd.file_fd == -1)
+    {
+        std::println("File dup failed! {}", strerror(errno));
+        free(header);
+        cmd.data = nullptr;
+        return cmd;
+    }
+    cmd.offset = offset;
+    cmd.length = length;
+    return cmd;
+}
+
+void netlib::discard_command(command &cmd)
+{
+    switch (cmd.type)
+    {
+        case command_type::SEND:
+            free(cmd.data);
+            break;
+        case command_type::PUBLISH:
+            release_buffer(cmd.shared);
+            break;
+        case command_type::SEND_FILE:
+            free(cmd.data);
+            if (cmd.file_fd != -1)
+                close(cmd.file_fd);
+            break;
+        default:
+            break;
+    }
+}
+
+static void free_chunk(netlib::outbound_chunk &chunk)
+{
+    if (chunk.file_fd != -1)
+        close(chunk.file_fd);
+    else if (chunk.shared)
+        netlib::release_buffer(chunk.shared);
+    else
+        free(chunk.data);
+}
+
+void netlib::outbound_queue::push(char *data, size_t size)
+{
+    chunks.push_back({data, size, 0});
+    pending += size;
+}
+
+void netlib::outbound_queue::push_shared(shared_buffer *buffer, int topic)
+{
+    retain_buffer(buffer);
+    chunks.push_back({buffer->data, buffer->size, 0, buffer, topic});
+    pending += buffer->size;
+}
+
+// header may be null, otherwise it goes out in the same segment as the
+// start of the file
+void netlib::outbound_queue::push_file(char *header, size_t header_size, int file_fd, uint64_t offset, size_t length)
+{
+    if (header)
+    {
+        chunks.push_back({header, header_size, 0});
+        chunks.back().more = length > 0;
+        pending += header_size;
+    }
+    chunks.push_back({nullptr, length, 0});
+    chunks.back().file_fd = file_fd;
+    chunks.back().offset = offset;
+    pending += length;
+}
+
+// Drops the not yet started chunks of topic, returns how many went
+size_t netlib::outbound_queue::coalesce(int topic)
+{
+    size_t dropped = 0;
+    for (auto chunk = chunks.begin(); chunk != chunks.end();)
+    {
+        if (chunk->topic != topic || chunk->sent != 0)
+        {
+            chunk++;
+            continue;
+        }
+        pending -= chunk->size;
+        free_chunk(*chunk);
+        chunk = chunks.erase(chunk);
+        dropped++;
+    }
+    return dropped;
+}
+
+// Sends as much as the socket takes without blocking.
+// Returns 0 when everything went out, 1 if some is left, -1 on error.
+// A file that ends early is an error, the peer was promised its length
+int netlib::outbound_queue::flush(int fd, transport &net)
+{
+    while (!chunks.empty())
+    {
+        outbound_chunk &chunk = chunks.front();
+        ssize_t status;
+        if (chunk.file_fd != -1)
+        {
+            status = chunk.size == 0 ? 0 : net.send_file(fd, chunk.file_fd, chunk.offset + chunk.sent, chunk.size - chunk.sent);
+            if (status == 0 && chunk.size != 0)
+            {
+                errno = EIO;
+                status = -1;
+            }
+        }
+        else
+            status = net.send(fd, chunk.data + chunk.sent, chunk.size - chunk.sent, MSG_DONTWAIT | (chunk.more ? MSG_MORE : 0));
+        if (status == -1)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+                return 1;
+            return -1;
+        }
+        chunk.sent += status;
+        pending -= status;
+        if (chunk.sent < chunk.size)
+            return 1;
+        free_chunk(chunk);
+        chunks.pop_front();
+    }
+    return 0;
+}
+
+// Appends the bytes not sent yet to out and empties the queue, queued
+// files are read in
+void netlib::outbound_queue::drain_to(std::string &out)
+{
+    for (auto &chunk : chunks)
+    {
+        if (chunk.file_fd == -1)
+        {
+            out.append(chunk.data + chunk.sent, chunk.size - chunk.sent);
+            continue;
+        }
+        size_t start = out.size();
+        out.resize(start + chunk.size - chunk.sent);
+        ssize_t status = pread(chunk.file_fd, out.data() + start, chunk.size - chunk.sent, chunk.offset + chunk.sent);
+        out.resize(start + (status > 0 ? status : 0));
+    }
+    clear();
+}
+
+void netlib::outbound_queue::clear()
+{
+    for (auto &chunk : chunks)
+        free_chunk(chunk);
+    chunks.clear();
+    pending = 0;
+}
+
+static void run_command(netlib::command &cmd, const netlib::command_handlers &handlers, std::vector<std::function<void()>> &calls, bool &running)
+{
+    using netlib::command_type;
+    switch (cmd.type)
+    {
+        case command_type::SEND:
+        case command_type::SEND_FILE:
+        {
+            netlib::outbound_queue *queue = handlers.outbound ? handlers.outbound(cmd.fd) : nullptr;
+            if (!queue)
+            {
+                netlib::discard_command(cmd);
+                break;
+            }
+            // Only a file's header is recorded, the file never enters user space
+            if (handlers.record && cmd.data)
+                handlers.record(cmd.fd, cmd.data, cmd.size);
+            if (cmd.type == command_type::SEND)
+                queue->push(cmd.data, cmd.size);
+            else
+                queue->push_file(cmd.data, cmd.size, cmd.file_fd, cmd.offset, cmd.length);
+            if (handlers.flush)
+                handlers.flush(cmd.fd);
+            break;
+        }
+        case command_type::DISCONNECT:
+            if (handlers.disconnect)
+                handlers.disconnect(cmd.fd);
+            break;
+        case command_type::SET_TARGET:
+            if (handlers.set_target)
+                handlers.set_target(cmd.fd, cmd.size, cmd.permanent);
+            break;
+        case command_type::CALL:
+            calls.push_back(std::move(cmd.callback));
+            break;
+        case command_type::PUBLISH:
+            if (handlers.publish)
+                handlers.publish(cmd.topic, cmd.shared);
+            netlib::release_buffer(cmd.shared);
+            break;
+        case command_type::SHUTDOWN:
+            running = false;
+            break;
+    }
+}
+
+bool netlib::run_commands(mpsc_queue<command> &commands, const command_handlers &handlers, std::mutex *lock)
+{
+    std::vector<std::function<void()>> calls;
+    bool running = true;
+    command cmd;
+    if (lock)
+        lock->lock();
+    while (commands.pop(cmd))
+        run_command(cmd, handlers, calls, running);
+    if (lock)
+        lock->unlock();
+    for (auto &callback : calls)
+        callback();
+    return running;
+}
+
+int netlib::flush_outbound(outbound_queue &queue, int fd, transport &net, poller &poll_set, bool &write_interest, bool reading)
+{
+    int status = queue.flush(fd, net);
+    if (status == -1)
+        return -1;
+    bool wanted = status == 1;
+    if (write_interest != wanted)
+    {
+        poll_set.watch(fd, (reading ? TRANSPORT_READ : 0) | (wanted ? TRANSPORT_WRITE : 0));
+        write_interest = wanted;
+    }
+    return status;
+}
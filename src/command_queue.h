@@ -0,0 +1,214 @@
+#pragma once
+#include <sys/socket.h>
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstdlib>
+#include <unistd.h>
+#include <errno.h>
+#include "transport.h"
+#if defined(__APPLE__) || defined(__FreeBSD__)
+#include <sys/event.h>
+#elif defined(__linux__)
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+#ifndef MSG_MORE
+#define MSG_MORE 0
+#endif
+
+namespace netlib
+{
+    // Frees what a value still left in a queue owns, overloaded per type
+    template<typename T>
+    void discard_command(T &)
+    {
+    }
+
+    // Multi producer single consumer queue (Vyukov). Pushing is a single
+    // atomic exchange so any thread can post without taking the reactor lock,
+    // only the reactor thread may pop
+    template<typename T>
+    class mpsc_queue
+    {
+        public:
+            mpsc_queue()
+            {
+                tail = new node();
+                head.store(tail);
+            }
+            ~mpsc_queue()
+            {
+                T discard;
+                while (pop(discard))
+                    discard_command(discard);
+                delete tail;
+            }
+            mpsc_queue(const mpsc_queue &) = delete;
+            mpsc_queue &operator=(const mpsc_queue &) = delete;
+            void push(T value)
+            {
+                node *new_node = new node();
+                new_node->value = std::move(value);
+                node *prev = head.exchange(new_node, std::memory_order_acq_rel);
+                prev->next.store(new_node, std::memory_order_release);
+            }
+            bool pop(T &out)
+            {
+                node *next = tail->next.load(std::memory_order_acquire);
+                if (!next)
+                    return false;
+                out = std::move(next->value);
+                delete tail;
+                tail = next;
+                return true;
+            }
+        private:
+            struct node
+            {
+                std::atomic<node *> next = nullptr;
+                T value;
+            };
+            std::atomic<node *> head;
+            node *tail;
+    };
+
+    enum class command_type
+    {
+        SEND,
+        DISCONNECT,
+        SET_TARGET,
+        CALL,
+        PUBLISH,
+        SEND_FILE,
+        SHUTDOWN
+    };
+
+    // Encoded once and queued to many connections, the last release frees it
+    struct shared_buffer
+    {
+        std::atomic_size_t refs;
+        char *data;
+        size_t size;
+    };
+
+    shared_buffer *make_shared_buffer(char *data, size_t size);
+    void retain_buffer(shared_buffer *buffer);
+    void release_buffer(shared_buffer *buffer);
+
+    struct command
+    {
+        command_type type = command_type::CALL;
+        int fd = 0;
+        char *data = nullptr;
+        size_t size = 0;
+        bool permanent = false;
+        std::function<void()> callback;
+        shared_buffer *shared = nullptr;
+        std::string topic;
+        int file_fd = -1;
+        uint64_t offset = 0;
+        size_t length = 0;
+    };
+
+    // Commands never processed, the reactor stopped first
+    void discard_command(command &cmd);
+
+    // SEND_FILE for fd with a dup of file_fd, so the caller may close its own
+    // right away. On failure header is freed and file_fd comes back -1
+    command file_command(int fd, char *header, size_t header_size, int file_fd, uint64_t offset, size_t length);
+
+    // eventfd on Linux, EVFILT_USER on kqueue. Lets other threads interrupt a
+    // reactor blocked in epoll_wait/kevent
+    class waker
+    {
+        public:
+            waker()
+            {
+                fd = -1;
+                epfd = -1;
+            }
+            ~waker()
+            {
+                if (fd != -1)
+                    close(fd);
+            }
+            void open(int reactor_fd);
+            void wake();
+            void drain();
+            int fd;
+        private:
+            int epfd;
+    };
+
+    // Either owns data or holds a reference on shared, topic is 0 outside pub/sub.
+    // A file chunk has no data, it owns file_fd and sends size bytes from offset.
+    // more holds the segment back for the chunk after it
+    struct outbound_chunk
+    {
+        char *data;
+        size_t size;
+        size_t sent;
+        shared_buffer *shared = nullptr;
+        int topic = 0;
+        int file_fd = -1;
+        uint64_t offset = 0;
+        bool more = false;
+    };
+
+    // Bytes waiting for the socket to become writable, owned by the reactor
+    struct outbound_queue
+    {
+        outbound_queue()
+        {
+            pending = 0;
+        }
+        ~outbound_queue()
+        {
+            clear();
+        }
+        std::deque<outbound_chunk> chunks;
+        size_t pending;
+        void push(char *data, size_t size);
+        void push_shared(shared_buffer *buffer, int topic = 0);
+        void push_file(char *header, size_t header_size, int file_fd, uint64_t offset, size_t length);
+        size_t coalesce(int topic);
+        int flush(int fd, transport &net = default_transport());
+        void drain_to(std::string &out);
+        void clear();
+        bool empty() { return chunks.empty(); }
+    };
+
+    // What a reactor plugs into run_commands. outbound is the queue of fd,
+    // null once the connection is gone, flush sends what was just queued on
+    // it. Commands whose hook is empty are dropped
+    struct command_handlers
+    {
+        std::function<outbound_queue *(int fd)> outbound;
+        std::function<void(int fd)> flush;
+        // Sees every SEND and SEND_FILE header before it is queued
+        std::function<void(int fd, const char *data, size_t size)> record;
+        std::function<void(int fd)> disconnect;
+        std::function<void(int fd, size_t size, bool permanent)> set_target;
+        // buffer is released afterwards, retain it to keep it
+        std::function<void(const std::string &topic, shared_buffer *buffer)> publish;
+    };
+
+    // Runs every queued command with lock held, when there is one, then the
+    // CALLs after releasing it so they may take it themselves. false once
+    // a SHUTDOWN came through
+    bool run_commands(mpsc_queue<command> &commands, const command_handlers &handlers, std::mutex *lock = nullptr);
+
+    // Flushes queue and keeps fd's write interest in step with what is left,
+    // reading is whether read interest stays on. Returns the flush status,
+    // on -1 the connection is the caller's to drop
+    int flush_outbound(outbound_queue &queue, int fd, transport &net, poller &poll_set, bool &write_interest, bool reading = true);
+}
@@ -1,8 +1,10 @@
+#pragma once
 #include <concepts>
 #include <cstring>
 #include <tuple>
 #include <stdlib.h>
 #include "utils.h"
+#include "byte_order.h"
 #ifdef __FreeBSD__
 #include <sys/endian.h>
 #endif
@@ -24,44 +26,25 @@
 #define be64toh(x) OSSwapBigToHostInt64(x)
 #define le64toh(x) OSSwapLittleToHostInt64(x)
 #endif
-#define read_comp_pkt(size, ptr, t) const_for_<size>([&](auto i){std::get<i.value>(t) = read_var<std::tuple_element_t<i.value, decltype(t)>>::call(&ptr);});
+#define read_comp_pkt(size, ptr, t, order) const_for_<size>([&](auto i){std::get<i.value>(t) = read_var<std::tuple_element_t<i.value, decltype(t)>, order>::call(&ptr);});
 
-template <typename T>
+template <typename T, typename Order = netlib::wire_order>
 T read_type(char *v)
 {
     T a;
 
     std::memcpy(&a, v, sizeof(T));
-    switch (sizeof(T))
-    {
-        case 1:
-            break;
-        case 2:
-            a = be16toh(a);
-            break;
-        case 4:
-            a = be32toh(a);
-            break;
-        case 8:
-            a = be64toh(a);
-            break;
-    }
-    return a;
+    return netlib::swap_order<Order>(a);
 }
-template<>
-float read_type<float>(char *v);
-
-template<>
-double read_type<double>(char *v);
 
-template<typename T>
+template<typename T, typename Order = netlib::wire_order>
 struct read_var
 {
     static T call(char_size* v)
     {
         if (sizeof(T) + v->consumed_size > v->max_size)
             return T{};
-        T ret = read_type<T>(v->data);
+        T ret = read_type<T, Order>(v->data);
         v->data += sizeof(T);
         v->consumed_size += sizeof(T);
         return ret;
@@ -69,8 +52,8 @@ struct read_var
 };
 
 
-template<typename ...T>
-struct read_var<std::tuple<T...>>
+template<typename Order, typename ...T>
+struct read_var<std::tuple<T...>, Order>
 {
     static std::tuple<T...> call(char_size *v)
     {
@@ -79,7 +62,7 @@ struct read_var<std::tuple<T...>>
         if (size + v->consumed_size > v->max_size)
             return std::tuple<T...>{};
         char *diff = v->data;
-        ret = read_comp_pkt(size, diff, ret);
+        ret = read_comp_pkt(size, diff, ret, Order);
         int size_diff =(diff - v->data); 
         v->consumed_size += size_diff;
         v->data += size_diff;
@@ -100,12 +83,12 @@ template <auto N, typename F> constexpr void const_for_(F&& func)
 
 namespace netlib
 {
-    template<typename ...T>
+    template<typename Order = wire_order, typename ...T>
     std::tuple<T...> read_packet(std::tuple<T...> packet, struct packet pkt)
     {
         char_size buff = {.data = pkt.data, .consumed_size = 0, .max_size = (int)pkt.size, .start_data = pkt.data};
         constexpr std::size_t size = std::tuple_size_v<decltype(packet)>;
-        read_comp_pkt(size, buff, packet);
+        read_comp_pkt(size, buff, packet, Order);
         return packet;
     }
 }
\ No newline at end of file
@@ -4,9 +4,12 @@
 #include <cstring>
 #include <tuple>
 #include <bitset>
+#include <vector>
+#include <type_traits>
 #include <unistd.h>
 #include <print>
 #include "utils.h"
+#include "byte_order.h"
 #ifdef __FreeBSD__
 #include <sys/endian.h>
 #endif
@@ -30,7 +33,7 @@
 #define le64toh(x) OSSwapLittleToHostInt64(x)
 #endif
 
-#define write_comp_pkt(size, ptr, t) const_for<size>([&](auto i){write_var<std::tuple_element_t<i.value, decltype(t)>>::call(&ptr, std::get<i.value>(t));});
+#define write_comp_pkt(size, ptr, t, order) const_for<size>([&](auto i){write_var<std::remove_cvref_t<std::tuple_element_t<i.value, std::remove_cvref_t<decltype(t)>>>, order>::call(&ptr, std::get<i.value>(t));});
 
 template <typename Integer, Integer ...I, typename F> constexpr void const_for_each(std::integer_sequence<Integer, I...>, F&& func)
 {
@@ -43,36 +46,18 @@ template <auto N, typename F> constexpr void const_for(F&& func)
         const_for_each(std::make_integer_sequence<decltype(N), N>{}, std::forward<F>(func));
 } 
 
-template <typename T>
+template <typename T, typename Order = netlib::wire_order>
 void write_type(char *v, T value)
 {
-    switch (sizeof(T))
-    {
-        case 2:
-        {
-            uint16_t conv = htobe16((*(uint16_t *)&value));
-            std::memcpy(v, &conv, sizeof(T));
-            break;
-        }
-        case 4:
-        {
-            uint32_t conv = htobe32((*(uint32_t *)&value));
-            std::memcpy(v, &conv, sizeof(T));
-            break;
-        }
-        case 8:
-        {
-            uint64_t conv = htobe64((*(uint64_t *)&value));
-            std::memcpy(v, &conv, sizeof(T));
-            break;
-        }
-        default:
-            std::memcpy(v, &value, sizeof(T));
-    }
+    value = netlib::swap_order<Order>(value);
+    std::memcpy(v, &value, sizeof(T));
 }
 
 template <int size, typename T>
-void write_array(char *v, T value);
+void write_array(char *v, T value)
+{
+    std::memcpy(v, value, size);
+}
 
 template<typename T>
 concept arithmetic = std::integral<T> or std::floating_point<T>;
@@ -83,7 +68,7 @@ concept IsChar = std::same_as<T, char *>;
 template<typename T>
 concept IsPointer = std::is_pointer_v<T>;
 
-template<typename T>
+template<typename T, typename Order = netlib::wire_order>
 struct write_var
 {
     static void call(char_size *v, T value) requires (arithmetic<T>)
@@ -94,26 +79,26 @@ struct write_var
             v->max_size += 1024;
             v->data = v->start_data + v->consumed_size;
         }
-        write_type<T>(v->data, value);
+        write_type<T, Order>(v->data, value);
         v->data += sizeof(T);
         v->consumed_size += sizeof(T);
     }
 };
 
-template<typename ...T>
-struct write_var<std::tuple<T...>>
+template<typename Order, typename ...T>
+struct write_var<std::tuple<T...>, Order>
 {
-    static void call(char_size *v, std::tuple<T...> value)
+    static void call(char_size *v, const std::tuple<T...> &value)
     {
-        constexpr std::size_t size = std::tuple_size_v<decltype(value)>;
-        write_comp_pkt(size, *v, value);
+        constexpr std::size_t size = sizeof...(T);
+        write_comp_pkt(size, *v, value, Order);
     }
 };
 
-template<>
-struct write_var<std::string>
+template<typename Order>
+struct write_var<std::string, Order>
 {
-    static void call(char_size *v, std::string value)
+    static void call(char_size *v, const std::string &value)
     {
         while (v->consumed_size >= v->max_size || v->consumed_size + value.size() >= v->max_size)
         {
@@ -128,10 +113,10 @@ struct write_var<std::string>
 };
 
 
-template<>
-struct write_var<char_size>
+template<typename Order>
+struct write_var<char_size, Order>
 {
-    static void call(char_size *v, char_size value)
+    static void call(char_size *v, const char_size &value)
     {
         while (v->consumed_size >= v->max_size || v->consumed_size + value.consumed_size >= v->max_size)
         {
@@ -145,32 +130,43 @@ struct write_var<char_size>
     }
 };
 
-template<typename T>
-struct write_var<std::vector<T, std::allocator<T>>>
+template<typename T, typename Order>
+struct write_var<std::vector<T, std::allocator<T>>, Order>
 {
-    static void call(char_size *v, std::vector<T, std::allocator<T>> value)
+    static void call(char_size *v, const std::vector<T, std::allocator<T>> &value)
     {
-        for (auto val : value)
-        {
-            std::tuple<T> va = val;
-            constexpr std::size_t size = std::tuple_size_v<decltype(va)>;
-            write_comp_pkt(size, *v, va);
-        }
+        for (const auto &val : value)
+            write_var<T, Order>::call(v, val);
     }
 };
 
 namespace netlib
 {
-    template<typename ...T>
-    int send_packet(std::tuple<T...> packet, int sock)
+    // Serializes into a malloc'd buffer, the caller owns buff.start_data.
+    // start_data is null when a field couldn't be encoded
+    template<typename Order = wire_order, typename ...T>
+    char_size encode_packet(std::tuple<T...> packet)
     {
         char *buffer = (char *)malloc(1024 * sizeof(char));
-        char *start_buffer = buffer;
         constexpr std::size_t size = std::tuple_size_v<decltype(packet)>;
-        char_size buff = {buffer, 0, 1024, start_buffer};
-        write_comp_pkt(size, buff, packet);
+        char_size buff = {buffer, 0, 1024, buffer};
+        write_comp_pkt(size, buff, packet, Order);
+        if (buff.failed)
+        {
+            free(buff.start_data);
+            return {nullptr, 0, 0, nullptr, true};
+        }
+        return buff;
+    }
 
-        int ret = send(sock, buff.start_data, buff.consumed_size, 0);
+    template<typename Order = wire_order, typename ...T>
+    int send_packet(std::tuple<T...> packet, int sock)
+    {
+        char_size buff = encode_packet<Order>(packet);
+        if (!buff.start_data)
+            return -1;
+
+        int ret = send_whole(sock, buff.start_data, buff.consumed_size, 0);
         std::println("Sent {}B", ret);
         free(buff.start_data);
         
@@ -178,5 +174,14 @@ namespace netlib
     }
 }
 
-template<typename ...T>
-int write_to_file(std::tuple<T...> packet, int fd);
\ No newline at end of file
+// Appends the encoded packet to fd, see capture.h for recording whole sessions
+template<typename Order = netlib::wire_order, typename ...T>
+int write_to_file(std::tuple<T...> packet, int fd)
+{
+    char_size buff = netlib::encode_packet<Order>(packet);
+    if (!buff.start_data)
+        return -1;
+    int ret = write(fd, buff.start_data, buff.consumed_size);
+    free(buff.start_data);
+    return ret;
+}
\ No newline at end of file
@@ -0,0 +1,339 @@
+#include "compress.h"
+#include <algorithm>
+#include <unordered_map>
+#include <unordered_set>
+#include "comp_time_read.h"
+
+#define LZ_MIN_MATCH 4
+#define LZ_LAST_LITERALS 5
+#define LZ_MATCH_LIMIT 12
+
+static uint32_t read32(const char *data)
+{
+    uint32_t value;
+    memcpy(&value, data, sizeof(value));
+    return value;
+}
+
+static uint32_t lz_hash(uint32_t value)
+{
+    return (value * 2654435761u) >> (32 - LZ_HASH_LOG);
+}
+
+static uint32_t fnv1a(const std::string &data)
+{
+    uint32_t hash = 2166136261u;
+    for (unsigned char c : data)
+    {
+        hash ^= c;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+netlib::dictionary netlib::make_dictionary(std::string data)
+{
+    if (data.size() > LZ_WINDOW)
+        data.erase(0, data.size() - LZ_WINDOW);
+    dictionary dict;
+    dict.id = fnv1a(data);
+    if (dict.id == 0)
+        dict.id = 1;
+    // Positions + 1 of the dictionary's 4 byte sequences, copied into the
+    // compressor's table so it starts out knowing them
+    dict.table.assign(1 << LZ_HASH_LOG, 0);
+    for (size_t pos = 0; pos + LZ_MIN_MATCH <= data.size(); pos++)
+        dict.table[lz_hash(read32(data.data() + pos))] = pos + 1;
+    dict.data = std::move(data);
+    return dict;
+}
+
+netlib::dictionary netlib::train_dictionary(const std::vector<std::string_view> &samples, size_t max_size)
+{
+    const size_t window = 8;
+    const size_t piece = 32;
+    std::unordered_map<uint64_t, uint32_t> counts;
+    for (auto sample : samples)
+    {
+        std::unordered_set<uint64_t> seen;
+        for (size_t pos = 0; pos + window <= sample.size(); pos++)
+        {
+            uint64_t key;
+            memcpy(&key, sample.data() + pos, window);
+            if (seen.insert(key).second)
+                counts[key]++;
+        }
+    }
+
+    struct scored
+    {
+        size_t score;
+        std::string_view data;
+    };
+    std::vector<scored> pieces;
+    for (auto sample : samples)
+    {
+        for (size_t offset = 0; offset + window <= sample.size(); offset += piece)
+        {
+            std::string_view current = sample.substr(offset, piece);
+            size_t score = 0;
+            for (size_t pos = 0; pos + window <= current.size(); pos++)
+            {
+                uint64_t key;
+                memcpy(&key, current.data() + pos, window);
+                uint32_t count = counts[key];
+                if (count > 1)
+                    score += count;
+            }
+            if (score > 0)
+                pieces.push_back({score, current});
+        }
+    }
+    std::stable_sort(pieces.begin(), pieces.end(), [](const scored &a, const scored &b) { return a.score > b.score; });
+
+    std::vector<std::string_view> chosen;
+    std::unordered_set<std::string_view> unique;
+    size_t total = 0;
+    for (auto &current : pieces)
+    {
+        if (total + current.data.size() > max_size)
+            break;
+        if (!unique.insert(current.data).second)
+            continue;
+        chosen.push_back(current.data);
+        total += current.data.size();
+    }
+    // Shorter offsets for the pieces most likely to match
+    std::string data;
+    data.reserve(total);
+    for (auto piece_data = chosen.rbegin(); piece_data != chosen.rend(); piece_data++)
+        data.append(*piece_data);
+    return make_dictionary(std::move(data));
+}
+
+size_t netlib::compress_bound(size_t size)
+{
+    return size + size / 255 + 16;
+}
+
+static bool put_length(char *dst, size_t capacity, size_t &out, size_t length)
+{
+    while (length >= 255)
+    {
+        if (out >= capacity)
+            return false;
+        dst[out++] = (char)255;
+        length -= 255;
+    }
+    if (out >= capacity)
+        return false;
+    dst[out++] = (char)length;
+    return true;
+}
+
+static bool put_sequence(char *dst, size_t capacity, size_t &out, const char *literals, size_t literal_size, size_t offset, size_t match_size)
+{
+    if (out >= capacity)
+        return false;
+    size_t token = out++;
+    size_t match_code = match_size ? match_size - LZ_MIN_MATCH : 0;
+    dst[token] = (char)(((literal_size < 15 ? literal_size : 15) << 4) | (match_code < 15 ? match_code : 15));
+    if (literal_size >= 15 && !put_length(dst, capacity, out, literal_size - 15))
+        return false;
+    if (out + literal_size > capacity)
+        return false;
+    memcpy(dst + out, literals, literal_size);
+    out += literal_size;
+    if (!match_size)
+        return true;
+    if (out + 2 > capacity)
+        return false;
+    dst[out++] = (char)(offset & 0xff);
+    dst[out++] = (char)(offset >> 8);
+    if (match_code >= 15 && !put_length(dst, capacity, out, match_code - 15))
+        return false;
+    return true;
+}
+
+// Compresses base[start, end), base[0, start) being history matches may reach into
+static size_t compress_block(const char *base, size_t start, size_t end, char *dst, size_t capacity, const uint32_t *primed)
+{
+    uint32_t table[1 << LZ_HASH_LOG];
+    if (primed)
+        memcpy(table, primed, sizeof(table));
+    else
+        memset(table, 0, sizeof(table));
+
+    size_t out = 0;
+    size_t anchor = start;
+    size_t pos = start;
+    if (end - start >= LZ_MATCH_LIMIT + 1)
+    {
+        size_t match_limit = end - LZ_MATCH_LIMIT;
+        size_t match_end = end - LZ_LAST_LITERALS;
+        while (pos < match_limit)
+        {
+            uint32_t sequence = read32(base + pos);
+            uint32_t hash = lz_hash(sequence);
+            size_t candidate = table[hash];
+            table[hash] = pos + 1;
+            if (!candidate || pos - (candidate - 1) > LZ_WINDOW || read32(base + candidate - 1) != sequence)
+            {
+                // Skip faster through data that doesn't compress
+                pos += 1 + ((pos - anchor) >> 6);
+                continue;
+            }
+            size_t match = candidate - 1;
+            while (pos > anchor && match > 0 && base[pos - 1] == base[match - 1])
+            {
+                pos--;
+                match--;
+            }
+            size_t length = LZ_MIN_MATCH;
+            while (pos + length < match_end && base[pos + length] == base[match + length])
+                length++;
+            if (!put_sequence(dst, capacity, out, base + anchor, pos - anchor, pos - match, length))
+                return 0;
+            pos += length;
+            anchor = pos;
+            if (pos - 2 >= start && pos < match_limit)
+                table[lz_hash(read32(base + pos - 2))] = pos - 1;
+        }
+    }
+    if (!put_sequence(dst, capacity, out, base + anchor, end - anchor, 0, 0))
+        return 0;
+    return out;
+}
+
+size_t netlib::lz_compress(const char *src, size_t size, char *dst, size_t capacity, const dictionary *dict)
+{
+    if (!dict || dict->data.empty())
+        return compress_block(src, 0, size, dst, capacity, nullptr);
+    // The dictionary has to sit right before the data
+    thread_local std::vector<char> scratch;
+    scratch.resize(dict->data.size() + size);
+    memcpy(scratch.data(), dict->data.data(), dict->data.size());
+    memcpy(scratch.data() + dict->data.size(), src, size);
+    return compress_block(scratch.data(), dict->data.size(), scratch.size(), dst, capacity, dict->table.data());
+}
+
+static bool get_length(const unsigned char *&in, const unsigned char *end, size_t &length)
+{
+    unsigned char byte;
+    do
+    {
+        if (in >= end)
+            return false;
+        byte = *in++;
+        length += byte;
+    } while (byte == 255);
+    return true;
+}
+
+int netlib::lz_decompress(const char *src, size_t size, char *dst, size_t raw_size, const dictionary *dict)
+{
+    const unsigned char *in = (const unsigned char *)src;
+    const unsigned char *end = in + size;
+    const char *history = dict ? dict->data.data() : nullptr;
+    size_t history_size = dict ? dict->data.size() : 0;
+    size_t out = 0;
+
+    while (in < end)
+    {
+        unsigned char token = *in++;
+        size_t literal_size = token >> 4;
+        if (literal_size == 15 && !get_length(in, end, literal_size))
+            return -1;
+        if (literal_size > (size_t)(end - in) || out + literal_size > raw_size)
+            return -1;
+        memcpy(dst + out, in, literal_size);
+        in += literal_size;
+        out += literal_size;
+        if (in == end)
+            break;
+
+        if (end - in < 2)
+            return -1;
+        size_t offset = in[0] | (in[1] << 8);
+        in += 2;
+        size_t match_size = token & 15;
+        if (match_size == 15 && !get_length(in, end, match_size))
+            return -1;
+        match_size += LZ_MIN_MATCH;
+        if (offset == 0 || offset > out + history_size || out + match_size > raw_size)
+            return -1;
+
+        if (offset > out)
+        {
+            // Starts in the dictionary
+            size_t from_history = std::min(offset - out, match_size);
+            memcpy(dst + out, history + history_size - (offset - out), from_history);
+            out += from_history;
+            match_size -= from_history;
+        }
+        char *copy = dst + out;
+        const char *from = copy - offset;
+        if (offset >= match_size)
+            memcpy(copy, from, match_size);
+        else
+            for (size_t i = 0; i < match_size; i++)
+                copy[i] = from[i];
+        out += match_size;
+    }
+    return out == raw_size ? (int)raw_size : -1;
+}
+
+void netlib::compression::add_dictionary(dictionary dict, bool use_for_sending)
+{
+    if (use_for_sending)
+        send_dictionary = dict.id;
+    dictionaries[dict.id] = std::move(dict);
+}
+
+char_size netlib::compression::compress(const char *body, size_t size) const
+{
+    const dictionary *dict = nullptr;
+    auto dict_test = dictionaries.find(send_dictionary);
+    if (dict_test != dictionaries.end())
+        dict = &dict_test->second;
+
+    size_t capacity = 8 + compress_bound(size);
+    char *out = (char *)malloc(capacity);
+    size_t compressed = lz_compress(body, size, out + 8, std::min(capacity - 8, size), dict);
+    if (compressed == 0 || compressed + 8 >= size)
+    {
+        free(out);
+        return {nullptr, 0, 0, nullptr};
+    }
+    write_type<uint32_t>(out, dict ? dict->id : 0);
+    write_type<uint32_t>(out + 4, (uint32_t)size);
+    return {out + 8 + compressed, (int)(8 + compressed), (int)capacity, out};
+}
+
+char *netlib::compression::decompress(const char *body, size_t size, size_t headroom, size_t &raw_size, size_t max_raw) const
+{
+    if (size < 8)
+        return nullptr;
+    uint32_t id = read_type<uint32_t>((char *)body);
+    raw_size = read_type<uint32_t>((char *)body + 4);
+    if (raw_size > max_raw)
+        return nullptr;
+    const dictionary *dict = nullptr;
+    if (id != 0)
+    {
+        auto dict_test = dictionaries.find(id);
+        if (dict_test == dictionaries.end())
+        {
+            std::println("Unknown compression dictionary {}", id);
+            return nullptr;
+        }
+        dict = &dict_test->second;
+    }
+    char *out = (char *)malloc(headroom + raw_size + 1);
+    if (lz_decompress(body + 8, size - 8, out + headroom, raw_size, dict) < 0)
+    {
+        free(out);
+        return nullptr;
+    }
+    return out;
+}
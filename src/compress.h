@@ -0,0 +1,100 @@
+#pragma once
+#include <concepts>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "comp_time_write.h"
+
+#ifndef COMPRESS_THRESHOLD
+#define COMPRESS_THRESHOLD 256
+#endif
+#ifndef MAX_DECOMPRESSED_SIZE
+#define MAX_DECOMPRESSED_SIZE (8192 * 8)
+#endif
+#define LZ_HASH_LOG 12
+#define LZ_WINDOW 65535
+
+// LZ4 style block codec: sequences of [token][literals][uint16 offset][match],
+// greedy hash matching, 64KB window. A preset dictionary is treated as the
+// bytes right before the data so repetitive small packets still find matches
+namespace netlib
+{
+    struct dictionary
+    {
+        uint32_t id;
+        std::string data;
+        std::vector<uint32_t> table;
+    };
+
+    // Ids are a hash of the contents so both ends can check they agree
+    dictionary make_dictionary(std::string data);
+    // Keeps the 32 byte pieces of samples whose contents recur across the
+    // most samples, the most common ones last
+    dictionary train_dictionary(const std::vector<std::string_view> &samples, size_t max_size = 16384);
+
+    size_t compress_bound(size_t size);
+    // Returns the compressed size, 0 if it doesn't fit in capacity
+    size_t lz_compress(const char *src, size_t size, char *dst, size_t capacity, const dictionary *dict = nullptr);
+    // Returns raw_size, -1 if src is corrupt or doesn't expand to exactly raw_size
+    int lz_decompress(const char *src, size_t size, char *dst, size_t raw_size, const dictionary *dict = nullptr);
+
+    // Compressed bodies are [uint32 dictionary id][uint32 raw size][block],
+    // id 0 being no dictionary. Both ends add the same dictionaries
+    struct compression
+    {
+        size_t threshold = COMPRESS_THRESHOLD;
+        uint32_t send_dictionary = 0;
+        std::map<uint32_t, dictionary> dictionaries;
+        void add_dictionary(dictionary dict, bool use_for_sending = true);
+        // malloc'd compressed body, start_data is null when it wouldn't shrink
+        char_size compress(const char *body, size_t size) const;
+        // malloc'd body with headroom free bytes in front, null on failure
+        char *decompress(const char *body, size_t size, size_t headroom, size_t &raw_size, size_t max_raw = MAX_DECOMPRESSED_SIZE) const;
+    };
+
+    // Top bit of a server<T> size header, set when the body is compressed
+    template<std::integral T>
+    constexpr T compressed_flag = (T)((std::make_unsigned_t<T>)1 << (sizeof(T) * 8 - 1));
+
+    // Encodes packet as a server<T> frame, [T body size][body], compressing
+    // bodies over options->threshold when that makes them smaller
+    template<typename T, typename Order = wire_order, typename ...U>
+    char_size encode_framed(std::tuple<U...> packet, const compression *options = nullptr)
+    {
+        static_assert(sizeof(T) > 1, "compressed frames need at least a 16 bit header");
+        char_size buff = netlib::encode_packet<Order>(std::tuple_cat(std::make_tuple((T)0), packet));
+        if (!buff.start_data)
+            return buff;
+        size_t body_size = buff.consumed_size - sizeof(T);
+        T flag = 0;
+        if (options && body_size >= options->threshold)
+        {
+            char_size compressed = options->compress(buff.start_data + sizeof(T), body_size);
+            if (compressed.start_data)
+            {
+                char *framed = (char *)malloc(sizeof(T) + compressed.consumed_size);
+                memcpy(framed + sizeof(T), compressed.start_data, compressed.consumed_size);
+                free(compressed.start_data);
+                free(buff.start_data);
+                body_size = compressed.consumed_size;
+                buff = {framed + sizeof(T) + body_size, (int)(sizeof(T) + body_size), (int)(sizeof(T) + body_size), framed};
+                flag = compressed_flag<T>;
+            }
+        }
+        write_type<T, Order>(buff.start_data, (T)body_size | flag);
+        return buff;
+    }
+
+    template<typename T, typename Order = wire_order, typename ...U>
+    int send_framed(std::tuple<U...> packet, int sock, const compression *options = nullptr)
+    {
+        char_size buff = encode_framed<T, Order>(packet, options);
+        if (!buff.start_data)
+            return -1;
+        int ret = send_whole(sock, buff.start_data, buff.consumed_size, 0);
+        free(buff.start_data);
+        return ret;
+    }
+}
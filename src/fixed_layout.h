@@ -0,0 +1,138 @@
+#pragma once
+#include <array>
+#include <tuple>
+#include <type_traits>
+#include "aggregate.h"
+
+// Compile time layout of packets made only of fixed size fields: arithmetic
+// types, and tuples or aggregates of them. Size and offsets are constants so
+// decoding is one length check and a load per field at a known offset:
+//
+//     using move = std::tuple<uint8_t, uint32_t, float, float>;
+//     static_assert(netlib::fixed_layout<move>::size == 13);
+//     static_assert(netlib::fixed_layout<move>::offset<2> == 5);
+namespace netlib
+{
+    template<typename T>
+    struct is_tuple : std::false_type {};
+
+    template<typename ...T>
+    struct is_tuple<std::tuple<T...>> : std::true_type {};
+
+    template<typename T>
+    struct decay_tuple;
+
+    template<typename ...T>
+    struct decay_tuple<std::tuple<T...>>
+    {
+        using type = std::tuple<std::remove_cvref_t<T>...>;
+    };
+
+    // The fields of an aggregate as a tuple of values
+    template<typename S>
+    using struct_tuple = typename decay_tuple<field_types<S>>::type;
+
+    template<typename T>
+    constexpr bool is_fixed();
+
+    template<typename ...T>
+    constexpr bool all_fixed(std::tuple<T...> *)
+    {
+        return (is_fixed<T>() && ...);
+    }
+
+    template<typename T>
+    constexpr bool is_fixed()
+    {
+        if constexpr (arithmetic<T>)
+            return true;
+        else if constexpr (is_tuple<T>::value)
+            return all_fixed((T *)nullptr);
+        else if constexpr (wire_struct<T>)
+            return all_fixed((struct_tuple<T> *)nullptr);
+        else
+            return false;
+    }
+
+    template<typename T>
+    constexpr size_t wire_size();
+
+    template<typename ...T>
+    constexpr size_t total_wire_size(std::tuple<T...> *)
+    {
+        return (wire_size<T>() + ... + 0);
+    }
+
+    template<typename T>
+    constexpr size_t wire_size()
+    {
+        if constexpr (arithmetic<T>)
+            return sizeof(T);
+        else if constexpr (is_tuple<T>::value)
+            return total_wire_size((T *)nullptr);
+        else
+            return total_wire_size((struct_tuple<T> *)nullptr);
+    }
+
+    template<typename T, typename Order>
+    void load_fixed(const char *data, T &out);
+
+    template<typename Tuple>
+    struct fixed_layout;
+
+    template<typename ...T>
+    struct fixed_layout<std::tuple<T...>>
+    {
+        static_assert((is_fixed<T>() && ...), "fixed_layout takes arithmetic fields, or tuples and aggregates of them");
+        static constexpr size_t size = (wire_size<T>() + ... + 0);
+        static constexpr std::array<size_t, sizeof...(T)> offsets = []
+        {
+            std::array<size_t, sizeof...(T)> ret{};
+            constexpr size_t sizes[] = {wire_size<T>()..., 0};
+            size_t offset = 0;
+            for (size_t i = 0; i < sizeof...(T); i++)
+            {
+                ret[i] = offset;
+                offset += sizes[i];
+            }
+            return ret;
+        }();
+        template<size_t I>
+        static constexpr size_t offset = offsets[I];
+
+        // data must hold size bytes, out is the tuple or a tie of its fields
+        template<typename Order = wire_order, typename Fields>
+        static void load(const char *data, Fields &&out)
+        {
+            const_for_<sizeof...(T)>([&](auto i)
+            {
+                load_fixed<std::tuple_element_t<i.value, std::tuple<T...>>, Order>(data + offsets[i.value], std::get<i.value>(out));
+            });
+        }
+    };
+
+    template<typename T, typename Order>
+    void load_fixed(const char *data, T &out)
+    {
+        if constexpr (arithmetic<T>)
+            out = read_type<T, Order>((char *)data);
+        else if constexpr (is_tuple<T>::value)
+            fixed_layout<T>::template load<Order>(data, out);
+        else if constexpr (same_layout<T, Order>())
+            std::memcpy(&out, data, sizeof(T));
+        else
+            fixed_layout<struct_tuple<T>>::template load<Order>(data, field_tie(out));
+    }
+
+    // Decodes pkt into out, returns the bytes consumed or -1 when pkt is
+    // shorter than the layout, in which case out is left untouched
+    template<typename Order = wire_order, typename ...T>
+    int read_fixed(std::tuple<T...> &out, struct packet pkt)
+    {
+        using layout = fixed_layout<std::tuple<T...>>;
+        if (pkt.size < 0 || (size_t)pkt.size < layout::size)
+            return -1;
+        layout::template load<Order>(pkt.data, out);
+        return layout::size;
+    }
+}
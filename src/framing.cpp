@@ -0,0 +1,56 @@
+#include "framing.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+static size_t find_delimiter_scalar(const char *data, size_t size, const char *delim, size_t delim_size)
+{
+    size_t index = 0;
+
+    while (index + delim_size <= size)
+    {
+        const char *found = (const char *)memchr(data + index, delim[0], size - index - delim_size + 1);
+        if (!found)
+            return netlib::no_delimiter;
+        index = found - data;
+        if (memcmp(found + 1, delim + 1, delim_size - 1) == 0)
+            return index;
+        index++;
+    }
+    return netlib::no_delimiter;
+}
+
+size_t netlib::find_delimiter(const char *data, size_t size, const char *delim, size_t delim_size)
+{
+    if (delim_size == 0 || size < delim_size)
+        return no_delimiter;
+    if (delim_size == 1)
+    {
+        const char *found = (const char *)memchr(data, delim[0], size);
+        return found ? found - data : no_delimiter;
+    }
+    size_t index = 0;
+    #ifdef __SSE2__
+    // Compare the first and last delimiter bytes 16 positions at a time, only
+    // the candidates where both match need a full memcmp
+    const __m128i first = _mm_set1_epi8(delim[0]);
+    const __m128i last = _mm_set1_epi8(delim[delim_size - 1]);
+    for (; index + 16 + delim_size - 1 <= size; index += 16)
+    {
+        __m128i block_first = _mm_loadu_si128((const __m128i *)(data + index));
+        __m128i block_last = _mm_loadu_si128((const __m128i *)(data + index + delim_size - 1));
+        unsigned int mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(first, block_first), _mm_cmpeq_epi8(last, block_last)));
+        while (mask != 0)
+        {
+            int bit = __builtin_ctz(mask);
+            if (delim_size <= 2 || memcmp(data + index + bit + 1, delim + 1, delim_size - 2) == 0)
+                return index + bit;
+            mask &= mask - 1;
+        }
+    }
+    #endif
+    size_t found = find_delimiter_scalar(data + index, size - index, delim, delim_size);
+    if (found == no_delimiter)
+        return no_delimiter;
+    return index + found;
+}
@@ -0,0 +1,66 @@
+#pragma once
+#include <cstddef>
+#include <cstring>
+#include <string>
+#include <tuple>
+#include <type_traits>
+#include "comp_time_read.h"
+
+#ifndef MAX_PACKET_SIZE
+#define MAX_PACKET_SIZE 8192
+#endif
+
+namespace netlib
+{
+    constexpr size_t no_delimiter = (size_t)-1;
+
+    // Offset of the first occurrence of delim in data, or no_delimiter.
+    // Vectorized with SSE2 when available, memchr based otherwise
+    size_t find_delimiter(const char *data, size_t size, const char *delim, size_t delim_size);
+
+    // Runtime view of a length prefixed framing, header_size 0 means off
+    struct frame_policy
+    {
+        size_t header_size;
+        size_t (*frame_size)(char *header);
+        size_t max_frame_size;
+    };
+
+    template<size_t N, typename ...T>
+    constexpr size_t field_offset()
+    {
+        constexpr size_t sizes[] = {sizeof(T)..., 0};
+        size_t offset = 0;
+        for (size_t i = 0; i < N; i++)
+            offset += sizes[i];
+        return offset;
+    }
+
+    // Header layout declared as a tuple, the field at index N holds the body
+    // length (or the whole frame length with IncludesHeader). Example:
+    // netlib::length_prefix<std::tuple<uint8_t, uint32_t>, 1>::policy()
+    template<typename Header, size_t N, bool IncludesHeader = false, typename Order = wire_order>
+    struct length_prefix;
+
+    template<size_t N, bool IncludesHeader, typename Order, typename ...T>
+    struct length_prefix<std::tuple<T...>, N, IncludesHeader, Order>
+    {
+        using length_type = std::tuple_element_t<N, std::tuple<T...>>;
+        static_assert(std::is_integral_v<length_type>, "the length field must be an integer");
+        static constexpr size_t header_size = (sizeof(T) + ... + 0);
+        static constexpr size_t offset = field_offset<N, T...>();
+
+        static size_t frame_size(char *header)
+        {
+            size_t length = (size_t)read_type<length_type, Order>(header + offset);
+            if constexpr (IncludesHeader)
+                return length;
+            else
+                return length + header_size;
+        }
+        static frame_policy policy(size_t max_frame_size = MAX_PACKET_SIZE + header_size)
+        {
+            return {header_size, frame_size, max_frame_size};
+        }
+    };
+}
@@ -0,0 +1,241 @@
+#include "handoff.h"
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <errno.h>
+#include <cstring>
+#include <print>
+#include "varlen.h"
+
+using handoff_field = netlib::prefixed<std::string_view, uint32_t, HANDOFF_MAX_FIELD>;
+using handoff_record = std::tuple<uint32_t, uint8_t, uint8_t, uint64_t, uint64_t, uint64_t, uint64_t, handoff_field, handoff_field, handoff_field, handoff_field>;
+
+static bool unix_address(const std::string &path, sockaddr_un &addr)
+{
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path))
+    {
+        std::println("Unix socket path too long: {}", path);
+        return false;
+    }
+    memcpy(addr.sun_path, path.c_str(), path.size());
+    return true;
+}
+
+int netlib::listen_unix(const std::string &path, int backlog)
+{
+    sockaddr_un addr;
+    if (!unix_address(path, addr))
+        return -1;
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(path.c_str());
+    if (bind(sock, (sockaddr *)&addr, sizeof(addr)) == -1 || listen(sock, backlog) == -1)
+    {
+        std::println("Unix listen failed! {}", strerror(errno));
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+int netlib::connect_unix(const std::string &path)
+{
+    sockaddr_un addr;
+    if (!unix_address(path, addr))
+        return -1;
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (connect(sock, (sockaddr *)&addr, sizeof(addr)) == -1)
+    {
+        std::println("Unix connect failed! {}", strerror(errno));
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+static bool send_all(int sock, const char *data, size_t size)
+{
+    while (size > 0)
+    {
+        ssize_t status = send(sock, data, size, MSG_NOSIGNAL);
+        if (status == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        data += status;
+        size -= status;
+    }
+    return true;
+}
+
+static bool recv_all(int sock, char *data, size_t size)
+{
+    while (size > 0)
+    {
+        ssize_t status = recv(sock, data, size, 0);
+        if (status == -1 && errno == EINTR)
+            continue;
+        if (status <= 0)
+            return false;
+        data += status;
+        size -= status;
+    }
+    return true;
+}
+
+bool netlib::send_fd(int sock, int fd, const char *data, size_t size)
+{
+    iovec iov = {(void *)data, size};
+    char control[CMSG_SPACE(sizeof(int))] = {0};
+    msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    ssize_t status;
+    do
+        status = sendmsg(sock, &msg, MSG_NOSIGNAL);
+    while (status == -1 && errno == EINTR);
+    if (status == -1)
+    {
+        std::println("Sending fd failed! {}", strerror(errno));
+        return false;
+    }
+    // The descriptor went with the first byte, the rest can go as is
+    return send_all(sock, data + status, size - status);
+}
+
+bool netlib::recv_fd(int sock, int &fd, char *data, size_t size, int flags)
+{
+    fd = -1;
+    iovec iov = {data, size};
+    char control[CMSG_SPACE(sizeof(int))] = {0};
+    msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    ssize_t status;
+    do
+        status = recvmsg(sock, &msg, MSG_WAITALL | flags);
+    while (status == -1 && errno == EINTR);
+    if (status <= 0)
+        return false;
+    for (cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+            memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+    return recv_all(sock, data + status, size - status);
+}
+
+// [uint32 size] with fd attached, then the body
+static bool send_message(int sock, int fd, char_size body)
+{
+    if (!body.start_data)
+        return false;
+    char header[sizeof(uint32_t)];
+    write_type<uint32_t>(header, body.consumed_size);
+    bool sent = netlib::send_fd(sock, fd, header, sizeof(header)) && send_all(sock, body.start_data, body.consumed_size);
+    free(body.start_data);
+    return sent;
+}
+
+static char *recv_message(int sock, int &fd, uint32_t &size)
+{
+    char header[sizeof(uint32_t)];
+    if (!netlib::recv_fd(sock, fd, header, sizeof(header)))
+        return nullptr;
+    size = read_type<uint32_t>(header);
+    // size + 1 would wrap, and the body is read as an int sized packet
+    if (size > HANDOFF_MAX_FIELD)
+    {
+        std::println("Handoff message too large {}", size);
+        if (fd != -1)
+            close(fd);
+        return nullptr;
+    }
+    char *body = (char *)malloc(size + 1);
+    if (!recv_all(sock, body, size))
+    {
+        free(body);
+        if (fd != -1)
+            close(fd);
+        return nullptr;
+    }
+    return body;
+}
+
+bool netlib::send_handoff(int sock, int listener, const std::vector<handoff_connection> &connections)
+{
+    if (!send_message(sock, listener, encode_packet(std::make_tuple((uint32_t)HANDOFF_MAGIC, (uint32_t)connections.size()))))
+        return false;
+    for (auto &current : connections)
+    {
+        std::string topics;
+        for (auto &name : current.topics)
+            topics.append(name).push_back('\0');
+        handoff_record record = {HANDOFF_MAGIC, current.target, current.target_permanent, current.target_size,
+            current.idle_timeout, current.read_timeout, current.write_timeout, {current.data}, {current.outbound}, {current.delimiter}, {topics}};
+        if (!send_message(sock, current.fd, encode_packet(record)))
+            return false;
+    }
+    return true;
+}
+
+bool netlib::recv_handoff(int sock, int &listener, std::vector<handoff_connection> &connections)
+{
+    uint32_t size = 0;
+    char *body = recv_message(sock, listener, size);
+    if (!body)
+        return false;
+    struct packet pkt = {(int)size, (int)size, body, body};
+    auto [magic, count] = read_packet(std::tuple<uint32_t, uint32_t>{}, pkt);
+    free(body);
+    if (magic != HANDOFF_MAGIC || listener == -1)
+    {
+        std::println("Bad handoff header");
+        return false;
+    }
+    for (uint32_t i = 0; i < count; i++)
+    {
+        handoff_connection current;
+        body = recv_message(sock, current.fd, size);
+        if (!body)
+            return false;
+        pkt = {(int)size, (int)size, body, body};
+        auto [record_magic, target, permanent, target_size, idle, read, write, data, outbound, delimiter, topics] = read_packet(handoff_record{}, pkt);
+        if (record_magic != HANDOFF_MAGIC || current.fd == -1)
+        {
+            std::println("Bad handoff record");
+            if (current.fd != -1)
+                close(current.fd);
+            free(body);
+            return false;
+        }
+        current.target = target;
+        current.target_permanent = permanent;
+        current.target_size = target_size;
+        current.idle_timeout = idle;
+        current.read_timeout = read;
+        current.write_timeout = write;
+        current.data = data.value;
+        current.outbound = outbound.value;
+        current.delimiter = delimiter.value;
+        for (size_t start = 0; start < topics.value.size();)
+        {
+            size_t end = topics.value.find('\0', start);
+            current.topics.emplace_back(topics.value.substr(start, end - start));
+            start = end + 1;
+        }
+        free(body);
+        connections.push_back(std::move(current));
+    }
+    return true;
+}
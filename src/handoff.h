@@ -0,0 +1,42 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#define HANDOFF_MAGIC 0x4e4c484f
+#ifndef HANDOFF_MAX_FIELD
+#define HANDOFF_MAX_FIELD (1024 * 1024 * 1024)
+#endif
+
+// Passing a server's sockets to another process over an AF_UNIX socket.
+// Every message is a uint32 body size carrying one descriptor as SCM_RIGHTS,
+// then the body: first [magic][connection count] with the listener, then one
+// per connection with its buffered input, unsent output and settings.
+// Framing can't be passed, connections use the receiving server's framing
+namespace netlib
+{
+    struct handoff_connection
+    {
+        int fd;
+        std::string data;
+        std::string outbound;
+        bool target;
+        bool target_permanent;
+        uint64_t target_size;
+        uint64_t idle_timeout;
+        uint64_t read_timeout;
+        uint64_t write_timeout;
+        std::string delimiter;
+        std::vector<std::string> topics;
+    };
+
+    int listen_unix(const std::string &path, int backlog = 1);
+    int connect_unix(const std::string &path);
+    bool send_fd(int sock, int fd, const char *data, size_t size);
+    // fd is -1 when the message carried no descriptor. flags go to recvmsg,
+    // with MSG_DONTWAIT it fails with EAGAIN when nothing has arrived
+    bool recv_fd(int sock, int &fd, char *data, size_t size, int flags = 0);
+
+    bool send_handoff(int sock, int listener, const std::vector<handoff_connection> &connections);
+    bool recv_handoff(int sock, int &listener, std::vector<handoff_connection> &connections);
+}
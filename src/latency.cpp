@@ -0,0 +1,106 @@
+#include "latency.h"
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <errno.h>
+#include <chrono>
+#include <cstring>
+#include <print>
+#ifdef __FreeBSD__
+#include <pthread_np.h>
+#endif
+
+netlib::latency_profile netlib::low_latency(int cpu)
+{
+    latency_profile profile;
+    profile.cpu = cpu;
+    profile.spin_us = 50;
+    profile.busy_poll_us = 50;
+    profile.prefer_busy_poll = true;
+    profile.nodelay = true;
+    profile.quickack = true;
+    return profile;
+}
+
+bool netlib::pin_thread(int cpu)
+{
+    if (cpu < 0)
+        return true;
+    #if defined(__linux__) || defined(__FreeBSD__)
+    #ifdef __linux__
+    cpu_set_t set;
+    #else
+    cpuset_t set;
+    #endif
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    int status = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (status != 0)
+    {
+        std::println("Couldn't pin to cpu {}: {}", cpu, strerror(status));
+        return false;
+    }
+    return true;
+    #else
+    std::println("Thread pinning isn't supported here");
+    return false;
+    #endif
+}
+
+static void set_option(int fd, int level, int name, int value, const char *label)
+{
+    if (setsockopt(fd, level, name, &value, sizeof(value)) == -1)
+        std::println("Couldn't set {}: {}", label, strerror(errno));
+}
+
+void netlib::tune_socket(int fd, const latency_profile &profile)
+{
+    if (profile.nodelay)
+        set_option(fd, IPPROTO_TCP, TCP_NODELAY, 1, "TCP_NODELAY");
+    rearm_quickack(fd, profile);
+    if (profile.rcvbuf > 0)
+        set_option(fd, SOL_SOCKET, SO_RCVBUF, profile.rcvbuf, "SO_RCVBUF");
+    if (profile.sndbuf > 0)
+        set_option(fd, SOL_SOCKET, SO_SNDBUF, profile.sndbuf, "SO_SNDBUF");
+    #ifdef SO_BUSY_POLL
+    if (profile.busy_poll_us > 0)
+        set_option(fd, SOL_SOCKET, SO_BUSY_POLL, profile.busy_poll_us, "SO_BUSY_POLL");
+    #endif
+    #ifdef SO_PREFER_BUSY_POLL
+    if (profile.prefer_busy_poll)
+        set_option(fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, 1, "SO_PREFER_BUSY_POLL");
+    #endif
+}
+
+void netlib::rearm_quickack(int fd, const latency_profile &profile)
+{
+    #ifdef TCP_QUICKACK
+    if (profile.quickack)
+        set_option(fd, IPPROTO_TCP, TCP_QUICKACK, 1, "TCP_QUICKACK");
+    #endif
+}
+
+#ifdef __linux__
+int netlib::wait_events(int epfd, epoll_event *events, int max_events, int wait_ms, const latency_profile &profile)
+{
+    if (profile.spin_us == 0 || wait_ms == 0)
+        return epoll_wait(epfd, events, max_events, wait_ms);
+    auto start = std::chrono::steady_clock::now();
+    auto spin_end = start + std::chrono::microseconds(profile.spin_us);
+    if (wait_ms > 0 && start + std::chrono::milliseconds(wait_ms) < spin_end)
+        spin_end = start + std::chrono::milliseconds(wait_ms);
+    while (true)
+    {
+        int events_ready = epoll_wait(epfd, events, max_events, 0);
+        if (events_ready != 0)
+            return events_ready;
+        if (std::chrono::steady_clock::now() >= spin_end)
+            break;
+    }
+    if (wait_ms == -1)
+        return epoll_wait(epfd, events, max_events, -1);
+    auto spun = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+    return epoll_wait(epfd, events, max_events, spun >= wait_ms ? 0 : wait_ms - spun);
+}
+#endif
@@ -0,0 +1,37 @@
+#pragma once
+#include <cstdint>
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
+
+namespace netlib
+{
+    // Everything is off by default, set before open_server/connect_to_server
+    struct latency_profile
+    {
+        // Reactor thread pinned to this core, -1 leaves it to the scheduler
+        int cpu = -1;
+        // Polls with a zero timeout this long before blocking in epoll_wait
+        uint64_t spin_us = 0;
+        // SO_BUSY_POLL, raising it past net.core.busy_read needs CAP_NET_ADMIN
+        int busy_poll_us = 0;
+        bool prefer_busy_poll = false;
+        bool nodelay = false;
+        // Linux drops back to delayed acks on its own, so it's set again after every read
+        bool quickack = false;
+        // 0 keeps the kernel's autotuning
+        int rcvbuf = 0;
+        int sndbuf = 0;
+    };
+
+    // Trades a core for wakeup latency: pinned, spinning 50us, busy polling,
+    // no Nagle and no delayed acks
+    latency_profile low_latency(int cpu);
+
+    bool pin_thread(int cpu);
+    void tune_socket(int fd, const latency_profile &profile);
+    void rearm_quickack(int fd, const latency_profile &profile);
+    #ifdef __linux__
+    int wait_events(int epfd, epoll_event *events, int max_events, int wait_ms, const latency_profile &profile);
+    #endif
+}
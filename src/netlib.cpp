@@ -1,21 +1,21 @@
 #include "netlib.h"
 
-void user_raw::add_data(char *new_data, size_t size)
+void user_raw::add_data(char *new_data, size_t size, uint64_t kernel_ns)
 {
     std::lock_guard<std::mutex> lock(sync);
     if (!new_data || size == 0 || size > MAX_PACKET_SIZE)
         return;
-    if (data_size + size > alloc_size)
+    // One spare byte keeps the data null terminated
+    if (!pool->grow(data, alloc_size, data_size, data_size + size + 1))
     {
-        data = (char *)realloc(data, size + data_size + 1);
-        if (!data)
-        {
-            std::runtime_error(std::format("Realloc failed {}", strerror(errno)).c_str());
-        }
-        alloc_size = data_size + size + 1;
+        std::println("Buffer alloc failed {}", strerror(errno));
+        return;
     }
     memcpy(&data[data_size], new_data, size);
     data_size += size;
+    data[data_size] = '\0';
+    if (tracer)
+        tracer->received(trace, size, kernel_ns);
 }
 
 void user_raw::remove_data(size_t size)
@@ -26,60 +26,792 @@ void user_raw::remove_data(size_t size)
     int new_data_size = data_size - size;
     if (new_data_size < 0)
         return;
-    char *new_data = (char *)calloc(alloc_size, sizeof(char));
-    if (!new_data)
-        std::runtime_error(std::format("Calloc failed {}", strerror(errno)).c_str());
-    memcpy(new_data, &data[size], new_data_size);
-    free(data);
-    data = new_data;
+    if (tracer)
+        tracer->consumed(trace, size);
+    memmove(data, &data[size], new_data_size);
     data_size = new_data_size;
+    // Drained connections hand their buffer back to the pool
+    pool->trim(data, alloc_size, data_size ? data_size + 1 : 0);
+    if (data)
+        data[data_size] = '\0';
+    scan_offset = scan_offset > size ? scan_offset - size : 0;
+    line_end = line_end > size ? line_end - size : 0;
+    frame_end = frame_end > size ? frame_end - size : 0;
+    charged_end = charged_end > size ? charged_end - size : 0;
     if (data_size == 0)
         readable = false;
 }
 
+void user_raw::mark_ready()
+{
+    if (!tracer)
+        return;
+    std::lock_guard<std::mutex> lock(sync);
+    tracer->ready(trace);
+}
+
 void netlib::server_raw::open_server(std::string address, short port)
 {
-    fd = socket(AF_INET, SOCK_STREAM, 0);
-    sockaddr_in addr = {0};
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(port);
-    
-    if (inet_pton(AF_INET, address.c_str(), &(addr.sin_addr)) == -1)
-    {
-        std::println("Inet pton failed! {}", strerror(errno));
-        close(fd);
+    fd = net->listen(address, port, latency);
+    if (fd == -1)
         return ;
+    poll_set = net->open_poller(latency);
+    add_to_list(fd);
+    recv_thread = std::thread([this]() { this->recv_th(); });
+}
+
+bool netlib::server_raw::hand_off(const std::string &path, bool connections)
+{
+    if (!net->sockets())
+    {
+        std::println("Handoff needs a socket transport");
+        return false;
     }
-    if (bind(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) == -1)
+    int sock = connect_unix(path);
+    if (sock == -1)
+        return false;
+    // The reactor reads fd and the users, it stops before they change
+    post_shutdown();
+    if (recv_thread.joinable())
+        recv_thread.join();
+    std::unique_lock<std::mutex> lock(sync);
+    if (!connections)
     {
-        std::println("Bind failed! {}", strerror(errno));
-        close(fd);
-        return ;
+        bool sent = send_handoff(sock, fd, {});
+        close(sock);
+        if (sent)
+        {
+            remove_from_list(fd);
+            close(fd);
+            fd = -1;
+        }
+        lock.unlock();
+        // Connections already accepted stay with this process
+        restart_reactor();
+        return sent;
     }
-    if (listen(fd, 10) == -1)
+    // The framing's frame_size can't cross processes, the other side
+    // applies its own server framing to everything it takes over
+    for (auto &[client_fd, current_user] : users)
     {
-        std::println("Listen failed!");
-        close(fd);
-        return ;
+        if (current_user.framing.header_size != server_framing.header_size || current_user.framing.frame_size != server_framing.frame_size
+            || current_user.framing.max_frame_size != server_framing.max_frame_size)
+        {
+            std::println("fd {} has its own framing, it can't be handed off", client_fd);
+            close(sock);
+            lock.unlock();
+            restart_reactor();
+            return false;
+        }
+    }
+    std::vector<handoff_connection> passed;
+    for (auto &[client_fd, current_user] : users)
+    {
+        std::lock_guard<std::mutex> user_lock(current_user.sync);
+        handoff_connection current;
+        current.fd = client_fd;
+        if (current_user.data_size > 0)
+            current.data.assign(current_user.data, current_user.data_size);
+        current_user.outbound.drain_to(current.outbound);
+        current.target = current_user.target;
+        current.target_permanent = current_user.target_permanent;
+        current.target_size = current_user.target_size;
+        current.idle_timeout = current_user.idle_timeout;
+        current.read_timeout = current_user.read_timeout;
+        current.write_timeout = current_user.write_timeout;
+        current.delimiter = current_user.delimiter;
+        current.topics = current_user.topics;
+        passed.push_back(std::move(current));
+    }
+    bool sent = send_handoff(sock, fd, passed);
+    close(sock);
+    if (!sent)
+    {
+        // Nobody took over, put the unsent bytes back and keep serving
+        for (auto &current : passed)
+        {
+            if (current.outbound.empty())
+                continue;
+            char *copy = (char *)malloc(current.outbound.size());
+            memcpy(copy, current.outbound.data(), current.outbound.size());
+            users.find(current.fd)->second.outbound.push(copy, current.outbound.size());
+        }
+        lock.unlock();
+        restart_reactor();
+        return false;
     }
-    #if defined(__APPLE__) || defined(__FreeBSD__)
-    epfd = kqueue();
-    #elif defined(__linux__)
-    epfd = epoll_create1(0);
-    #endif
+    // The other process holds its own references, closing ours doesn't end
+    // the connections
+    for (auto &[client_fd, current_user] : users)
+    {
+        limiter.detach(current_user.rate);
+        close(client_fd);
+    }
+    users.clear();
+    readable.clear();
+    topics.clear();
+    close(fd);
+    fd = -1;
+    return true;
+}
+
+void netlib::server_raw::restart_reactor()
+{
+    threads = true;
+    recv_thread = std::thread([this]() { this->recv_th(); });
+}
+
+bool netlib::server_raw::resume_from(const std::string &path)
+{
+    if (!net->sockets())
+    {
+        std::println("Handoff needs a socket transport");
+        return false;
+    }
+    int listener = listen_unix(path);
+    if (listener == -1)
+        return false;
+    int sock = accept(listener, nullptr, nullptr);
+    close(listener);
+    unlink(path.c_str());
+    if (sock == -1)
+    {
+        std::println("Handoff accept failed! {}", strerror(errno));
+        return false;
+    }
+    std::vector<handoff_connection> passed;
+    bool received = recv_handoff(sock, fd, passed);
+    close(sock);
+    if (!received)
+    {
+        for (auto &current : passed)
+            close(current.fd);
+        if (fd != -1)
+            close(fd);
+        return false;
+    }
+    poll_set = net->open_poller(latency);
     add_to_list(fd);
+    std::unique_lock<std::mutex> lock(sync);
+    for (auto &current : passed)
+        restore_user(current);
+    lock.unlock();
     recv_thread = std::thread([this]() { this->recv_th(); });
+    std::println("Resumed with {} connections", passed.size());
+    return true;
+}
+
+// Rebuilds a handed off connection as if it had been read up to now
+void netlib::server_raw::restore_user(handoff_connection &passed)
+{
+    int client_fd = passed.fd;
+    auto new_user = users.emplace(std::piecewise_construct, std::forward_as_tuple(client_fd), std::forward_as_tuple(client_fd, &pool));
+    auto &current_user = new_user.first->second;
+    if (tracer)
+    {
+        net->enable_timestamps(client_fd);
+        current_user.tracer = tracer;
+    }
+    current_user.idle_timeout = passed.idle_timeout;
+    current_user.read_timeout = passed.read_timeout;
+    current_user.write_timeout = passed.write_timeout;
+    current_user.delimiter = passed.delimiter;
+    current_user.framing = server_framing;
+    current_user.target = passed.target;
+    current_user.target_permanent = passed.target_permanent;
+    current_user.target_size = passed.target_size;
+    sockaddr_in addr = {0};
+    socklen_t addr_size = sizeof(addr);
+    getpeername(client_fd, (sockaddr *)&addr, &addr_size);
+    limiter.attach(current_user.rate, addr.sin_addr.s_addr);
+    add_to_list(client_fd);
+    arm_idle(current_user);
+    for (auto &name : passed.topics)
+    {
+        find_topic(name).subscribers.push_back(client_fd);
+        current_user.topics.push_back(name);
+    }
+    if (!passed.outbound.empty())
+    {
+        char *copy = (char *)malloc(passed.outbound.size());
+        memcpy(copy, passed.outbound.data(), passed.outbound.size());
+        current_user.outbound.push(copy, passed.outbound.size());
+        flush_user(client_fd);
+    }
+    for (size_t offset = 0; offset < passed.data.size(); offset += MAX_PACKET_SIZE)
+        current_user.add_data(passed.data.data() + offset, std::min<size_t>(MAX_PACKET_SIZE, passed.data.size() - offset));
+    if (current_user.data_size == 0)
+        return;
+    bool ready;
+    if (current_user.framing.header_size > 0)
+        ready = scan_frame(current_user) == 1;
+    else if (!current_user.delimiter.empty())
+        ready = scan_line(current_user);
+    else
+        ready = !current_user.target || current_user.data_size >= current_user.target_size;
+    if (!ready)
+        return;
+    if (current_user.target && current_user.target_permanent == false)
+        current_user.target = false;
+    mark_readable(current_user);
+}
+
+void netlib::server_raw::init_timers()
+{
+    idle_timeout = 0;
+    next_schedule_id = 1;
+}
+
+void netlib::server_raw::arm_idle(user_raw &current_user)
+{
+    if (current_user.idle_timeout == 0)
+        return;
+    int current_fd = current_user.fd;
+    if (!current_user.idle_timer.callback)
+        current_user.idle_timer.callback = [this, current_fd]() { idle_expired.push_back(current_fd); };
+    timers.arm(&current_user.idle_timer, current_user.idle_timeout);
+}
+
+void netlib::server_raw::fire_timers()
+{
+    std::vector<std::function<void()>> due;
+    std::unique_lock<std::mutex> lock(sync);
+    timers.advance(timers.now_ms());
+    for (int current_fd : idle_expired)
+    {
+        std::println("fd {} idle timeout", current_fd);
+        if (users.contains(current_fd))
+            disconnect_user(current_fd);
+    }
+    idle_expired.clear();
+    for (int current_fd : write_expired)
+    {
+        std::println("fd {} write timeout", current_fd);
+        if (users.contains(current_fd))
+            disconnect_user(current_fd);
+    }
+    write_expired.clear();
+    for (int current_fd : rate_resumed)
+    {
+        auto current_user_test = users.find(current_fd);
+        if (current_user_test == users.end())
+            continue;
+        limiter.resume(current_user_test->second.rate);
+        set_read_interest(current_user_test->second, true);
+    }
+    rate_resumed.clear();
+    for (int id : due_ids)
+    {
+        auto it = scheduled.find(id);
+        if (it == scheduled.end())
+            continue;
+        due.push_back(std::move(it->second.callback));
+        scheduled.erase(it);
+    }
+    due_ids.clear();
+    lock.unlock();
+    for (auto &callback : due)
+        callback();
+}
+
+void netlib::server_raw::set_idle_timeout(uint64_t timeout_ms)
+{
+    std::lock_guard<std::mutex> lock(sync);
+    idle_timeout = timeout_ms;
+}
+
+void netlib::server_raw::set_idle_timeout(int client_fd, uint64_t timeout_ms)
+{
+    std::unique_lock<std::mutex> lock(sync);
+    auto current_user_test = users.find(client_fd);
+    if (current_user_test == users.end())
+        return ;
+    auto &current_user = current_user_test->second;
+    current_user.idle_timeout = timeout_ms;
+    if (timeout_ms == 0)
+    {
+        timers.cancel(&current_user.idle_timer);
+        return ;
+    }
+    arm_idle(current_user);
+    lock.unlock();
+    wake();
+}
+
+void netlib::server_raw::set_read_timeout(int client_fd, uint64_t timeout_ms)
+{
+    std::lock_guard<std::mutex> lock(sync);
+    auto current_user_test = users.find(client_fd);
+    if (current_user_test == users.end())
+        return ;
+    current_user_test->second.read_timeout = timeout_ms;
+}
+
+void netlib::server_raw::set_write_timeout(int client_fd, uint64_t timeout_ms)
+{
+    std::lock_guard<std::mutex> lock(sync);
+    auto current_user_test = users.find(client_fd);
+    if (current_user_test == users.end())
+        return ;
+    current_user_test->second.write_timeout = timeout_ms;
+    if (timeout_ms == 0)
+        timers.cancel(&current_user_test->second.write_timer);
+}
+
+int netlib::server_raw::schedule(uint64_t delay_ms, std::function<void()> callback)
+{
+    std::unique_lock<std::mutex> lock(sync);
+    int id = next_schedule_id++;
+    auto &entry = scheduled.try_emplace(id).first->second;
+    entry.callback = std::move(callback);
+    entry.timer.callback = [this, id]() { due_ids.push_back(id); };
+    timers.arm(&entry.timer, delay_ms);
+    lock.unlock();
+    wake();
+    return id;
+}
+
+void netlib::server_raw::cancel_scheduled(int id)
+{
+    std::lock_guard<std::mutex> lock(sync);
+    scheduled.erase(id);
+}
+
+// Called with sync held
+void netlib::server_raw::flush_user(int current_fd)
+{
+    auto current_user_test = users.find(current_fd);
+    if (current_user_test == users.end())
+        return;
+    auto &current_user = current_user_test->second;
+    int status = flush_outbound(current_user.outbound, current_fd, *net, *poll_set, current_user.write_interest, !current_user.rate.paused);
+    if (status == -1)
+    {
+        disconnect_user(current_fd);
+        return;
+    }
+    if (status == 0)
+    {
+        timers.cancel(&current_user.write_timer);
+        return;
+    }
+    // The socket is backed up, the write timeout restarts on every bit of progress
+    if (current_user.write_timeout > 0)
+    {
+        if (!current_user.write_timer.callback)
+            current_user.write_timer.callback = [this, current_fd]() { write_expired.push_back(current_fd); };
+        timers.arm(&current_user.write_timer, current_user.write_timeout);
+    }
+}
+
+// Called with sync held. Stamps what is buffered as ready even if the user
+// already was readable
+void netlib::server_raw::mark_readable(user_raw &current_user)
+{
+    current_user.mark_ready();
+    if (std::find(readable.begin(), readable.end(), current_user.fd) != readable.end())
+        return;
+    current_user.readable = true;
+    readable.push_back(current_user.fd);
+    readable_cv.notify_all();
+}
+
+// Called with sync held, marks the user readable if its target is already buffered
+void netlib::server_raw::check_target(user_raw &current_user)
+{
+    if (!current_user.target || current_user.target_size == 0 || current_user.data_size < current_user.target_size)
+        return;
+    if (std::find(readable.begin(), readable.end(), current_user.fd) != readable.end())
+        return;
+    mark_readable(current_user);
+    if (current_user.target_permanent == false)
+        current_user.target = false;
+}
+
+// The hooks run with sync held
+netlib::command_handlers netlib::server_raw::command_hooks()
+{
+    return {
+        .outbound = [this](int current_fd) -> outbound_queue *
+        {
+            auto current_user_test = users.find(current_fd);
+            return current_user_test == users.end() ? nullptr : &current_user_test->second.outbound;
+        },
+        .flush = [this](int current_fd) { flush_user(current_fd); },
+        .record = [this](int current_fd, const char *data, size_t size)
+        {
+            if (capture_writer *writer = capture.load())
+                writer->record(current_fd, capture_direction::OUTBOUND, data, size);
+        },
+        .disconnect = [this](int current_fd)
+        {
+            if (users.contains(current_fd))
+                disconnect_user(current_fd);
+        },
+        .set_target = [this](int current_fd, size_t size, bool permanent)
+        {
+            auto current_user_test = users.find(current_fd);
+            if (current_user_test == users.end())
+                return;
+            readable.erase(std::remove(readable.begin(), readable.end(), current_fd), readable.end());
+            current_user_test->second.set_target(size, permanent);
+            check_target(current_user_test->second);
+        },
+        .publish = [this](const std::string &name, shared_buffer *buffer)
+        {
+            auto topic_test = topics.find(name);
+            if (topic_test != topics.end())
+                fan_out(topic_test->second, buffer);
+        }
+    };
+}
+
+// Called with sync held, creates the topic on first use
+netlib::topic &netlib::server_raw::find_topic(const std::string &name)
+{
+    auto topic_test = topics.find(name);
+    if (topic_test != topics.end())
+        return topic_test->second;
+    netlib::topic &created = topics[name];
+    created.id = next_topic_id++;
+    return created;
+}
+
+// Called with sync held. Slow subscribers get the topic's policy instead of
+// an ever growing queue
+void netlib::server_raw::fan_out(netlib::topic &current_topic, shared_buffer *buffer)
+{
+    current_topic.published++;
+    std::vector<int> subscribers = current_topic.subscribers;
+    for (int client_fd : subscribers)
+    {
+        auto current_user_test = users.find(client_fd);
+        if (current_user_test == users.end())
+            continue;
+        auto &outbound = current_user_test->second.outbound;
+        if (outbound.pending > 0 && outbound.pending + buffer->size > current_topic.max_pending)
+        {
+            if (current_topic.policy == slow_policy::DROP)
+            {
+                current_topic.dropped++;
+                continue;
+            }
+            current_topic.coalesced += outbound.coalesce(current_topic.id);
+        }
+        bool idle = outbound.empty();
+        if (capture_writer *writer = capture.load())
+            writer->record(client_fd, capture_direction::OUTBOUND, buffer->data, buffer->size);
+        outbound.push_shared(buffer, current_topic.id);
+        // A backed up socket is flushed when it turns writable
+        if (idle)
+            flush_user(client_fd);
+    }
+}
+
+void netlib::server_raw::subscribe(int client_fd, std::string topic)
+{
+    std::lock_guard<std::mutex> lock(sync);
+    auto current_user_test = users.find(client_fd);
+    if (current_user_test == users.end())
+        return;
+    auto &current_user = current_user_test->second;
+    if (std::find(current_user.topics.begin(), current_user.topics.end(), topic) != current_user.topics.end())
+        return;
+    find_topic(topic).subscribers.push_back(client_fd);
+    current_user.topics.push_back(topic);
+}
+
+void netlib::server_raw::unsubscribe(int client_fd, std::string topic)
+{
+    std::lock_guard<std::mutex> lock(sync);
+    auto current_user_test = users.find(client_fd);
+    if (current_user_test == users.end())
+        return;
+    auto &user_topics = current_user_test->second.topics;
+    user_topics.erase(std::remove(user_topics.begin(), user_topics.end(), topic), user_topics.end());
+    auto topic_test = topics.find(topic);
+    if (topic_test == topics.end())
+        return;
+    auto &subscribers = topic_test->second.subscribers;
+    subscribers.erase(std::remove(subscribers.begin(), subscribers.end(), client_fd), subscribers.end());
+}
+
+void netlib::server_raw::set_topic_policy(std::string topic, slow_policy policy, size_t max_pending)
+{
+    std::lock_guard<std::mutex> lock(sync);
+    netlib::topic &current_topic = find_topic(topic);
+    current_topic.policy = policy;
+    current_topic.max_pending = max_pending;
+}
+
+void netlib::server_raw::publish_data(std::string topic, char *data, size_t size)
+{
+    char *copy = (char *)malloc(size);
+    memcpy(copy, data, size);
+    commands.push({.type = command_type::PUBLISH, .shared = make_shared_buffer(copy, size), .topic = std::move(topic)});
+    wake();
+}
+
+netlib::topic_stats netlib::server_raw::get_topic_stats(std::string topic)
+{
+    std::lock_guard<std::mutex> lock(sync);
+    auto topic_test = topics.find(topic);
+    if (topic_test == topics.end())
+        return {0, 0, 0, 0};
+    auto &current_topic = topic_test->second;
+    return {current_topic.subscribers.size(), current_topic.published, current_topic.dropped, current_topic.coalesced};
+}
+
+// Set before open_server
+void netlib::server_raw::set_rate_limit(rate_limit per_connection, rate_limit per_address)
+{
+    limiter.configure(per_connection, per_address);
+}
+
+netlib::rate_stats netlib::server_raw::get_rate_stats()
+{
+    return limiter.stats();
+}
+
+// Stops reading the connection until its buckets have refilled
+void netlib::server_raw::throttle(user_raw &current_user, uint64_t delay_ms)
+{
+    int current_fd = current_user.fd;
+    limiter.pause(current_user.rate);
+    set_read_interest(current_user, false);
+    if (!current_user.rate.resume_timer.callback)
+        current_user.rate.resume_timer.callback = [this, current_fd]() { rate_resumed.push_back(current_fd); };
+    timers.arm(&current_user.rate.resume_timer, delay_ms);
+}
+
+void netlib::server_raw::set_capture(capture_writer *writer)
+{
+    capture = writer;
+}
+
+// Set before open_server
+void netlib::server_raw::set_tracer(latency_tracer *data_tracer)
+{
+    tracer = data_tracer;
+}
+
+// Set before open_server
+void netlib::server_raw::set_transport(transport &network)
+{
+    net = &network;
+}
+
+void netlib::server_raw::wake()
+{
+    if (poll_set)
+        poll_set->wake();
+}
+
+// Set before open_server
+void netlib::server_raw::set_latency_profile(latency_profile profile)
+{
+    latency = profile;
+}
+
+netlib::connection_memory netlib::server_raw::get_memory(int client_fd)
+{
+    std::lock_guard<std::mutex> lock(sync);
+    auto current_user_test = users.find(client_fd);
+    if (current_user_test == users.end())
+        return {0, 0, 0};
+    auto &current_user = current_user_test->second;
+    std::lock_guard<std::mutex> user_lock(current_user.sync);
+    return {current_user.data_size, current_user.alloc_size, current_user.outbound.pending};
+}
+
+netlib::connection_memory netlib::server_raw::get_total_memory()
+{
+    connection_memory total = {0, 0, 0};
+    std::lock_guard<std::mutex> lock(sync);
+    for (auto &[client_fd, current_user] : users)
+    {
+        std::lock_guard<std::mutex> user_lock(current_user.sync);
+        total.buffered += current_user.data_size;
+        total.capacity += current_user.alloc_size;
+        total.outbound += current_user.outbound.pending;
+    }
+    return total;
+}
+
+netlib::buffer_pool_stats netlib::server_raw::get_pool_stats()
+{
+    return pool.stats();
+}
+
+void netlib::server_raw::post_send(int client_fd, char *data, size_t size)
+{
+    char *copy = (char *)malloc(size);
+    memcpy(copy, data, size);
+    commands.push({.type = command_type::SEND, .fd = client_fd, .data = copy, .size = size});
+    wake();
+}
+
+// Queues length bytes of file_fd from offset, sent by the kernel without
+// passing through user space. file_fd is dup'd, the caller keeps its own
+bool netlib::server_raw::send_file(int client_fd, int file_fd, uint64_t offset, size_t length)
+{
+    command cmd = file_command(client_fd, nullptr, 0, file_fd, offset, length);
+    if (cmd.file_fd == -1)
+        return false;
+    commands.push(std::move(cmd));
+    wake();
+    return true;
+}
+
+void netlib::server_raw::post_disconnect(int client_fd)
+{
+    commands.push({.type = command_type::DISCONNECT, .fd = client_fd});
+    wake();
+}
+
+void netlib::server_raw::post_target(int client_fd, size_t target_s, bool permanent)
+{
+    commands.push({.type = command_type::SET_TARGET, .fd = client_fd, .size = target_s, .permanent = permanent});
+    wake();
+}
+
+void netlib::server_raw::post(std::function<void()> callback)
+{
+    commands.push({.type = command_type::CALL, .callback = std::move(callback)});
+    wake();
+}
+
+void netlib::server_raw::post_shutdown()
+{
+    threads = false;
+    commands.push({.type = command_type::SHUTDOWN});
+    wake();
 }
 
 void netlib::server_raw::disconnect_user(int current_fd)
 {
     remove_from_list(current_fd);
     std::println("Removed fd {} from epoll", current_fd);
-    close(current_fd);
+    net->close(current_fd);
+    release_user(current_fd);
+}
+
+// Forgets the user but leaves its socket alone
+void netlib::server_raw::release_user(int current_fd)
+{
+    auto current_user_test = users.find(current_fd);
+    if (current_user_test != users.end())
+    {
+        for (auto &name : current_user_test->second.topics)
+        {
+            auto &subscribers = topics[name].subscribers;
+            subscribers.erase(std::remove(subscribers.begin(), subscribers.end(), current_fd), subscribers.end());
+        }
+        limiter.detach(current_user_test->second.rate);
+    }
     users.erase(current_fd);
     readable.erase(std::remove(readable.begin(), readable.end(), current_fd), readable.end());
 }
 
+bool netlib::server_raw::relay(int client_fd, int upstream_fd)
+{
+    if (upstream_fd < 0 || !net->sockets())
+        return false;
+    post([this, client_fd, upstream_fd]()
+    {
+        std::lock_guard<std::mutex> lock(sync);
+        start_relay(client_fd, upstream_fd, {}, {});
+    });
+    return true;
+}
+
+bool netlib::server_raw::relay(int client_fd, client_raw &upstream)
+{
+    if (!net->sockets())
+        return false;
+    std::string to_client;
+    std::string to_upstream;
+    int upstream_fd = upstream.detach(to_client, to_upstream);
+    if (upstream_fd == -1)
+        return false;
+    post([this, client_fd, upstream_fd, to_upstream, to_client]()
+    {
+        std::lock_guard<std::mutex> lock(sync);
+        start_relay(client_fd, upstream_fd, to_upstream, to_client);
+    });
+    return true;
+}
+
+netlib::relay_stats netlib::server_raw::get_relay_stats(int client_fd)
+{
+    std::lock_guard<std::mutex> lock(sync);
+    auto link = relays.find(client_fd);
+    if (link == relays.end())
+        return {0, 0, false, false};
+    return link->second->stats();
+}
+
+// Called with sync held on the reactor thread
+void netlib::server_raw::start_relay(int client_fd, int upstream_fd, std::string to_upstream, std::string to_client)
+{
+    auto current_user_test = users.find(client_fd);
+    if (current_user_test == users.end() || relays.contains(client_fd))
+    {
+        close(upstream_fd);
+        return;
+    }
+    auto &current_user = current_user_test->second;
+    auto link = std::make_shared<relay_link>(client_fd, upstream_fd);
+    {
+        std::lock_guard<std::mutex> user_lock(current_user.sync);
+        if (current_user.data_size > 0)
+            to_upstream.append(current_user.data, current_user.data_size);
+    }
+    // What was queued for the client is older than what upstream sent
+    std::string queued;
+    current_user.outbound.drain_to(queued);
+    link->up.staged = std::move(to_upstream);
+    link->down.staged = std::move(queued.append(to_client));
+    // The client socket stays registered, only the interest changes
+    link->interest[0] = (current_user.rate.paused ? 0 : TRANSPORT_READ) | (current_user.write_interest ? TRANSPORT_WRITE : 0);
+    release_user(client_fd);
+    relays[client_fd] = link;
+    relays[upstream_fd] = link;
+    if (!link->open())
+    {
+        set_relay_interest(client_fd, link->interest[0], 0);
+        relays.erase(client_fd);
+        relays.erase(upstream_fd);
+        return;
+    }
+    pump_relay(client_fd);
+}
+
+// Called with sync held. Moves what it can, then watches each side for what
+// the relay waits on. Sockets with nothing to wait for are taken out of the
+// reactor so a half closed side doesn't keep waking it
+void netlib::server_raw::pump_relay(int current_fd)
+{
+    auto link_test = relays.find(current_fd);
+    if (link_test == relays.end())
+        return;
+    std::shared_ptr<relay_link> link = link_test->second;
+    int status = link->pump();
+    if (status == 1)
+    {
+        int sides[2] = {link->client, link->upstream};
+        for (int i = 0; i < 2; i++)
+            set_relay_interest(sides[i], link->interest[i], (link->wants_read(sides[i]) ? TRANSPORT_READ : 0) | (link->wants_write(sides[i]) ? TRANSPORT_WRITE : 0));
+        return;
+    }
+    if (status == -1)
+        std::println("Relay {} <-> {} failed {}", link->client, link->upstream, strerror(errno));
+    set_relay_interest(link->client, link->interest[0], 0);
+    set_relay_interest(link->upstream, link->interest[1], 0);
+    relays.erase(link->client);
+    relays.erase(link->upstream);
+}
+
 char *netlib::server_raw::receive_data(int current_fd, size_t size)
 {
     std::lock_guard<std::mutex> lock(sync);
@@ -107,37 +839,210 @@ char *netlib::server_raw::receive_data_ensured(int current_fd, size_t size)
         user_previous_permanency = current_user.target_permanent;
     }
     current_user.set_target(size, false);
-    lock.unlock();
+    current_user.read_timed_out = false;
+    if (current_user.read_timeout > 0)
+    {
+        current_user.read_timer.callback = [this, current_fd]()
+        {
+            auto timed_out_user = users.find(current_fd);
+            if (timed_out_user == users.end())
+                return ;
+            timed_out_user->second.read_timed_out = true;
+            readable_cv.notify_all();
+        };
+        timers.arm(&current_user.read_timer, current_user.read_timeout);
+        lock.unlock();
+        wake();
+    }
+    else
+        lock.unlock();
     wait_readable_fd(current_fd);
+    // The user may have gone while unlocked, only fresh lookups are safe
+    lock.lock();
+    current_user_test = users.find(current_fd);
+    if (current_user_test == users.end())
+        return nullptr;
+    timers.cancel(&current_user_test->second.read_timer);
+    bool timed_out = current_user_test->second.read_timed_out;
+    current_user_test->second.read_timed_out = false;
+    lock.unlock();
     if (user_previous_target > 0)
         set_target(current_fd, user_previous_target, user_previous_permanency);
     else
         set_target(current_fd, 0, false);
-    return current_user.receive_data(size);
+    if (timed_out)
+    {
+        std::println("fd {} read timeout", current_fd);
+        return nullptr;
+    }
+    lock.lock();
+    current_user_test = users.find(current_fd);
+    if (current_user_test == users.end())
+        return nullptr;
+    return current_user_test->second.receive_data(size);
 }
 
+// Called with sync held. Looks for the end of the first buffered line, only
+// scanning bytes that werent scanned on a previous call
+bool netlib::server_raw::scan_line(user_raw &current_user)
+{
+    if (current_user.line_end > 0)
+        return true;
+    const char *delimiter = current_user.delimiter.empty() ? "\r\n" : current_user.delimiter.c_str();
+    size_t delimiter_size = current_user.delimiter.empty() ? 2 : current_user.delimiter.size();
+    if (current_user.scan_offset >= current_user.data_size)
+        return false;
+    size_t found = netlib::find_delimiter(current_user.data + current_user.scan_offset, current_user.data_size - current_user.scan_offset, delimiter, delimiter_size);
+    if (found == netlib::no_delimiter)
+    {
+        // A delimiter may straddle the next recv, keep its possible prefix
+        if (current_user.data_size >= delimiter_size)
+            current_user.scan_offset = std::max(current_user.scan_offset, current_user.data_size - (delimiter_size - 1));
+        return false;
+    }
+    current_user.line_end = current_user.scan_offset + found + delimiter_size;
+    return true;
+}
+
+// Returns the first complete line including its delimiter, nullptr if there
+// is none buffered yet
 char * netlib::server_raw::get_line(int current_fd)
 {
     std::lock_guard<std::mutex> lock(sync);
-    int index = 0;
-    int index2 = 0;
-
-    const char *end = "\r\n";
     auto current_user_test = users.find(current_fd);
     if (current_user_test == users.end())
         return nullptr;
     auto &current_user = current_user_test->second;
-    while (current_user.data[index] != '\0')
+    if (!scan_line(current_user))
+        return nullptr;
+    current_user.readable = true;
+    char *ret = current_user.receive_data(current_user.line_end);
+    if (!scan_line(current_user))
+        readable.erase(std::remove(readable.begin(), readable.end(), current_fd), readable.end());
+    return ret;
+}
+
+// Called with sync held. Returns 1 when the frame starting at from is fully
+// buffered, 0 if not yet and -1 if its header announces an invalid size
+int netlib::server_raw::scan_frame(user_raw &current_user, size_t from)
+{
+    if (current_user.frame_end == 0)
+    {
+        if (current_user.data_size < from + current_user.framing.header_size)
+            return 0;
+        size_t frame_size = current_user.framing.frame_size(current_user.data + from);
+        if (frame_size < current_user.framing.header_size || frame_size > current_user.framing.max_frame_size)
+            return -1;
+        current_user.frame_end = from + frame_size;
+    }
+    return current_user.data_size >= current_user.frame_end;
+}
+
+// Called with sync held. Counts the frames or lines completed since the last
+// call, size is how many bytes just arrived
+size_t netlib::server_raw::count_frames(user_raw &current_user, size_t size)
+{
+    size_t frames = 0;
+    if (current_user.framing.header_size > 0)
     {
-        if (current_user.data[index] == end[index2])
+        while (current_user.data_size >= current_user.charged_end + current_user.framing.header_size)
         {
-            if (index2 == 1)
+            size_t frame_size = current_user.framing.frame_size(current_user.data + current_user.charged_end);
+            // Invalid sizes are scan_frame's to report
+            if (frame_size < current_user.framing.header_size || frame_size > current_user.framing.max_frame_size)
+                break;
+            if (current_user.data_size < current_user.charged_end + frame_size)
                 break;
-            index2++;
+            current_user.charged_end += frame_size;
+            frames++;
         }
-        index++;
+        return frames;
+    }
+    const char *delimiter = current_user.delimiter.c_str();
+    size_t delimiter_size = current_user.delimiter.size();
+    // Lines ending before the new bytes were counted already, one may
+    // have its delimiter split across reads
+    size_t from = current_user.data_size > size + delimiter_size - 1 ? current_user.data_size - size - (delimiter_size - 1) : 0;
+    from = std::max(from, current_user.charged_end);
+    while (from < current_user.data_size)
+    {
+        size_t found = netlib::find_delimiter(current_user.data + from, current_user.data_size - from, delimiter, delimiter_size);
+        if (found == netlib::no_delimiter)
+            break;
+        from += found + delimiter_size;
+        current_user.charged_end = from;
+        frames++;
     }
-    return current_user.receive_data(index + 1);
+    return frames;
+}
+
+// Returns the first complete frame including its header, {nullptr, 0} if there
+// is none buffered yet
+std::pair<char *, size_t> netlib::server_raw::receive_frame(int current_fd)
+{
+    std::lock_guard<std::mutex> lock(sync);
+    auto current_user_test = users.find(current_fd);
+    if (current_user_test == users.end() || current_user_test->second.framing.header_size == 0)
+        return std::pair<char *, size_t>();
+    auto &current_user = current_user_test->second;
+    if (scan_frame(current_user) != 1)
+        return std::pair<char *, size_t>();
+    size_t frame_size = current_user.frame_end;
+    current_user.readable = true;
+    char *ret = current_user.receive_data(frame_size);
+    int status = scan_frame(current_user);
+    // Only the reactor closes, it may be reading this fd right now
+    if (status == -1)
+        post_disconnect(current_fd);
+    if (status != 1)
+        readable.erase(std::remove(readable.begin(), readable.end(), current_fd), readable.end());
+    return std::pair<char *, size_t>(ret, frame_size);
+}
+
+void netlib::server_raw::set_framing(frame_policy policy)
+{
+    std::lock_guard<std::mutex> lock(sync);
+    server_framing = policy;
+}
+
+void netlib::server_raw::set_framing(int client_fd, frame_policy policy)
+{
+    std::lock_guard<std::mutex> lock(sync);
+    auto current_user_test = users.find(client_fd);
+    if (current_user_test == users.end())
+        return ;
+    auto &current_user = current_user_test->second;
+    current_user.framing = policy;
+    current_user.frame_end = 0;
+    readable.erase(std::remove(readable.begin(), readable.end(), client_fd), readable.end());
+    if (policy.header_size == 0)
+        return ;
+    int status = scan_frame(current_user);
+    if (status == -1)
+        post_disconnect(client_fd);
+    else if (status == 1)
+        mark_readable(current_user);
+}
+
+void netlib::server_raw::set_line_mode(std::string delimiter)
+{
+    std::lock_guard<std::mutex> lock(sync);
+    server_delimiter = delimiter;
+}
+
+void netlib::server_raw::set_line_mode(int client_fd, std::string delimiter)
+{
+    std::lock_guard<std::mutex> lock(sync);
+    auto current_user_test = users.find(client_fd);
+    if (current_user_test == users.end())
+        return ;
+    auto &current_user = current_user_test->second;
+    current_user.delimiter = delimiter;
+    current_user.scan_offset = 0;
+    current_user.line_end = 0;
+    readable.erase(std::remove(readable.begin(), readable.end(), client_fd), readable.end());
+    if (!delimiter.empty() && scan_line(current_user))
+        mark_readable(current_user);
 }
 
 
@@ -179,6 +1084,9 @@ void netlib::server_raw::wait_readable_fd(int fd)
     readable.erase(std::remove(readable.begin(), readable.end(), fd), readable.end());
     while (true)
     {
+        current_user_test = users.find(fd);
+        if (current_user_test == users.end() || current_user_test->second.read_timed_out)
+            break;
         readable_cv.wait(lock);
         if (std::find(readable.begin(), readable.end(), fd) != readable.end())
             break;
@@ -203,34 +1111,29 @@ void user_raw::set_target(size_t target_s, bool permanent)
     target_permanent = permanent;
 }
 
-#if defined(__APPLE__) || defined(__FreeBSD__)
 void netlib::server_raw::add_to_list(int sockfd)
 {
-    struct kevent ev;
-    EV_SET(&ev, sockfd, EVFILT_READ, EV_ADD, 0, 0, 0);
-    kevent(epfd, &ev, 1, NULL, 0, NULL);
+    poll_set->watch(sockfd, TRANSPORT_READ);
 }
 
 void netlib::server_raw::remove_from_list(int fd)
 {
-    struct kevent ev;
-    EV_SET(&ev, fd, EVFILT_READ, EV_DELETE, 0, 0, 0);
-    kevent(epfd, &ev, 1, NULL, 0, NULL);
+    poll_set->watch(fd, 0);
 }
-#elif defined(__linux__)
-void netlib::server_raw::add_to_list(int sockfd)
+
+void netlib::server_raw::set_read_interest(user_raw &current_user, bool enabled)
 {
-    epoll_event event;
-    event.data.fd = sockfd;
-    event.events = EPOLLIN;
-    epoll_ctl(epfd, EPOLL_CTL_ADD, sockfd, &event);
+    poll_set->watch(current_user.fd, (enabled ? TRANSPORT_READ : 0) | (current_user.write_interest ? TRANSPORT_WRITE : 0));
 }
 
-void netlib::server_raw::remove_from_list(int fd)
+// 0 takes the socket out of the set, so hangups stop being reported too
+void netlib::server_raw::set_relay_interest(int relay_fd, uint8_t &current, uint8_t wanted)
 {
-    epoll_ctl(epfd, EPOLL_CTL_DEL, fd, nullptr);
+    if (current == wanted)
+        return;
+    poll_set->watch(relay_fd, wanted);
+    current = wanted;
 }
-#endif
 
 void netlib::server_raw::add_whitelist(std::vector<std::string> ips)
 {
@@ -240,50 +1143,71 @@ void netlib::server_raw::add_whitelist(std::vector<std::string> ips)
 
 void netlib::server_raw::recv_th()
 {
+    command_handlers handlers = command_hooks();
     int events_ready = 0;
-    #if defined(__APPLE__) || defined(__FreeBSD__)
-    struct kevent events[1024];
-    struct timespec timeout;
-    timeout.tv_sec = 0;
-    timeout.tv_nsec = 500000000; //500ms
-    #elif defined(__linux__)
-    epoll_event events[1024];
-    #endif
+    transport_event events[1024];
     int status = 0;
-    char *buffer = (char *)calloc(1024, sizeof(char));
+    char *buffer = (char *)malloc(RECV_SCRATCH_SIZE);
+    pin_thread(latency.cpu);
     while (threads == true)
     {
-        #if defined(__APPLE__) || defined(__FreeBSD__)
-        events_ready = kevent(epfd, NULL, 0, events, 1024, &timeout);
-        #elif defined(__linux__)
-        events_ready = epoll_wait(epfd, events, 1024, -1);
-        #endif
+        std::unique_lock<std::mutex> timer_lock(sync);
+        int wait_ms = timers.next_timeout(timers.now_ms());
+        timer_lock.unlock();
+        events_ready = poll_set->wait(events, 1024, wait_ms);
         if (events_ready == -1)
         {
+            if (errno == EINTR)
+                continue;
             std::println("Epoll/kqueue failed {}", strerror(errno));
             break;
         }
         for (int i = 0; i < events_ready; i++)
         {
-            #if defined(__APPLE__) || defined(__FreeBSD__)
-            int current_fd = events[i].ident;
-            #elif defined(__linux__)
-            int current_fd = events[i].data.fd;
-            #endif
+            int current_fd = events[i].fd;
+            bool writable = events[i].writable;
+            bool read_event = events[i].readable;
+            bool hangup = events[i].hangup;
+            if (relays.contains(current_fd))
+            {
+                std::lock_guard<std::mutex> lock(sync);
+                pump_relay(current_fd);
+                continue;
+            }
+            if (writable && current_fd != fd)
+            {
+                std::lock_guard<std::mutex> lock(sync);
+                flush_user(current_fd);
+            }
+            if (!read_event)
+                continue;
             if (current_fd == fd)
             {
-                sockaddr_in addr = {0};
-                unsigned int addr_size = sizeof(addr);
+                uint32_t ip = 0;
                 char str[INET_ADDRSTRLEN];
-                int new_client = accept(fd, (sockaddr *)&addr, &addr_size);
+                int new_client = net->accept(fd, ip);
+                // The listener may have been handed off since the event
+                if (new_client == -1)
+                    continue;
                 std::println("Client accepted");
+                net->tune(new_client, latency);
                 add_to_list(new_client);
-                struct in_addr ipAddr = addr.sin_addr;
+                struct in_addr ipAddr = {ip};
                 std::println("{} connected", inet_ntop(AF_INET, &ipAddr, str, INET_ADDRSTRLEN));
                 std::println("New fd {}", new_client);
-                auto new_user = users.emplace(std::piecewise_construct, std::forward_as_tuple(new_client), std::forward_as_tuple(new_client));
+                if (tracer)
+                    net->enable_timestamps(new_client);
+                std::unique_lock<std::mutex> accept_lock(sync);
+                auto new_user = users.emplace(std::piecewise_construct, std::forward_as_tuple(new_client), std::forward_as_tuple(new_client, &pool));
+                new_user.first->second.tracer = tracer;
                 if (server_target_size > 0)
                     new_user.first->second.set_target(server_target_size, true);
+                new_user.first->second.idle_timeout = idle_timeout;
+                new_user.first->second.delimiter = server_delimiter;
+                new_user.first->second.framing = server_framing;
+                limiter.attach(new_user.first->second.rate, ip);
+                arm_idle(new_user.first->second);
+                accept_lock.unlock();
                 if (whitelist)
                 {
                     bool in_whitelist = false;
@@ -296,7 +1220,7 @@ void netlib::server_raw::recv_th()
                     {
                         std::println("Ip {} not in whitelist!", str);
                         std::lock_guard lock(sync);
-                        disconnect_user(current_fd);
+                        disconnect_user(new_client);
                     }
                 }
                 continue;
@@ -318,41 +1242,83 @@ void netlib::server_raw::recv_th()
                     continue;
                 }
             }
-            status = recv(current_fd, buffer, 1024, 0);
+            // A hangup is read regardless so the disconnect isn't held up
+            if (limiter.enabled() && !hangup)
+            {
+                uint64_t delay_ms = limiter.blocked_ms(current_user.rate);
+                if (delay_ms > 0)
+                {
+                    std::lock_guard<std::mutex> lock(sync);
+                    throttle(current_user, delay_ms);
+                    continue;
+                }
+            }
+            uint64_t kernel_ns = 0;
+            size_t budget = limiter.read_budget(current_user.rate, RECV_SCRATCH_SIZE);
+            status = net->recv(current_fd, buffer, budget, 0, current_user.tracer ? &kernel_ns : nullptr);
+            // Sockets are non blocking, readiness may have been spurious
+            if (status == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                continue;
             if (status == -1 || status == 0)
             {
                 std::lock_guard<std::mutex> lock(sync);
                 disconnect_user(current_fd);
                 continue;
             }
-            current_user.add_data(buffer, status);
+            net->after_read(current_fd, latency);
+            if (capture_writer *writer = capture.load())
+                writer->record(current_fd, capture_direction::INBOUND, buffer, status);
+            // Under sync, readers holding it look into the buffer in place
+            // and appending may move it
             std::lock_guard<std::mutex> lock(sync);
+            current_user.add_data(buffer, status, kernel_ns);
+            // Framed and line connections pay per message, others per read
+            bool framed = current_user.framing.header_size > 0 || !current_user.delimiter.empty();
+            limiter.charge(current_user.rate, status, framed ? count_frames(current_user, status) : 1);
+            arm_idle(current_user);
+            if (current_user.framing.header_size > 0)
+            {
+                // Length prefixed, only ready once a whole frame is buffered
+                int frame_status = scan_frame(current_user);
+                if (frame_status == -1)
+                {
+                    std::println("fd {} sent an invalid frame size", current_fd);
+                    disconnect_user(current_fd);
+                }
+                else if (frame_status == 1)
+                    mark_readable(current_user);
+                continue;
+            }
+            if (!current_user.delimiter.empty())
+            {
+                // Line mode, only ready once a whole line is buffered
+                if (scan_line(current_user))
+                    mark_readable(current_user);
+                continue;
+            }
             if (std::find(readable.begin(), readable.end(), current_fd) == readable.end())
             {
                 if (current_user.target)
                 {
                     if (current_user.data_size >= current_user.target_size)
                     {
-                        current_user.readable = true;
-                        readable.push_back(current_fd);
-                        readable_cv.notify_all();
+                        mark_readable(current_user);
                         if (current_user.target_permanent == false)
                             current_user.target = false;
                     }
                     continue;
                 }
-                int count = 0;
-                ioctl(current_fd, FIONREAD, &count);
-
-                if (count == 0)
-                {
-                    current_user.readable = true;
-                    readable.push_back(current_fd);
-                    readable_cv.notify_all();
-                }
+                if (net->available(current_fd) == 0)
+                    mark_readable(current_user);
             }
+            else
+                current_user.mark_ready();
         }
+        fire_timers();
+        if (!run_commands(commands, handlers, &sync))
+            threads = false;
     }
+    free(buffer);
 }
 
 char *user_raw::receive_data(size_t size)
@@ -373,43 +1339,57 @@ char *user_raw::receive_data(size_t size)
 }
 
 
-void netlib::cli_raw::add_data(char *new_data, size_t size)
+void netlib::cli_raw::add_data(char *new_data, size_t size, uint64_t kernel_ns)
 {
     std::lock_guard<std::mutex> lock(sync);
     if (!new_data || size == 0 || size > MAX_PACKET_SIZE)
         return;
-    if (data_size + size > alloc_size)
+    // One spare byte keeps the data null terminated
+    if (!pool->grow(data, alloc_size, data_size, data_size + size + 1))
     {
-        data = (char *)realloc(data, size + data_size + 1);
-        if (!data)
-        {
-            std::runtime_error(std::format("Realloc failed {}", strerror(errno)).c_str());
-        }
-        alloc_size = data_size + size + 1;
+        std::println("Buffer alloc failed {}", strerror(errno));
+        return;
     }
     memcpy(&data[data_size], new_data, size);
     data_size += size;
+    data[data_size] = '\0';
+    if (tracer)
+        tracer->received(trace, size, kernel_ns);
 }
 
 void netlib::cli_raw::remove_data(size_t size)
 {
     std::lock_guard<std::mutex> lock(sync);
+    drop_data(size);
+}
+
+void netlib::cli_raw::drop_data(size_t size)
+{
     if (size == 0)
         return;
     int new_data_size = data_size - size;
     if (new_data_size < 0)
         return;
-    char *new_data = (char *)calloc(alloc_size, sizeof(char));
-    if (!new_data)
-        std::runtime_error(std::format("Calloc failed {}", strerror(errno)).c_str());
-    memcpy(new_data, &data[size], new_data_size);
-    free(data);
-    data = new_data;
+    if (tracer)
+        tracer->consumed(trace, size);
+    memmove(data, &data[size], new_data_size);
     data_size = new_data_size;
+    // Drained connections hand their buffer back to the pool
+    pool->trim(data, alloc_size, data_size ? data_size + 1 : 0);
+    if (data)
+        data[data_size] = '\0';
     if (data_size == 0)
         readable = false;
 }
 
+void netlib::cli_raw::mark_ready()
+{
+    if (!tracer)
+        return;
+    std::lock_guard<std::mutex> lock(sync);
+    tracer->ready(trace);
+}
+
 char *netlib::cli_raw::receive_data(size_t size)
 {
     if (readable == true)
@@ -428,40 +1408,150 @@ char *netlib::cli_raw::receive_data(size_t size)
 
 void netlib::client_raw::connect_to_server(std::string address, short port)
 {
-    fd = socket(AF_INET, SOCK_STREAM, 0);
-    sockaddr_in addr = {0};
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(port);
-    
-    if (inet_pton(AF_INET, address.c_str(), &(addr.sin_addr)) == -1)
-    {
-        std::println("Inet pton failed! {}", strerror(errno));
-        close(fd);
+    fd = net->connect(address, port, latency);
+    if (fd == -1)
         return ;
-    }
-    if (connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) == -1)
+    if (tracer)
     {
-        std::println("Connect failed!");
-        return ;
+        net->enable_timestamps(fd);
+        serv.tracer = tracer;
     }
-    #if defined(__APPLE__) || defined(__FreeBSD__)
-    epfd = kqueue();
-    struct kevent ev;
-    EV_SET(&ev, fd, EVFILT_READ, EV_ADD, 0, 0, 0);
-    kevent(epfd, &ev, 1, NULL, 0, NULL);
-    #elif defined(__linux__)
-    epfd = epoll_create1(0);
-    epoll_event event;
-    event.data.fd = fd;
-    event.events = EPOLLIN;
-    epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &event);
-    #endif
+    poll_set = net->open_poller(latency);
+    poll_set->watch(fd, TRANSPORT_READ);
     recv_thread = std::thread([this]() { this->recv_th(); });
 }
 
+// Set before connect_to_server
+void netlib::client_raw::set_latency_profile(latency_profile profile)
+{
+    latency = profile;
+}
+
+void netlib::client_raw::set_tracer(latency_tracer *data_tracer)
+{
+    tracer = data_tracer;
+}
+
+void netlib::client_raw::set_transport(transport &network)
+{
+    net = &network;
+}
+
+void netlib::client_raw::wake()
+{
+    if (poll_set)
+        poll_set->wake();
+}
+
+// Called with sync held
+void netlib::client_raw::flush_server()
+{
+    if (flush_outbound(serv.outbound, fd, *net, *poll_set, serv.write_interest) == -1)
+    {
+        serv.outbound.clear();
+        disconnect_from_server();
+    }
+}
+
+// The hooks run with sync held, there is only the one connection
+netlib::command_handlers netlib::client_raw::command_hooks()
+{
+    return {
+        .outbound = [this](int) { return &serv.outbound; },
+        .flush = [this](int) { flush_server(); },
+        .disconnect = [this](int) { disconnect_from_server(); }
+    };
+}
+
+// Called with sync held. Completes the request of every whole reply buffered
+void netlib::client_raw::dispatch_responses()
+{
+    size_t consumed = 0;
+    while (serv.data_size - consumed >= pipeline_framing::header_size)
+    {
+        char *frame = serv.data + consumed;
+        size_t frame_size = pipeline_framing::frame_size(frame);
+        if (frame_size > MAX_PACKET_SIZE + pipeline_framing::header_size)
+        {
+            std::println("Invalid reply size {}", frame_size);
+            disconnect_from_server();
+            return;
+        }
+        if (serv.data_size - consumed < frame_size)
+            break;
+        struct packet pkt = {(int)frame_size, (int)frame_size, frame, frame};
+        auto request = pending.find(pipeline_id(pkt));
+        if (request != pending.end())
+        {
+            request->second(pipeline_body(pkt));
+            pending.erase(request);
+        }
+        consumed += frame_size;
+    }
+    serv.remove_data(consumed);
+}
+
+void netlib::client_raw::post_send(char *data, size_t size)
+{
+    char *copy = (char *)malloc(size);
+    memcpy(copy, data, size);
+    commands.push({.type = command_type::SEND, .fd = fd, .data = copy, .size = size});
+    wake();
+}
+
+bool netlib::client_raw::send_file(int file_fd, uint64_t offset, size_t length)
+{
+    command cmd = file_command(fd, nullptr, 0, file_fd, offset, length);
+    if (cmd.file_fd == -1)
+        return false;
+    commands.push(std::move(cmd));
+    wake();
+    return true;
+}
+
+int netlib::client_raw::detach(std::string &inbound, std::string &outbound)
+{
+    post_shutdown();
+    if (recv_thread.joinable())
+        recv_thread.join();
+    std::lock_guard<std::mutex> lock(sync);
+    if (fd <= 0 || !net->sockets())
+        return -1;
+    poll_set->watch(fd, 0);
+    serv.write_interest = false;
+    {
+        std::lock_guard<std::mutex> data_lock(serv.sync);
+        if (serv.data_size > 0)
+            inbound.assign(serv.data, serv.data_size);
+    }
+    serv.remove_data(serv.data_size);
+    serv.outbound.drain_to(outbound);
+    readable = false;
+    int ret = fd;
+    fd = -1;
+    return ret;
+}
+
+void netlib::client_raw::post(std::function<void()> callback)
+{
+    commands.push({.type = command_type::CALL, .callback = std::move(callback)});
+    wake();
+}
+
+void netlib::client_raw::post_shutdown()
+{
+    threads = false;
+    commands.push({.type = command_type::SHUTDOWN});
+    wake();
+}
+
+// Called with sync held. Drops the outstanding requests, their futures get
+// a broken_promise instead of waiting for replies that can't come
 void netlib::client_raw::disconnect_from_server()
 {
-    close(fd);
+    net->close(fd);
+    pending.clear();
+    pipelined = false;
 }
 
 char *netlib::client_raw::receive_data(int current_fd, size_t size)
@@ -478,47 +1568,58 @@ char *netlib::client_raw::receive_data(int current_fd, size_t size)
 
 void netlib::client_raw::recv_th()
 {
+    command_handlers handlers = command_hooks();
     int events_ready = 0;
-    #if defined(__APPLE__) || defined(__FreeBSD__)
-    struct kevent events[1024];
-    struct timespec timeout;
-    timeout.tv_sec = 0;
-    timeout.tv_nsec = 500000000; //500ms
-    #elif defined(__linux__)
-    epoll_event events[1024];
-    #endif
+    transport_event events[1024];
     int status = 0;
-    char *buffer = (char *)calloc(1024, sizeof(char));
+    char *buffer = (char *)malloc(RECV_SCRATCH_SIZE);
+    pin_thread(latency.cpu);
     while (threads == true)
     {
-        #if defined(__APPLE__) || defined(__FreeBSD__)
-        events_ready = kevent(epfd, NULL, 0, events, 1024, &timeout);
-        #elif defined(__linux__)
-        events_ready = epoll_wait(epfd, events, 1024, -1);
-        #endif
+        events_ready = poll_set->wait(events, 1024, -1);
         if (events_ready == -1)
         {
+            if (errno == EINTR)
+                continue;
             std::println("Epoll/kqueue failed {}", strerror(errno));
             break;
         }
         for (int i = 0; i < events_ready; i++)
         {
-            #if defined(__APPLE__) || defined(__FreeBSD__)
-            int current_fd = events[i].ident;
-            #elif defined(__linux__)
-            int current_fd = events[i].data.fd;
-            #endif
-            status = recv(current_fd, buffer, 1024, 0);
+            int current_fd = events[i].fd;
+            bool writable = events[i].writable;
+            bool read_event = events[i].readable;
+            if (writable)
+            {
+                std::lock_guard<std::mutex> lock(sync);
+                flush_server();
+            }
+            if (!read_event)
+                continue;
+            uint64_t kernel_ns = 0;
+            status = net->recv(current_fd, buffer, RECV_SCRATCH_SIZE, 0, serv.tracer ? &kernel_ns : nullptr);
+            if (status == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                continue;
             if (status == -1 || status == 0)
             {
                 std::lock_guard<std::mutex> lock(sync);
                 disconnect_from_server();
                 continue;
             }
-            serv.add_data(buffer, status);
+            net->after_read(current_fd, latency);
+            serv.add_data(buffer, status, kernel_ns);
             std::lock_guard<std::mutex> lock(sync);
+            serv.mark_ready();
+            if (pipelined)
+            {
+                dispatch_responses();
+                continue;
+            }
             readable = true;
             serv.readable = true;
         }
+        if (!run_commands(commands, handlers, &sync))
+            threads = false;
     }
+    free(buffer);
 }
@@ -15,20 +15,51 @@
 #include <errno.h>
 #include <cstring>
 #include <sys/ioctl.h>
+#include <poll.h>
 #include <tuple>
+#include <optional>
 #include <mutex>
 #include <map>
 #include <condition_variable>
+#include <functional>
+#include <future>
+#include <memory>
+#include <string_view>
 #include "comp_time_read.h"
 #include "comp_time_write.h"
+#include "timer_wheel.h"
+#include "command_queue.h"
+#include "pubsub.h"
+#include "framing.h"
+#include "pipeline.h"
+#include "varlen.h"
+#include "varint.h"
+#include "aggregate.h"
+#include "fixed_layout.h"
+#include "protocol.h"
+#include "scatter.h"
+#include "compress.h"
+#include "capture.h"
+#include "buffer_pool.h"
+#include "latency.h"
+#include "rate_limit.h"
+#include "handoff.h"
+#include "relay.h"
+#include "tracing.h"
+#include "transport.h"
+#include "shm_transport.h"
 
 #define MAX_PACKET_SIZE 8192
+// Reactors read into one scratch buffer this size, add_data takes at most MAX_PACKET_SIZE
+#define RECV_SCRATCH_SIZE MAX_PACKET_SIZE
 
 template <typename T>
 struct packet_raw
 {
     T size;
     char *data;
+    // Set when a tracer is, for the ready to consumed latency
+    uint64_t ready_ns = 0;
 };
 
 template <typename T>
@@ -39,132 +70,341 @@ struct user
     {}
     int fd;
     std::vector<packet_raw<T>> packets;
+    netlib::timer_node idle_timer;
+    netlib::outbound_queue outbound;
+    bool write_interest = false;
+    netlib::rate_state rate;
 };
 
 struct user_raw
 {
-    user_raw(int sockfd)
-    :fd(sockfd)
+    user_raw(int sockfd, netlib::buffer_pool *buffers = &netlib::default_pool())
+    :fd(sockfd), pool(buffers)
     {
-        data = (char *)calloc(1024, sizeof(char));
+        data = nullptr;
         data_size = 0;
-        alloc_size = 1024;
+        alloc_size = 0;
         target = false;
         target_permanent = false;
         target_size = 0;
+        idle_timeout = 0;
+        read_timeout = 0;
+        write_timeout = 0;
+        read_timed_out = false;
+        write_interest = false;
+        scan_offset = 0;
+        line_end = 0;
+        framing = {0, nullptr, 0};
+        frame_end = 0;
+        charged_end = 0;
+    }
+    ~user_raw()
+    {
+        pool->release(data, alloc_size);
     }
     int fd;
+    // Pooled, null while nothing is buffered
     char *data;
     size_t data_size;
     size_t alloc_size;
+    netlib::buffer_pool *pool;
     void set_target(size_t target_s, bool permanent = false);
-    void add_data(char *new_data, size_t size);
+    void add_data(char *new_data, size_t size, uint64_t kernel_ns = 0);
     void remove_data(size_t size);
     char *receive_data(size_t size);
+    void mark_ready();
     std::atomic_bool readable;
     std::mutex sync;
+    netlib::latency_tracer *tracer = nullptr;
+    netlib::trace_state trace;
     bool target;
     bool target_permanent;
     size_t target_size;
+    uint64_t idle_timeout;
+    uint64_t read_timeout;
+    uint64_t write_timeout;
+    bool read_timed_out;
+    netlib::timer_node idle_timer;
+    netlib::timer_node read_timer;
+    netlib::timer_node write_timer;
+    netlib::outbound_queue outbound;
+    bool write_interest;
+    std::string delimiter;
+    size_t scan_offset;
+    size_t line_end;
+    netlib::frame_policy framing;
+    size_t frame_end;
+    // Buffered bytes whose frames or lines the rate limiter has seen
+    size_t charged_end;
+    std::vector<std::string> topics;
+    netlib::rate_state rate;
 };
 
 namespace netlib
 {
-    template<typename T>
+    // T is the integer size header in front of every packet, read in Order
+    // like the packet fields
+    template<typename T, typename Order = wire_order>
     class server
     {
         public:
             server()
             {
                 fd = 0;
-                epfd = 0;
                 threads = true;
+                idle_timeout = 0;
+                next_schedule_id = 1;
             }
             ~server()
             {
-                threads = false;
-                recv_thread.join();
+                post_shutdown();
+                if (recv_thread.joinable())
+                    recv_thread.join();
             }
             int fd;
             void open_server(std::string address, short port);
             void disconnect_user(int current_fd);
             std::map<int, std::vector<packet_raw<T>>> check_packets();
+            // Runs every queued packet through Protocol::dispatch, the handler
+            // gets (fd, message). Peers sending ids the protocol lacks are dropped
+            template<typename Protocol, typename F>
+            size_t dispatch_packets(F &&handler);
+            void set_idle_timeout(uint64_t timeout_ms);
+            int schedule(uint64_t delay_ms, std::function<void()> callback);
+            void cancel_scheduled(int id);
+            void post_send(int client_fd, char *data, size_t size);
+            bool send_file(int client_fd, int file_fd, uint64_t offset, size_t length);
+            template<typename ...U>
+            bool send_file(int client_fd, std::tuple<U...> header, int file_fd, uint64_t offset, size_t length);
+            template<typename ...U>
+            void post_packet(int client_fd, std::tuple<U...> packet);
+            template<typename ...U>
+            void post_framed(int client_fd, std::tuple<U...> packet);
+            void set_compression(compression options);
+            void set_capture(capture_writer *writer);
+            // What the server listens and talks through, sockets unless set.
+            // The transport has to outlive the server. Set before open_server
+            void set_transport(transport &network);
+            // Times every packet from the kernel to check_packets, the tracer
+            // has to outlive the server. Set before open_server
+            void set_tracer(latency_tracer *tracer);
+            void set_latency_profile(latency_profile profile);
+            void set_rate_limit(rate_limit per_connection, rate_limit per_address = {});
+            rate_stats get_rate_stats();
+            void post_disconnect(int client_fd);
+            void post(std::function<void()> callback);
+            void post_shutdown();
             std::vector<int> readable;
             std::map<int, user<T>> users;
             std::mutex sync;
         private:
             void add_to_list(int sockfd);
             void remove_from_list(int fd);
+            void set_read_interest(user<T> &current_user, bool enabled);
+            void throttle(user<T> &current_user, uint64_t delay_ms);
+            void flush_user(int current_fd);
             void recv_th();
-            int epfd;
-            bool threads;
+            void arm_idle(user<T> &current_user);
+            void fire_timers();
+            command_handlers command_hooks();
+            bool inflate(packet_raw<T> &pkt);
+            void wake();
+            transport *net = &default_transport();
+            std::unique_ptr<poller> poll_set;
+            compression codec;
+            std::atomic<capture_writer *> capture = nullptr;
+            latency_profile latency;
+            latency_tracer *tracer = nullptr;
+            std::atomic_bool threads;
+            mpsc_queue<command> commands;
+            uint64_t idle_timeout;
+            timer_wheel timers;
+            std::map<int, scheduled_timer> scheduled;
+            int next_schedule_id;
+            std::vector<int> due_ids;
+            std::vector<int> idle_expired;
+            std::vector<int> rate_resumed;
+            rate_limiter limiter;
             std::thread recv_thread;
     };
 
+    class client_raw;
+
     class server_raw
     {
         public:
             server_raw()
             {
                 fd = 0;
-                epfd = 0;
                 threads = true;
                 memory_cap = false;
                 server_target_size = 0;
+                init_timers();
             }
             server_raw(bool server_target, int target_size)
             {
                 fd = 0;
-                epfd = 0;
                 threads = true;
                 memory_cap = false;
                 if (server_target)
                     server_target_size = target_size;
                 else
                     server_target_size = 0;
+                init_timers();
             }
             explicit server_raw(long cap_memory_size)
             :memory_cap_size(cap_memory_size)
             {
                 fd = 0;
-                epfd = 0;
                 threads = true;
                 memory_cap = true;
                 server_target_size = 0;
+                init_timers();
             }
             ~server_raw()
             {
-                threads = false;
-                recv_thread.join();
+                post_shutdown();
+                if (recv_thread.joinable())
+                    recv_thread.join();
+                // Their buffers go back to pool, which is destroyed first
+                users.clear();
             }
             int fd;
             void open_server(std::string address, short port);
+            // Passes the listener to the process waiting in resume_from at
+            // path. With connections they go too, buffered and unsent bytes
+            // included, and this server stops. Without them it keeps serving
+            // the ones it has and accepts no more. Timeouts are kept, framing
+            // isn't: it fails if a connection has framing of its own
+            bool hand_off(const std::string &path, bool connections = true);
+            // Starts from what hand_off sends instead of open_server, set the
+            // framing first
+            bool resume_from(const std::string &path);
+            // Joins client_fd to upstream_fd, from then on the reactor moves
+            // bytes between them in the kernel until both sides have closed.
+            // client_fd stops being a user, what it had buffered goes
+            // upstream first. The server owns upstream_fd. Relays aren't
+            // passed on by hand_off
+            bool relay(int client_fd, int upstream_fd);
+            // Takes over upstream's socket, it can't be used afterwards
+            bool relay(int client_fd, client_raw &upstream);
+            relay_stats get_relay_stats(int client_fd);
             void disconnect_user(int current_fd);
             char *receive_data(int current_fd, size_t size);
             char *receive_data_ensured(int current_fd, size_t size);
             char *get_line(int current_fd);
+            template<typename F>
+            size_t consume_lines(int current_fd, F &&callback);
+            void set_line_mode(std::string delimiter);
+            void set_line_mode(int client_fd, std::string delimiter);
+            std::pair<char *, size_t> receive_frame(int current_fd);
+            template<typename F>
+            size_t consume_frames(int current_fd, F &&callback);
+            void set_framing(frame_policy policy);
+            void set_framing(int client_fd, frame_policy policy);
             std::pair<char *, size_t> receive_everything(int current_fd);
-            template<typename ...T>
-            std::tuple<T...> read_packet(int current_fd, std::tuple<T...> packet);
+            template<typename Order = wire_order, typename ...T>
+            std::optional<std::tuple<T...>> read_packet(int current_fd, std::tuple<T...> packet);
             std::vector<int> get_readable();
             std::vector<int> wait_readable();
 
             void wait_readable_fd(int fd);
 
             void set_target(int client_fd, size_t target_s, bool permanent = false);
+            void set_idle_timeout(uint64_t timeout_ms);
+            void set_idle_timeout(int client_fd, uint64_t timeout_ms);
+            void set_read_timeout(int client_fd, uint64_t timeout_ms);
+            void set_write_timeout(int client_fd, uint64_t timeout_ms);
+            int schedule(uint64_t delay_ms, std::function<void()> callback);
+            void cancel_scheduled(int id);
+            void post_send(int client_fd, char *data, size_t size);
+            bool send_file(int client_fd, int file_fd, uint64_t offset, size_t length);
+            template<typename Order = wire_order, typename ...T>
+            bool send_file(int client_fd, std::tuple<T...> header, int file_fd, uint64_t offset, size_t length);
+            template<typename Order = wire_order, typename ...T>
+            void post_packet(int client_fd, std::tuple<T...> packet);
+            template<typename ...T>
+            void post_reply(int client_fd, uint32_t id, std::tuple<T...> packet);
+            void post_disconnect(int client_fd);
+            void post_target(int client_fd, size_t target_s, bool permanent = false);
+            void post(std::function<void()> callback);
+            void post_shutdown();
+            void subscribe(int client_fd, std::string topic);
+            void unsubscribe(int client_fd, std::string topic);
+            void set_topic_policy(std::string topic, slow_policy policy, size_t max_pending = TOPIC_MAX_PENDING);
+            template<typename Order = wire_order, typename ...T>
+            void publish(std::string topic, std::tuple<T...> packet);
+            void publish_data(std::string topic, char *data, size_t size);
+            topic_stats get_topic_stats(std::string topic);
+            // Records every frame read and queued for sending, null to stop
+            void set_capture(capture_writer *writer);
+            // What the server listens and talks through, sockets unless set.
+            // The transport has to outlive the server. Set before
+            // open_server, hand_off, resume_from and relay need sockets
+            void set_transport(transport &network);
+            // Times received bytes from the kernel until they are consumed,
+            // the tracer has to outlive the server. Set before open_server
+            void set_tracer(latency_tracer *tracer);
+            void set_latency_profile(latency_profile profile);
+            void set_rate_limit(rate_limit per_connection, rate_limit per_address = {});
+            rate_stats get_rate_stats();
+            connection_memory get_memory(int client_fd);
+            connection_memory get_total_memory();
+            buffer_pool_stats get_pool_stats();
             std::vector<int> readable;
             std::map<int, user_raw> users;
             std::mutex sync;
             void add_whitelist(std::vector<std::string> ips);
         private:
-            bool whitelist;
+            bool whitelist = false;
             std::vector<std::string> ip_whitelisted;
             void add_to_list(int sockfd);
             void remove_from_list(int fd);
             void recv_th();
-            int epfd;
-            bool threads;
+            void init_timers();
+            void arm_idle(user_raw &current_user);
+            void fire_timers();
+            void set_read_interest(user_raw &current_user, bool enabled);
+            void throttle(user_raw &current_user, uint64_t delay_ms);
+            void restore_user(handoff_connection &passed);
+            void release_user(int current_fd);
+            void restart_reactor();
+            void start_relay(int client_fd, int upstream_fd, std::string to_upstream, std::string to_client);
+            void pump_relay(int current_fd);
+            void set_relay_interest(int relay_fd, uint8_t &current, uint8_t wanted);
+            void flush_user(int current_fd);
+            void check_target(user_raw &current_user);
+            void mark_readable(user_raw &current_user);
+            bool scan_line(user_raw &current_user);
+            int scan_frame(user_raw &current_user, size_t from = 0);
+            size_t count_frames(user_raw &current_user, size_t size);
+            netlib::topic &find_topic(const std::string &name);
+            void fan_out(netlib::topic &current_topic, shared_buffer *buffer);
+            command_handlers command_hooks();
+            void wake();
+            transport *net = &default_transport();
+            std::unique_ptr<poller> poll_set;
+            mpsc_queue<command> commands;
+            uint64_t idle_timeout;
+            timer_wheel timers;
+            std::map<int, scheduled_timer> scheduled;
+            int next_schedule_id;
+            std::vector<int> due_ids;
+            std::vector<int> idle_expired;
+            std::vector<int> write_expired;
+            std::vector<int> rate_resumed;
+            rate_limiter limiter;
+            std::atomic_bool threads;
             int server_target_size;
+            std::string server_delimiter;
+            frame_policy server_framing = {0, nullptr, 0};
+            std::map<std::string, netlib::topic> topics;
+            int next_topic_id = 1;
+            std::map<int, std::shared_ptr<relay_link>> relays;
+            std::atomic<capture_writer *> capture = nullptr;
+            buffer_pool pool;
+            latency_profile latency;
+            latency_tracer *tracer = nullptr;
             bool memory_cap;
             long memory_cap_size;
             std::condition_variable readable_cv;
@@ -175,26 +415,40 @@ namespace netlib
         cli_raw()
         {
             fd = 0;
-            data = (char *)calloc(1024, sizeof(char));
+            data = nullptr;
             data_size = 0;
-            alloc_size = 1024;
+            alloc_size = 0;
+            pool = &default_pool();
         }
         cli_raw(int sockfd)
         :fd(sockfd)
         {
-            data = (char *)calloc(1024, sizeof(char));
+            data = nullptr;
             data_size = 0;
-            alloc_size = 1024;
+            alloc_size = 0;
+            pool = &default_pool();
+        }
+        ~cli_raw()
+        {
+            pool->release(data, alloc_size);
         }
         int fd;
         char *data;
         size_t data_size;
         size_t alloc_size;
-        void add_data(char *new_data, size_t size);
+        buffer_pool *pool;
+        void add_data(char *new_data, size_t size, uint64_t kernel_ns = 0);
         void remove_data(size_t size);
+        // remove_data for callers already holding sync
+        void drop_data(size_t size);
         char *receive_data(size_t size);
+        void mark_ready();
         std::atomic_bool readable;
         std::mutex sync;
+        latency_tracer *tracer = nullptr;
+        trace_state trace;
+        outbound_queue outbound;
+        bool write_interest = false;
     };
     
     class client_raw
@@ -203,190 +457,368 @@ namespace netlib
             client_raw()
             {
                 fd = 0;
-                epfd = 0;
                 threads = true;
                 readable = false;
+                pipelined = false;
+                next_id = 1;
             }
             ~client_raw()
             {
-                threads = false;
-                recv_thread.join();
+                post_shutdown();
+                if (recv_thread.joinable())
+                    recv_thread.join();
             }
             int fd;
             void connect_to_server(std::string address, short port);
+            void set_latency_profile(latency_profile profile);
+            // Sockets unless set, the transport has to outlive the client.
+            // Set before connect_to_server
+            void set_transport(transport &network);
+            // Set before connect_to_server
+            void set_tracer(latency_tracer *tracer);
             void disconnect_from_server();
             char *receive_data(int current_fd, size_t size);
-            template<typename ...T>
-            std::tuple<T...> read_packet(int current_fd, std::tuple<T...> packet);
+            template<typename Order = wire_order, typename ...T>
+            std::optional<std::tuple<T...>> read_packet(int current_fd, std::tuple<T...> packet);
+            void post_send(char *data, size_t size);
+            // Stops the reactor and gives up the socket with whatever was
+            // buffered either way, for server_raw::relay. -1 if not connected
+            // or not on sockets
+            int detach(std::string &inbound, std::string &outbound);
+            bool send_file(int file_fd, uint64_t offset, size_t length);
+            template<typename Order = wire_order, typename ...T>
+            bool send_file(std::tuple<T...> header, int file_fd, uint64_t offset, size_t length);
+            template<typename Order = wire_order, typename ...T>
+            void post_packet(std::tuple<T...> packet);
+            template<typename R, typename ...T>
+            std::future<R> request(std::tuple<T...> packet, R response = R{});
+            void post(std::function<void()> callback);
+            void post_shutdown();
             std::atomic_bool readable;
             std::mutex sync;
         private:
             cli_raw serv;
             void recv_th();
-            int epfd;
-            bool threads;
+            void flush_server();
+            command_handlers command_hooks();
+            void dispatch_responses();
+            bool pipelined;
+            uint32_t next_id;
+            std::map<uint32_t, std::function<void(struct packet)>> pending;
+            latency_profile latency;
+            latency_tracer *tracer = nullptr;
+            void wake();
+            transport *net = &default_transport();
+            std::unique_ptr<poller> poll_set;
+            std::atomic_bool threads;
+            mpsc_queue<command> commands;
             std::thread recv_thread;
     };
     
-    template <typename... T>
-    inline std::tuple<T...> client_raw::read_packet(int current_fd, std::tuple<T...> packet)
+    // Decodes straight from the receive buffer, empty when fewer than the
+    // packet's bytes have arrived and then nothing is consumed
+    template <typename Order, typename... T>
+    inline std::optional<std::tuple<T...>> client_raw::read_packet(int current_fd, std::tuple<T...> packet)
     {
-        constexpr std::size_t size_tuple = std::tuple_size_v<decltype(packet)>;
-        int size = 0;
-        const_for_<size_tuple>([&](auto i){size += sizeof(std::get<i.value>(packet));});
-        
+        using layout = fixed_layout<std::tuple<T...>>;
+
         std::lock_guard<std::mutex> lock(sync);
-        
+
         auto &current_user = serv;
-        
-        char *data = current_user.receive_data(size);
-        struct packet pkt = {size, size, data, data};
-        packet = netlib::read_packet(packet, pkt);
+
+        {
+            std::lock_guard<std::mutex> data_lock(current_user.sync);
+            if (current_user.data_size < layout::size)
+                return std::nullopt;
+            layout::template load<Order>(current_user.data, packet);
+        }
+        current_user.remove_data(layout::size);
         return packet;
     }
+    template <typename Order, typename... T>
+    inline void client_raw::post_packet(std::tuple<T...> packet)
+    {
+        char_size buff = netlib::encode_packet<Order>(packet);
+        if (!buff.start_data)
+            return;
+        commands.push({.type = command_type::SEND, .fd = fd, .data = buff.start_data, .size = (size_t)buff.consumed_size});
+        wake();
+    }
+    // header is encoded like post_packet and leads the file in one segment
+    template <typename Order, typename... T>
+    inline bool client_raw::send_file(std::tuple<T...> header, int file_fd, uint64_t offset, size_t length)
+    {
+        char_size buff = netlib::encode_packet<Order>(header);
+        if (!buff.start_data)
+            return false;
+        command cmd = file_command(fd, buff.start_data, buff.consumed_size, file_fd, offset, length);
+        if (cmd.file_fd == -1)
+            return false;
+        commands.push(std::move(cmd));
+        wake();
+        return true;
+    }
+    // Sends packet with a correlation id and returns a future for the reply.
+    // Any number of requests can be in flight, replies may come back in any
+    // order. Once used, incoming data is only delivered through these futures
+    template <typename R, typename... T>
+    inline std::future<R> client_raw::request(std::tuple<T...> packet, R response)
+    {
+        auto promise = std::make_shared<std::promise<R>>();
+        std::future<R> ret = promise->get_future();
+
+        std::unique_lock<std::mutex> lock(sync);
+        uint32_t id = next_id++;
+        // Dropping the promise breaks the future, nothing goes out
+        char_size buff = netlib::encode_pipelined(id, packet);
+        if (!buff.start_data)
+            return ret;
+        pipelined = true;
+        pending[id] = [promise, response](struct packet body) { promise->set_value(netlib::read_packet(response, body)); };
+        lock.unlock();
+
+        commands.push({.type = command_type::SEND, .fd = fd, .data = buff.start_data, .size = (size_t)buff.consumed_size});
+        wake();
+        return ret;
+    }
     template <typename... T>
-    inline std::tuple<T...> server_raw::read_packet(int current_fd, std::tuple<T...> packet)
+    inline void server_raw::post_reply(int current_fd, uint32_t id, std::tuple<T...> packet)
+    {
+        char_size buff = netlib::encode_pipelined(id, packet);
+        if (!buff.start_data)
+            return;
+        commands.push({.type = command_type::SEND, .fd = current_fd, .data = buff.start_data, .size = (size_t)buff.consumed_size});
+        wake();
+    }
+    // Encodes once, the reactor queues the same buffer to every subscriber
+    template <typename Order, typename... T>
+    inline void server_raw::publish(std::string topic, std::tuple<T...> packet)
+    {
+        char_size buff = netlib::encode_packet<Order>(packet);
+        if (!buff.start_data)
+            return;
+        commands.push({.type = command_type::PUBLISH, .shared = make_shared_buffer(buff.start_data, buff.consumed_size), .topic = std::move(topic)});
+        wake();
+    }
+    template <typename Order, typename... T>
+    inline void server_raw::post_packet(int current_fd, std::tuple<T...> packet)
+    {
+        char_size buff = netlib::encode_packet<Order>(packet);
+        if (!buff.start_data)
+            return;
+        commands.push({.type = command_type::SEND, .fd = current_fd, .data = buff.start_data, .size = (size_t)buff.consumed_size});
+        wake();
+    }
+    // header is encoded like post_packet and leads the file in one segment
+    template <typename Order, typename... T>
+    inline bool server_raw::send_file(int current_fd, std::tuple<T...> header, int file_fd, uint64_t offset, size_t length)
+    {
+        char_size buff = netlib::encode_packet<Order>(header);
+        if (!buff.start_data)
+            return false;
+        command cmd = file_command(current_fd, buff.start_data, buff.consumed_size, file_fd, offset, length);
+        if (cmd.file_fd == -1)
+            return false;
+        commands.push(std::move(cmd));
+        wake();
+        return true;
+    }
+    // Hands every complete line to callback(std::string_view) without the
+    // delimiter and without copying, the view is only valid during the call.
+    // The callback runs with sync held, calling back into the server from it
+    // deadlocks, post_* and publish don't take sync. Returns how many lines
+    // were consumed
+    template <typename F>
+    inline size_t server_raw::consume_lines(int current_fd, F &&callback)
     {
-        constexpr std::size_t size_tuple = std::tuple_size_v<decltype(packet)>;
-        int size = 0;
-        const_for_<size_tuple>([&](auto i){size += sizeof(std::get<i.value>(packet));});
-        
         std::lock_guard<std::mutex> lock(sync);
-        
         auto current_user_test = users.find(current_fd);
         if (current_user_test == users.end())
-            return packet;
+            return 0;
         auto &current_user = current_user_test->second;
-        
-        if (size == current_user.data_size)
+        size_t delimiter_size = current_user.delimiter.empty() ? 2 : current_user.delimiter.size();
+        size_t consumed = 0;
+        size_t lines = 0;
+        while (scan_line(current_user))
+        {
+            callback(std::string_view(current_user.data + consumed, current_user.line_end - consumed - delimiter_size));
+            consumed = current_user.line_end;
+            current_user.scan_offset = consumed;
+            current_user.line_end = 0;
+            lines++;
+        }
+        current_user.remove_data(consumed);
+        if (!scan_line(current_user))
             readable.erase(std::remove(readable.begin(), readable.end(), current_fd), readable.end());
-        char *data = current_user.receive_data(size);
-        struct packet pkt = {size, size, data, data};
-        packet = netlib::read_packet(packet, pkt);
-        return packet;
+        return lines;
     }
-}
-template <typename T>
-inline void netlib::server<T>::open_server(std::string address, short port)
-{
-    fd = socket(AF_INET, SOCK_STREAM, 0);
-    sockaddr_in addr = {0};
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(port);
-    
-    if (inet_pton(AF_INET, address.c_str(), &(addr.sin_addr)) == -1)
+    // Hands every complete frame (header included) to callback(packet) in
+    // place, the packet is only valid during the call and can be fed straight
+    // to netlib::read_packet. Like consume_lines the callback runs with sync
+    // held, which keeps the reactor from moving the buffer under it. Returns
+    // how many frames were consumed
+    template <typename F>
+    inline size_t server_raw::consume_frames(int current_fd, F &&callback)
     {
-        std::println("Inet pton failed! {}", strerror(errno));
-        close(fd);
-        return ;
+        std::lock_guard<std::mutex> lock(sync);
+        auto current_user_test = users.find(current_fd);
+        if (current_user_test == users.end())
+            return 0;
+        auto &current_user = current_user_test->second;
+        size_t consumed = 0;
+        size_t frames = 0;
+        int status = 0;
+        while ((status = scan_frame(current_user, consumed)) == 1)
+        {
+            int frame_size = current_user.frame_end - consumed;
+            struct packet pkt = {frame_size, frame_size, current_user.data + consumed, current_user.data + consumed};
+            callback(pkt);
+            consumed = current_user.frame_end;
+            current_user.frame_end = 0;
+            frames++;
+        }
+        current_user.remove_data(consumed);
+        // Only the reactor closes, it may be reading this fd right now
+        if (status == -1)
+            post_disconnect(current_fd);
+        if (status == -1 || scan_frame(current_user) != 1)
+            readable.erase(std::remove(readable.begin(), readable.end(), current_fd), readable.end());
+        return frames;
     }
-    if (bind(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) == -1)
+    // Same as client_raw::read_packet, short buffers are left alone
+    template <typename Order, typename... T>
+    inline std::optional<std::tuple<T...>> server_raw::read_packet(int current_fd, std::tuple<T...> packet)
     {
-        std::println("Bind failed! {}", strerror(errno));
-        close(fd);
-        return ;
+        using layout = fixed_layout<std::tuple<T...>>;
+
+        std::lock_guard<std::mutex> lock(sync);
+
+        auto current_user_test = users.find(current_fd);
+        if (current_user_test == users.end())
+            return std::nullopt;
+        auto &current_user = current_user_test->second;
+
+        {
+            // Appending may move the buffer
+            std::lock_guard<std::mutex> data_lock(current_user.sync);
+            if (current_user.data_size < layout::size)
+                return std::nullopt;
+            layout::template load<Order>(current_user.data, packet);
+        }
+        current_user.remove_data(layout::size);
+        if (current_user.data_size == 0)
+            readable.erase(std::remove(readable.begin(), readable.end(), current_fd), readable.end());
+        return packet;
     }
-    if (listen(fd, 10) == -1)
-    {
-        std::println("Listen failed!");
-        close(fd);
+}
+template <typename T, typename Order>
+inline void netlib::server<T, Order>::open_server(std::string address, short port)
+{
+    fd = net->listen(address, port, latency);
+    if (fd == -1)
         return ;
-    }
-    #if defined(__APPLE__) || defined(__FreeBSD__)
-    epfd = kqueue();
-    #elif defined(__linux__)
-    epfd = epoll_create1(0);
-    #endif
+    poll_set = net->open_poller(latency);
     add_to_list(fd);
     recv_thread = std::thread([this]() { this->recv_th(); });
 }
-template<typename T>
-void netlib::server<T>::disconnect_user(int current_fd)
+template <typename T, typename Order>
+void netlib::server<T, Order>::disconnect_user(int current_fd)
 {
+    auto current_user_test = users.find(current_fd);
+    if (current_user_test != users.end())
+        limiter.detach(current_user_test->second.rate);
     remove_from_list(current_fd);
     std::println("Removed fd {} from epoll", current_fd);
-    close(current_fd);
+    net->close(current_fd);
     users.erase(current_fd);
     readable.erase(std::remove(readable.begin(), readable.end(), current_fd), readable.end());
 }
 
-#if defined(__APPLE__) || defined(__FreeBSD__)
-template <typename T>
-void netlib::server<T>::add_to_list(int sockfd)
+template <typename T, typename Order>
+void netlib::server<T, Order>::add_to_list(int sockfd)
 {
-    struct kevent ev;
-    EV_SET(&ev, sockfd, EVFILT_READ, EV_ADD, 0, 0, 0);
-    kevent(epfd, &ev, 1, NULL, 0, NULL);
+    poll_set->watch(sockfd, TRANSPORT_READ);
 }
 
-template<typename T>
-void netlib::server<T>::remove_from_list(int fd)
+template <typename T, typename Order>
+void netlib::server<T, Order>::remove_from_list(int fd)
 {
-    struct kevent ev;
-    EV_SET(&ev, fd, EVFILT_READ, EV_DELETE, 0, 0, 0);
-    kevent(epfd, &ev, 1, NULL, 0, NULL);
+    poll_set->watch(fd, 0);
 }
-#elif defined(__linux__)
-template<typename T>
-void netlib::server<T>::add_to_list(int sockfd)
+
+template <typename T, typename Order>
+void netlib::server<T, Order>::set_read_interest(user<T> &current_user, bool enabled)
 {
-    epoll_event event;
-    event.data.fd = fd;
-    event.events = EPOLLIN;
-    epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &event);
+    poll_set->watch(current_user.fd, (enabled ? TRANSPORT_READ : 0) | (current_user.write_interest ? TRANSPORT_WRITE : 0));
 }
 
-template<typename T>
-void netlib::server<T>::remove_from_list(int fd)
+// Stops reading the connection until its buckets have refilled
+template <typename T, typename Order>
+void netlib::server<T, Order>::throttle(user<T> &current_user, uint64_t delay_ms)
 {
-    epoll_ctl(epfd, EPOLL_CTL_DEL, fd, nullptr);
+    int current_fd = current_user.fd;
+    limiter.pause(current_user.rate);
+    set_read_interest(current_user, false);
+    if (!current_user.rate.resume_timer.callback)
+        current_user.rate.resume_timer.callback = [this, current_fd]() { rate_resumed.push_back(current_fd); };
+    timers.arm(&current_user.rate.resume_timer, delay_ms);
 }
-#endif
 
-template <typename T>
-inline void netlib::server<T>::recv_th()
+template <typename T, typename Order>
+inline void netlib::server<T, Order>::recv_th()
 {
+    command_handlers handlers = command_hooks();
     int events_ready = 0;
-    #if defined(__APPLE__) || defined(__FreeBSD__)
-    struct kevent events[1024];
-    struct timespec timeout;
-    timeout.tv_sec = 0;
-    timeout.tv_nsec = 500000000; //500ms
-    #elif defined(__linux__)
-    epoll_event events[1024];
-    #endif
+    transport_event events[1024];
     int status = 0;
+    pin_thread(latency.cpu);
     while (threads == true)
     {
-        #if defined(__APPLE__) || defined(__FreeBSD__)
-        events_ready = kevent(epfd, NULL, 0, events, 1024, &timeout);
-        #elif defined(__linux__)
-        events_ready = epoll_wait(epfd, events, 1024, 500);
-        #endif
+        std::unique_lock<std::mutex> timer_lock(sync);
+        int wait_ms = timers.next_timeout(timers.now_ms());
+        timer_lock.unlock();
+        if (wait_ms == -1 || wait_ms > 500)
+            wait_ms = 500;
+        events_ready = poll_set->wait(events, 1024, wait_ms);
         if (events_ready == -1)
         {
+            if (errno == EINTR)
+                continue;
             std::println("Epoll/kqueue failed {}", strerror(errno));
             break;
         }
         for (int i = 0; i < events_ready; i++)
         {
-            #if defined(__APPLE__) || defined(__FreeBSD__)
-            int current_fd = events[i].ident;
-            #elif defined(__linux__)
-            int current_fd = events[i].data.fd;
-            #endif
+            int current_fd = events[i].fd;
+            bool writable = events[i].writable;
+            bool read_event = events[i].readable;
+            bool hangup = events[i].hangup;
+            if (writable && current_fd != fd)
+            {
+                std::lock_guard<std::mutex> lock(sync);
+                flush_user(current_fd);
+            }
+            if (!read_event)
+                continue;
             if (current_fd == fd)
             {
-                sockaddr_in addr = {0};
-                unsigned int addr_size = sizeof(addr);
+                uint32_t ip = 0;
                 char str[INET_ADDRSTRLEN];
-                int new_client = accept(fd, (sockaddr *)&addr, &addr_size);
+                int new_client = net->accept(fd, ip);
+                if (new_client == -1)
+                    continue;
                 std::println("Client accepted");
+                net->tune(new_client, latency);
                 add_to_list(new_client);
-                struct in_addr ipAddr = addr.sin_addr;
+                struct in_addr ipAddr = {ip};
                 std::println("{} connected", inet_ntop(AF_INET, &ipAddr, str, INET_ADDRSTRLEN));
                 std::println("New fd {}", new_client);
-                users.emplace(std::piecewise_construct, std::forward_as_tuple(new_client), std::forward_as_tuple(new_client));
+                if (tracer)
+                    net->enable_timestamps(new_client);
+                std::lock_guard<std::mutex> lock(sync);
+                auto new_user = users.emplace(std::piecewise_construct, std::forward_as_tuple(new_client), std::forward_as_tuple(new_client));
+                limiter.attach(new_user.first->second.rate, ip);
+                arm_idle(new_user.first->second);
                 continue;
             }
             auto current_user_prov = users.find(current_fd);
@@ -396,9 +828,30 @@ inline void netlib::server<T>::recv_th()
                 continue;
             }
             auto &current_user = current_user_prov->second;
+            // A hangup is read regardless so the disconnect isn't held up
+            if (limiter.enabled() && !hangup)
+            {
+                uint64_t delay_ms = limiter.blocked_ms(current_user.rate);
+                if (delay_ms > 0)
+                {
+                    std::lock_guard<std::mutex> lock(sync);
+                    throttle(current_user, delay_ms);
+                    continue;
+                }
+            }
 
             T head = 0;
-            status = recv(current_fd, &head, sizeof(T), MSG_PEEK);
+            status = net->recv(current_fd, &head, sizeof(T), MSG_PEEK);
+            // Sockets are non blocking, readiness may have been spurious
+            if (status == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                continue;
+            head = read_type<T, Order>((char *)&head);
+            bool compressed = false;
+            if constexpr (sizeof(T) > 1)
+            {
+                compressed = head & compressed_flag<T>;
+                head &= ~compressed_flag<T>;
+            }
             if (status == -1 || status == 0 || head > MAX_PACKET_SIZE)
             {
                 std::lock_guard<std::mutex> lock(sync);
@@ -408,7 +861,9 @@ inline void netlib::server<T>::recv_th()
             packet_raw<T> pkt= {0};
             pkt.size = head + sizeof(T);
             pkt.data = (char *)calloc(head + sizeof(T) + 1, sizeof(char));
-            status = recv(current_fd, pkt.data, pkt.size, 0);
+            uint64_t kernel_ns = 0;
+            status = net->recv(current_fd, pkt.data, pkt.size, 0, tracer ? &kernel_ns : nullptr);
+            uint64_t reactor_ns = tracer ? latency_tracer::now_ns() : 0;
             if (status == -1 || status == 0)
             {
                 std::lock_guard<std::mutex> lock(sync);
@@ -420,7 +875,11 @@ inline void netlib::server<T>::recv_th()
             while (data_recv < head + sizeof(T))
             {
                 int data_left = (head + sizeof(T)) - data_recv; 
-                status = recv(current_fd, &pkt.data[data_recv], data_left, 0);
+                status = net->recv(current_fd, &pkt.data[data_recv], data_left, 0);
+                // The rest of the packet is on its way, wait for it as a
+                // blocking socket would
+                if (status == -1 && (errno == EAGAIN || errno == EWOULDBLOCK) && wait_socket(current_fd, POLLIN))
+                    continue;
                 if (status == -1 || status == 0)
                 {
                     std::lock_guard<std::mutex> lock(sync);
@@ -432,25 +891,345 @@ inline void netlib::server<T>::recv_th()
             }
             if (user_disconnect == true)
                 continue;
+            limiter.charge(current_user.rate, pkt.size, 1);
+            net->after_read(current_fd, latency);
+            // Captured as it came off the wire so a replay sends the same bytes
+            if (capture_writer *writer = capture.load())
+                writer->record(current_fd, capture_direction::INBOUND, pkt.data, pkt.size);
+            if (compressed && !inflate(pkt))
+            {
+                std::lock_guard<std::mutex> lock(sync);
+                disconnect_user(current_fd);
+                continue;
+            }
+            if (tracer)
+            {
+                pkt.ready_ns = latency_tracer::now_ns();
+                tracer->frame_ready(kernel_ns, reactor_ns, pkt.ready_ns);
+            }
             std::lock_guard<std::mutex> lock(sync);
             current_user.packets.push_back(pkt);
+            arm_idle(current_user);
             if (std::find(readable.begin(), readable.end(), current_fd) == readable.end())
                 readable.push_back(current_fd);
         }
+        fire_timers();
+        if (!run_commands(commands, handlers, &sync))
+            threads = false;
     }
 }
 
-template <typename T>
-std::map<int, std::vector<packet_raw<T>>> netlib::server<T>::check_packets()
+template <typename T, typename Order>
+void netlib::server<T, Order>::flush_user(int current_fd)
+{
+    auto current_user_test = users.find(current_fd);
+    if (current_user_test == users.end())
+        return;
+    auto &current_user = current_user_test->second;
+    if (flush_outbound(current_user.outbound, current_fd, *net, *poll_set, current_user.write_interest, !current_user.rate.paused) == -1)
+        disconnect_user(current_fd);
+}
+
+// The hooks run with sync held
+template <typename T, typename Order>
+netlib::command_handlers netlib::server<T, Order>::command_hooks()
+{
+    return {
+        .outbound = [this](int current_fd) -> outbound_queue *
+        {
+            auto current_user_test = users.find(current_fd);
+            return current_user_test == users.end() ? nullptr : &current_user_test->second.outbound;
+        },
+        .flush = [this](int current_fd) { flush_user(current_fd); },
+        .record = [this](int current_fd, const char *data, size_t size)
+        {
+            if (capture_writer *writer = capture.load())
+                writer->record(current_fd, capture_direction::OUTBOUND, data, size);
+        },
+        .disconnect = [this](int current_fd)
+        {
+            if (users.contains(current_fd))
+                disconnect_user(current_fd);
+        }
+    };
+}
+
+template <typename T, typename Order>
+void netlib::server<T, Order>::post_send(int client_fd, char *data, size_t size)
+{
+    char *copy = (char *)malloc(size);
+    memcpy(copy, data, size);
+    commands.push({.type = command_type::SEND, .fd = client_fd, .data = copy, .size = size});
+    wake();
+}
+
+// Queues length bytes of file_fd from offset, sent by the kernel without
+// passing through user space. file_fd is dup'd, the caller keeps its own
+template <typename T, typename Order>
+bool netlib::server<T, Order>::send_file(int client_fd, int file_fd, uint64_t offset, size_t length)
+{
+    command cmd = file_command(client_fd, nullptr, 0, file_fd, offset, length);
+    if (cmd.file_fd == -1)
+        return false;
+    commands.push(std::move(cmd));
+    wake();
+    return true;
+}
+
+template <typename T, typename Order>
+template <typename ...U>
+bool netlib::server<T, Order>::send_file(int client_fd, std::tuple<U...> header, int file_fd, uint64_t offset, size_t length)
+{
+    char_size buff = netlib::encode_packet<Order>(header);
+    if (!buff.start_data)
+        return false;
+    command cmd = file_command(client_fd, buff.start_data, buff.consumed_size, file_fd, offset, length);
+    if (cmd.file_fd == -1)
+        return false;
+    commands.push(std::move(cmd));
+    wake();
+    return true;
+}
+
+template <typename T, typename Order>
+template <typename ...U>
+void netlib::server<T, Order>::post_packet(int client_fd, std::tuple<U...> packet)
+{
+    char_size buff = netlib::encode_packet<Order>(packet);
+    if (!buff.start_data)
+        return;
+    commands.push({.type = command_type::SEND, .fd = client_fd, .data = buff.start_data, .size = (size_t)buff.consumed_size});
+    wake();
+}
+
+// Frames like send_framed, compressed with the options from set_compression
+template <typename T, typename Order>
+template <typename ...U>
+void netlib::server<T, Order>::post_framed(int client_fd, std::tuple<U...> packet)
+{
+    char_size buff = netlib::encode_framed<T, Order>(packet, &codec);
+    if (!buff.start_data)
+        return;
+    commands.push({.type = command_type::SEND, .fd = client_fd, .data = buff.start_data, .size = (size_t)buff.consumed_size});
+    wake();
+}
+
+// Set before open_server, the reactor reads it without locking
+template <typename T, typename Order>
+void netlib::server<T, Order>::set_compression(compression options)
+{
+    codec = std::move(options);
+}
+
+template <typename T, typename Order>
+void netlib::server<T, Order>::set_capture(capture_writer *writer)
+{
+    capture = writer;
+}
+
+template <typename T, typename Order>
+void netlib::server<T, Order>::set_transport(transport &network)
+{
+    net = &network;
+}
+
+template <typename T, typename Order>
+void netlib::server<T, Order>::set_tracer(latency_tracer *packet_tracer)
+{
+    tracer = packet_tracer;
+}
+
+// Set before open_server
+template <typename T, typename Order>
+void netlib::server<T, Order>::set_latency_profile(latency_profile profile)
+{
+    latency = profile;
+}
+
+// Set before open_server
+template <typename T, typename Order>
+void netlib::server<T, Order>::set_rate_limit(rate_limit per_connection, rate_limit per_address)
+{
+    limiter.configure(per_connection, per_address);
+}
+
+template <typename T, typename Order>
+netlib::rate_stats netlib::server<T, Order>::get_rate_stats()
+{
+    return limiter.stats();
+}
+
+// Swaps a compressed packet for its expanded body behind a plain header
+template <typename T, typename Order>
+bool netlib::server<T, Order>::inflate(packet_raw<T> &pkt)
+{
+    size_t raw_size = 0;
+    size_t max_raw = MAX_DECOMPRESSED_SIZE;
+    if constexpr (sizeof(T) < sizeof(size_t))
+        max_raw = std::min(max_raw, (size_t)(std::make_unsigned_t<T>)~compressed_flag<T>);
+    char *raw = codec.decompress(pkt.data + sizeof(T), pkt.size - sizeof(T), sizeof(T), raw_size, max_raw);
+    free(pkt.data);
+    pkt.data = raw;
+    if (!raw)
+        return false;
+    write_type<T, Order>(raw, (T)raw_size);
+    raw[sizeof(T) + raw_size] = '\0';
+    pkt.size = raw_size + sizeof(T);
+    return true;
+}
+
+template <typename T, typename Order>
+void netlib::server<T, Order>::post_disconnect(int client_fd)
+{
+    commands.push({.type = command_type::DISCONNECT, .fd = client_fd});
+    wake();
+}
+
+template <typename T, typename Order>
+void netlib::server<T, Order>::post(std::function<void()> callback)
+{
+    commands.push({.type = command_type::CALL, .callback = std::move(callback)});
+    wake();
+}
+
+template <typename T, typename Order>
+void netlib::server<T, Order>::post_shutdown()
+{
+    threads = false;
+    commands.push({.type = command_type::SHUTDOWN});
+    wake();
+}
+
+template <typename T, typename Order>
+void netlib::server<T, Order>::wake()
+{
+    if (poll_set)
+        poll_set->wake();
+}
+
+template <typename T, typename Order>
+void netlib::server<T, Order>::arm_idle(user<T> &current_user)
+{
+    if (idle_timeout == 0)
+        return;
+    int current_fd = current_user.fd;
+    if (!current_user.idle_timer.callback)
+        current_user.idle_timer.callback = [this, current_fd]() { idle_expired.push_back(current_fd); };
+    timers.arm(&current_user.idle_timer, idle_timeout);
+}
+
+template <typename T, typename Order>
+void netlib::server<T, Order>::fire_timers()
+{
+    std::vector<std::function<void()>> due;
+    std::unique_lock<std::mutex> lock(sync);
+    timers.advance(timers.now_ms());
+    for (int current_fd : idle_expired)
+    {
+        std::println("fd {} idle timeout", current_fd);
+        if (users.contains(current_fd))
+            disconnect_user(current_fd);
+    }
+    idle_expired.clear();
+    for (int current_fd : rate_resumed)
+    {
+        auto current_user_test = users.find(current_fd);
+        if (current_user_test == users.end())
+            continue;
+        limiter.resume(current_user_test->second.rate);
+        set_read_interest(current_user_test->second, true);
+    }
+    rate_resumed.clear();
+    for (int id : due_ids)
+    {
+        auto it = scheduled.find(id);
+        if (it == scheduled.end())
+            continue;
+        due.push_back(std::move(it->second.callback));
+        scheduled.erase(it);
+    }
+    due_ids.clear();
+    lock.unlock();
+    for (auto &callback : due)
+        callback();
+}
+
+template <typename T, typename Order>
+void netlib::server<T, Order>::set_idle_timeout(uint64_t timeout_ms)
+{
+    std::lock_guard<std::mutex> lock(sync);
+    idle_timeout = timeout_ms;
+    for (auto &[current_fd, current_user] : users)
+    {
+        if (timeout_ms == 0)
+            timers.cancel(&current_user.idle_timer);
+        else
+            arm_idle(current_user);
+    }
+}
+
+template <typename T, typename Order>
+int netlib::server<T, Order>::schedule(uint64_t delay_ms, std::function<void()> callback)
+{
+    std::lock_guard<std::mutex> lock(sync);
+    int id = next_schedule_id++;
+    auto &entry = scheduled.try_emplace(id).first->second;
+    entry.callback = std::move(callback);
+    entry.timer.callback = [this, id]() { due_ids.push_back(id); };
+    timers.arm(&entry.timer, delay_ms);
+    wake();
+    return id;
+}
+
+template <typename T, typename Order>
+void netlib::server<T, Order>::cancel_scheduled(int id)
+{
+    std::lock_guard<std::mutex> lock(sync);
+    scheduled.erase(id);
+}
+
+template <typename T, typename Order>
+std::map<int, std::vector<packet_raw<T>>> netlib::server<T, Order>::check_packets()
 {
     std::unique_lock<std::mutex> lock(sync);
     std::map<int, std::vector<packet_raw<T>>> ret;
     for (auto current_fd: readable)
     {
-        user<T> &current_user = users.find(current_fd)->second;
+        auto current_user_test = users.find(current_fd);
+        if (current_user_test == users.end())
+            continue;
+        user<T> &current_user = current_user_test->second;
+        if (tracer)
+            for (auto &pkt : current_user.packets)
+                tracer->frame_consumed(pkt.ready_ns);
         ret.emplace(std::piecewise_construct, std::forward_as_tuple(current_fd), std::forward_as_tuple(current_user.packets));
         current_user.packets.clear();
-        readable.erase(std::remove(readable.begin(), readable.end(), current_fd), readable.end());
     }
+    readable.clear();
     return ret;
 }
+
+template <typename T, typename Order>
+template <typename Protocol, typename F>
+size_t netlib::server<T, Order>::dispatch_packets(F &&handler)
+{
+    size_t dispatched = 0;
+    for (auto &[current_fd, packets] : check_packets())
+    {
+        bool rejected = false;
+        for (auto &pkt : packets)
+        {
+            struct packet body = {(int)(pkt.size - sizeof(T)), (int)(pkt.size - sizeof(T)), pkt.data + sizeof(T), pkt.data};
+            if (!rejected && Protocol::template dispatch<Order>(body, handler, current_fd) == -1)
+            {
+                std::println("Unknown or short message from {}", current_fd);
+                post_disconnect(current_fd);
+                rejected = true;
+            }
+            else if (!rejected)
+                dispatched++;
+            free(pkt.data);
+        }
+    }
+    return dispatched;
+}
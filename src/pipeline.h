@@ -0,0 +1,42 @@
+#pragma once
+#include <tuple>
+#include <cstdint>
+#include "comp_time_read.h"
+#include "comp_time_write.h"
+#include "framing.h"
+
+// Pipelined frames are [uint32 body size][uint32 correlation id][body], the
+// body being a regular tuple encoded packet. Replies carry the request's id
+namespace netlib
+{
+    using pipeline_header = std::tuple<uint32_t, uint32_t>;
+    using pipeline_framing = length_prefix<pipeline_header, 0>;
+
+    inline frame_policy pipeline_policy()
+    {
+        return pipeline_framing::policy();
+    }
+
+    template<typename ...T>
+    char_size encode_pipelined(uint32_t id, std::tuple<T...> packet)
+    {
+        char_size buff = netlib::encode_packet(std::tuple_cat(std::make_tuple((uint32_t)0, id), packet));
+        if (!buff.start_data)
+            return buff;
+        write_type<uint32_t>(buff.start_data, buff.consumed_size - pipeline_framing::header_size);
+        return buff;
+    }
+
+    inline uint32_t pipeline_id(struct packet frame)
+    {
+        return read_type<uint32_t>(frame.data + field_offset<1, uint32_t, uint32_t>());
+    }
+
+    // The body of a whole frame, ready for netlib::read_packet
+    inline struct packet pipeline_body(struct packet frame)
+    {
+        int size = frame.size - pipeline_framing::header_size;
+        char *body = frame.data + pipeline_framing::header_size;
+        return {size, size, body, body};
+    }
+}
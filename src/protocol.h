@@ -0,0 +1,217 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <concepts>
+#include <type_traits>
+#include <utility>
+#include <variant>
+#include "compress.h"
+#include "fixed_layout.h"
+
+// A protocol is a compile time list of (id, message) pairs, each message a
+// tuple or an aggregate. Packets are [Id][message] and dispatch reads the id,
+// decodes the matching message on the stack and calls the handler for it:
+//
+//     using chat = netlib::protocol<uint8_t,
+//         netlib::message<1, std::tuple<uint32_t, netlib::prefixed<std::string>>>,
+//         netlib::message<2, login>>;
+//     chat::dispatch(pkt, netlib::overloaded{
+//         [](std::tuple<uint32_t, netlib::prefixed<std::string>> &say) {...},
+//         [](login &request) {...}});
+//
+// A handler that misses a message is a compile error, an unknown id is -1
+namespace netlib
+{
+    template<auto Id, typename M>
+    struct message
+    {
+        static constexpr auto id = Id;
+        using type = M;
+    };
+
+    template<typename ...F>
+    struct overloaded : F...
+    {
+        using F::operator()...;
+    };
+
+    // Ids spread wider than this many slots per message use a sorted search
+    // instead of a jump table
+    #ifndef PROTOCOL_DENSE_SPREAD
+    #define PROTOCOL_DENSE_SPREAD 4
+    #endif
+
+    template<std::integral Id, typename ...M>
+    struct protocol
+    {
+        static_assert(sizeof...(M) > 0, "a protocol needs at least one message");
+        static_assert(((is_tuple<typename M::type>::value || wire_struct<typename M::type>) && ...), "messages are tuples or aggregates");
+
+        using id_type = Id;
+        using variant = std::variant<typename M::type...>;
+        static constexpr size_t count = sizeof...(M);
+        static constexpr std::array<Id, count> ids = {(Id)M::id...};
+
+        static_assert([]
+        {
+            for (size_t i = 0; i < count; i++)
+                for (size_t j = i + 1; j < count; j++)
+                    if (ids[i] == ids[j])
+                        return false;
+            return true;
+        }(), "message ids must be unique");
+
+        static constexpr Id min_id = *std::min_element(ids.begin(), ids.end());
+        static constexpr Id max_id = *std::max_element(ids.begin(), ids.end());
+        static constexpr size_t span = (size_t)max_id - (size_t)min_id + 1;
+        static constexpr bool dense = span <= count * PROTOCOL_DENSE_SPREAD + 16;
+
+        // Handlers are called with any leading args then the message
+        template<typename F, typename ...Args>
+        static constexpr bool handles = (std::invocable<F &, Args..., typename M::type &> && ...);
+
+        template<typename T>
+        static constexpr size_t index_of = []
+        {
+            constexpr bool matches[] = {std::is_same_v<T, typename M::type>...};
+            size_t found = count;
+            for (size_t i = 0; i < count; i++)
+                if (matches[i])
+                    found = found == count ? i : count + 1;
+            return found;
+        }();
+
+        template<typename T>
+        static constexpr Id id_of = []
+        {
+            static_assert(index_of<T> < count, "type isn't exactly one message of the protocol");
+            return ids[index_of<T>];
+        }();
+
+        // Message index for id, -1 when the protocol doesn't have it
+        static constexpr int find(Id id)
+        {
+            if constexpr (dense)
+            {
+                constexpr auto table = []
+                {
+                    std::array<int, span> ret{};
+                    ret.fill(-1);
+                    for (size_t i = 0; i < count; i++)
+                        ret[(size_t)ids[i] - (size_t)min_id] = i;
+                    return ret;
+                }();
+                if (id < min_id || id > max_id)
+                    return -1;
+                return table[(size_t)id - (size_t)min_id];
+            }
+            else
+            {
+                constexpr auto sorted = []
+                {
+                    std::array<std::pair<Id, int>, count> ret{};
+                    for (size_t i = 0; i < count; i++)
+                        ret[i] = {ids[i], (int)i};
+                    std::sort(ret.begin(), ret.end());
+                    return ret;
+                }();
+                auto found = std::lower_bound(sorted.begin(), sorted.end(), std::pair<Id, int>(id, -1));
+                if (found == sorted.end() || found->first != id)
+                    return -1;
+                return found->second;
+            }
+        }
+
+        // Decodes body into out, -1 when a fixed size message is cut short
+        template<typename Order, typename T>
+        static int decode_body(char *body, int size, T &out)
+        {
+            if constexpr (is_fixed<T>())
+            {
+                if (size < 0 || (size_t)size < wire_size<T>())
+                    return -1;
+                load_fixed<T, Order>(body, out);
+                return wire_size<T>();
+            }
+            else
+            {
+                char_size buff = {.data = body, .consumed_size = 0, .max_size = size, .start_data = body};
+                if constexpr (is_tuple<T>::value)
+                    const_for_<std::tuple_size_v<T>>([&](auto i)
+                    {
+                        std::get<i.value>(out) = read_var<std::tuple_element_t<i.value, T>, Order>::call(&buff);
+                    });
+                else
+                    read_struct<T, Order>(&buff, out);
+                return buff.consumed_size;
+            }
+        }
+
+        template<typename Order, typename T, typename F, typename ...Args>
+        static int invoke(char *body, int size, F &handler, Args &...args)
+        {
+            T value{};
+            int consumed = decode_body<Order>(body, size, value);
+            if (consumed == -1)
+                return -1;
+            handler(args..., value);
+            return consumed;
+        }
+
+        // Returns the bytes consumed, -1 for an unknown id or a short packet,
+        // in which case the handler isn't called
+        template<typename Order = wire_order, typename F, typename ...Args>
+        static int dispatch(struct packet pkt, F &&handler, Args &&...args)
+        {
+            static_assert(handles<F, Args &...>, "the handler has to take every message of the protocol");
+            if (pkt.size < (int)sizeof(Id))
+                return -1;
+            int index = find(read_type<Id, Order>(pkt.data));
+            if (index == -1)
+                return -1;
+            using entry = int (*)(char *, int, std::remove_reference_t<F> &, std::remove_reference_t<Args> &...);
+            static constexpr entry table[] = {&invoke<Order, typename M::type, std::remove_reference_t<F>, std::remove_reference_t<Args>...>...};
+            int consumed = table[index](pkt.data + sizeof(Id), pkt.size - sizeof(Id), handler, args...);
+            return consumed == -1 ? -1 : consumed + sizeof(Id);
+        }
+
+        // For callers that would rather std::visit
+        template<typename Order = wire_order>
+        static int decode(struct packet pkt, variant &out)
+        {
+            return dispatch<Order>(pkt, [&out](auto &value) { out = std::move(value); });
+        }
+
+        template<typename Order = wire_order, typename T>
+        static char_size encode(const T &value)
+        {
+            return encode_packet<Order>(std::make_tuple(id_of<T>, value));
+        }
+
+        // Unframed [Id][message], for server_raw and plain sockets. Peers
+        // reading with server<T> need send_framed
+        template<typename Order = wire_order, typename T>
+        static int send(const T &value, int sock)
+        {
+            char_size buff = encode<Order>(value);
+            if (!buff.start_data)
+                return -1;
+            int ret = send_whole(sock, buff.start_data, buff.consumed_size, 0);
+            free(buff.start_data);
+            return ret;
+        }
+
+        // [Size body size][Id][message], the frames server<Size>::dispatch_packets reads
+        template<typename Size, typename Order = wire_order, typename T>
+        static char_size encode_framed(const T &value, const compression *options = nullptr)
+        {
+            return netlib::encode_framed<Size, Order>(std::make_tuple(id_of<T>, value), options);
+        }
+
+        template<typename Size, typename Order = wire_order, typename T>
+        static int send_framed(const T &value, int sock, const compression *options = nullptr)
+        {
+            return netlib::send_framed<Size, Order>(std::make_tuple(id_of<T>, value), sock, options);
+        }
+    };
+}
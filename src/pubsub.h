@@ -0,0 +1,37 @@
+#pragma once
+#include <cstddef>
+#include <vector>
+
+#ifndef TOPIC_MAX_PENDING
+#define TOPIC_MAX_PENDING (1024 * 1024)
+#endif
+
+namespace netlib
+{
+    // What a publish does for a subscriber that already has more than
+    // max_pending bytes waiting on its socket
+    enum class slow_policy
+    {
+        DROP,
+        COALESCE
+    };
+
+    struct topic_stats
+    {
+        size_t subscribers;
+        size_t published;
+        size_t dropped;
+        size_t coalesced;
+    };
+
+    struct topic
+    {
+        int id;
+        std::vector<int> subscribers;
+        slow_policy policy = slow_policy::DROP;
+        size_t max_pending = TOPIC_MAX_PENDING;
+        size_t published = 0;
+        size_t dropped = 0;
+        size_t coalesced = 0;
+    };
+}
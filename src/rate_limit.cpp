@@ -0,0 +1,153 @@
+#include "rate_limit.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+
+void netlib::token_bucket::configure(double per_sec, double burst_size, uint64_t now_us)
+{
+    rate = per_sec;
+    burst = burst_size > 0 ? burst_size : per_sec;
+    tokens = burst;
+    last_us = now_us;
+}
+
+void netlib::token_bucket::refill(uint64_t now_us)
+{
+    if (rate <= 0 || now_us <= last_us)
+        return;
+    tokens = std::min(burst, tokens + rate * (now_us - last_us) / 1000000.0);
+    last_us = now_us;
+}
+
+uint64_t netlib::token_bucket::wait_ms() const
+{
+    if (!empty())
+        return 0;
+    return (uint64_t)std::ceil((1 - tokens) / rate * 1000);
+}
+
+uint64_t netlib::rate_limiter::now_us()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Set before open_server, existing connections keep their buckets
+void netlib::rate_limiter::configure(rate_limit per_connection, rate_limit per_address)
+{
+    std::lock_guard<std::mutex> lock(sync);
+    connection_limit = per_connection;
+    address_limit = per_address;
+    active = per_connection.bytes_per_sec > 0 || per_connection.frames_per_sec > 0 || per_address.bytes_per_sec > 0 || per_address.frames_per_sec > 0;
+}
+
+void netlib::rate_limiter::attach(rate_state &state, uint32_t ip)
+{
+    if (!active)
+        return;
+    uint64_t now = now_us();
+    state.ip = ip;
+    state.own.bytes.configure(connection_limit.bytes_per_sec, connection_limit.bytes_burst, now);
+    state.own.frames.configure(connection_limit.frames_per_sec, connection_limit.frames_burst, now);
+    if (address_limit.bytes_per_sec <= 0 && address_limit.frames_per_sec <= 0)
+        return;
+    std::lock_guard<std::mutex> lock(sync);
+    auto &shared = addresses[ip];
+    if (!shared)
+    {
+        shared = std::make_shared<rate_buckets>();
+        shared->bytes.configure(address_limit.bytes_per_sec, address_limit.bytes_burst, now);
+        shared->frames.configure(address_limit.frames_per_sec, address_limit.frames_burst, now);
+    }
+    state.address = shared;
+}
+
+void netlib::rate_limiter::detach(rate_state &state)
+{
+    std::lock_guard<std::mutex> lock(sync);
+    if (state.paused)
+        paused--;
+    state.paused = false;
+    if (!state.address)
+        return;
+    state.address.reset();
+    auto address_test = addresses.find(state.ip);
+    // The map's reference is the last one once every connection from ip is gone
+    if (address_test != addresses.end() && address_test->second.use_count() == 1)
+        addresses.erase(address_test);
+}
+
+uint64_t netlib::rate_limiter::blocked_ms(rate_state &state)
+{
+    if (!active)
+        return 0;
+    uint64_t now = now_us();
+    state.own.bytes.refill(now);
+    state.own.frames.refill(now);
+    uint64_t bytes_wait = state.own.bytes.wait_ms();
+    uint64_t frames_wait = state.own.frames.wait_ms();
+    if (state.address)
+    {
+        state.address->bytes.refill(now);
+        state.address->frames.refill(now);
+        bytes_wait = std::max(bytes_wait, state.address->bytes.wait_ms());
+        frames_wait = std::max(frames_wait, state.address->frames.wait_ms());
+    }
+    if (bytes_wait == 0 && frames_wait == 0)
+        return 0;
+    std::lock_guard<std::mutex> lock(sync);
+    if (bytes_wait > 0)
+        byte_limited++;
+    if (frames_wait > 0)
+        frame_limited++;
+    return std::max<uint64_t>(RATE_MIN_PAUSE_MS, std::max(bytes_wait, frames_wait));
+}
+
+size_t netlib::rate_limiter::read_budget(rate_state &state, size_t max)
+{
+    if (!active)
+        return max;
+    double budget = max;
+    if (state.own.bytes.rate > 0)
+        budget = std::min(budget, std::ceil(state.own.bytes.tokens));
+    if (state.address && state.address->bytes.rate > 0)
+        budget = std::min(budget, std::ceil(state.address->bytes.tokens));
+    return budget < 1 ? 1 : (size_t)budget;
+}
+
+void netlib::rate_limiter::charge(rate_state &state, size_t bytes, size_t frames)
+{
+    if (!active)
+        return;
+    state.own.bytes.take(bytes);
+    state.own.frames.take(frames);
+    if (state.address)
+    {
+        state.address->bytes.take(bytes);
+        state.address->frames.take(frames);
+    }
+}
+
+void netlib::rate_limiter::pause(rate_state &state)
+{
+    std::lock_guard<std::mutex> lock(sync);
+    if (state.paused)
+        return;
+    state.paused = true;
+    paused++;
+    pauses++;
+}
+
+void netlib::rate_limiter::resume(rate_state &state)
+{
+    std::lock_guard<std::mutex> lock(sync);
+    if (!state.paused)
+        return;
+    state.paused = false;
+    paused--;
+}
+
+netlib::rate_stats netlib::rate_limiter::stats()
+{
+    std::lock_guard<std::mutex> lock(sync);
+    return {paused, pauses, byte_limited, frame_limited, addresses.size()};
+}
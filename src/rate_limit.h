@@ -0,0 +1,96 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <map>
+#include <memory>
+#include <mutex>
+#include "timer_wheel.h"
+
+// Shortest pause, so a throttled connection reads in chunks instead of a
+// byte per wakeup
+#ifndef RATE_MIN_PAUSE_MS
+#define RATE_MIN_PAUSE_MS 10
+#endif
+
+namespace netlib
+{
+    // Rates of 0 are unlimited, a burst of 0 allows one second's worth
+    struct rate_limit
+    {
+        double bytes_per_sec = 0;
+        double bytes_burst = 0;
+        double frames_per_sec = 0;
+        double frames_burst = 0;
+    };
+
+    // Takes may overdraw, the bucket is empty until it climbs back to 1
+    struct token_bucket
+    {
+        double rate = 0;
+        double burst = 0;
+        double tokens = 0;
+        uint64_t last_us = 0;
+        void configure(double per_sec, double burst_size, uint64_t now_us);
+        void refill(uint64_t now_us);
+        bool empty() const { return rate > 0 && tokens < 1; }
+        void take(double amount) { if (rate > 0) tokens -= amount; }
+        uint64_t wait_ms() const;
+    };
+
+    struct rate_buckets
+    {
+        token_bucket bytes;
+        token_bucket frames;
+    };
+
+    // Reactor side state of a connection
+    struct rate_state
+    {
+        rate_buckets own;
+        std::shared_ptr<rate_buckets> address;
+        uint32_t ip = 0;
+        bool paused = false;
+        timer_node resume_timer;
+    };
+
+    struct rate_stats
+    {
+        size_t paused;
+        size_t pauses;
+        size_t byte_limited;
+        size_t frame_limited;
+        size_t addresses;
+    };
+
+    // Token buckets per connection and per source address. The reactor asks
+    // before reading, stops watching a connection that is out of tokens and
+    // watches it again once they are back, so nothing read is ever dropped.
+    // Frames are packets on server<T> and reads on server_raw
+    class rate_limiter
+    {
+        public:
+            void configure(rate_limit per_connection, rate_limit per_address);
+            bool enabled() const { return active; }
+            void attach(rate_state &state, uint32_t ip);
+            void detach(rate_state &state);
+            // 0 when the connection may read, otherwise ms until it can
+            uint64_t blocked_ms(rate_state &state);
+            // How much to read so a read can't overdraw by more than a scratch buffer
+            size_t read_budget(rate_state &state, size_t max);
+            void charge(rate_state &state, size_t bytes, size_t frames);
+            void pause(rate_state &state);
+            void resume(rate_state &state);
+            rate_stats stats();
+        private:
+            static uint64_t now_us();
+            rate_limit connection_limit;
+            rate_limit address_limit;
+            bool active = false;
+            std::map<uint32_t, std::shared_ptr<rate_buckets>> addresses;
+            size_t paused = 0;
+            size_t pauses = 0;
+            size_t byte_limited = 0;
+            size_t frame_limited = 0;
+            std::mutex sync;
+    };
+}
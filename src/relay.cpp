@@ -0,0 +1,143 @@
+#include "relay.h"
+#include <sys/socket.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <cstring>
+#include <print>
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+netlib::relay_link::relay_link(int client_fd, int upstream_fd)
+{
+    client = client_fd;
+    upstream = upstream_fd;
+}
+
+netlib::relay_link::~relay_link()
+{
+    for (relay_direction *way : {&up, &down})
+    {
+        if (way->pipe_read != -1)
+            close(way->pipe_read);
+        if (way->pipe_write != -1)
+            close(way->pipe_write);
+    }
+    close(client);
+    close(upstream);
+}
+
+// The relay owns both sockets from here on, so they can stay non blocking
+bool netlib::relay_link::open()
+{
+    fcntl(client, F_SETFL, fcntl(client, F_GETFL) | O_NONBLOCK);
+    fcntl(upstream, F_SETFL, fcntl(upstream, F_GETFL) | O_NONBLOCK);
+    #if defined(__linux__)
+    for (relay_direction *way : {&up, &down})
+    {
+        int fds[2];
+        if (pipe2(fds, O_NONBLOCK | O_CLOEXEC) == -1)
+        {
+            std::println("Relay pipe failed! {}", strerror(errno));
+            return false;
+        }
+        way->pipe_read = fds[0];
+        way->pipe_write = fds[1];
+    }
+    #endif
+    return true;
+}
+
+static bool would_block()
+{
+    return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+}
+
+// Same contract as pump for a single direction
+int netlib::relay_link::move(relay_direction &way, int from, int to)
+{
+    way.blocked = false;
+    while (!way.shut)
+    {
+        if (way.staged_sent < way.staged.size())
+        {
+            ssize_t status = send(to, way.staged.data() + way.staged_sent, way.staged.size() - way.staged_sent, MSG_DONTWAIT | MSG_NOSIGNAL);
+            if (status == -1)
+            {
+                if (!would_block())
+                    return -1;
+                way.blocked = true;
+                return 1;
+            }
+            way.staged_sent += status;
+            way.bytes += status;
+            continue;
+        }
+        way.staged.clear();
+        way.staged_sent = 0;
+        #if defined(__linux__)
+        while (way.in_pipe > 0)
+        {
+            ssize_t status = splice(way.pipe_read, NULL, to, NULL, way.in_pipe, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (status == -1)
+            {
+                if (!would_block())
+                    return -1;
+                way.blocked = true;
+                return 1;
+            }
+            way.in_pipe -= status;
+            way.bytes += status;
+        }
+        #endif
+        if (way.eof)
+        {
+            shutdown(to, SHUT_WR);
+            way.shut = true;
+            break;
+        }
+        #if defined(__linux__)
+        ssize_t status = splice(from, NULL, way.pipe_write, NULL, RELAY_CHUNK_SIZE, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (status > 0)
+            way.in_pipe += status;
+        #else
+        way.staged.resize(RELAY_CHUNK_SIZE);
+        ssize_t status = recv(from, way.staged.data(), RELAY_CHUNK_SIZE, MSG_DONTWAIT);
+        way.staged.resize(status > 0 ? status : 0);
+        #endif
+        if (status == 0)
+            way.eof = true;
+        else if (status == -1)
+            return would_block() ? 1 : -1;
+    }
+    return 0;
+}
+
+int netlib::relay_link::pump()
+{
+    int up_status = move(up, client, upstream);
+    int down_status = move(down, upstream, client);
+    if (up_status == -1 || down_status == -1)
+        return -1;
+    return up_status == 0 && down_status == 0 ? 0 : 1;
+}
+
+// A side is read until its FIN, but not while the other one is backed up
+bool netlib::relay_link::wants_read(int fd)
+{
+    relay_direction &way = fd == client ? up : down;
+    return !way.eof && !way.blocked;
+}
+
+bool netlib::relay_link::wants_write(int fd)
+{
+    relay_direction &way = fd == client ? down : up;
+    return way.blocked;
+}
+
+netlib::relay_stats netlib::relay_link::stats()
+{
+    return {up.bytes, down.bytes, !(up.eof && down.shut), !(down.eof && up.shut)};
+}
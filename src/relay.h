@@ -0,0 +1,64 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <string>
+
+// Bytes moved per splice, also the most a direction keeps in flight
+#ifndef RELAY_CHUNK_SIZE
+#define RELAY_CHUNK_SIZE (64 * 1024)
+#endif
+
+namespace netlib
+{
+    // One way of a relay. On Linux the bytes sit in a pipe between the two
+    // splices, elsewhere they go through staged. Bytes read in user space
+    // before the relay started wait in staged too and go out first
+    struct relay_direction
+    {
+        int pipe_read = -1;
+        int pipe_write = -1;
+        size_t in_pipe = 0;
+        std::string staged;
+        size_t staged_sent = 0;
+        // The source sent FIN / the destination was shut down for writing
+        bool eof = false;
+        bool shut = false;
+        bool blocked = false;
+        uint64_t bytes = 0;
+    };
+
+    struct relay_stats
+    {
+        uint64_t to_upstream;
+        uint64_t to_client;
+        bool client_open;
+        bool upstream_open;
+    };
+
+    // Joins two sockets and moves bytes both ways until both have closed.
+    // A FIN from one side is passed on as a shutdown of the other once
+    // everything before it went out, the other way keeps flowing
+    class relay_link
+    {
+        public:
+            relay_link(int client_fd, int upstream_fd);
+            ~relay_link();
+            relay_link(const relay_link &) = delete;
+            relay_link &operator=(const relay_link &) = delete;
+            bool open();
+            // Moves whatever both sockets allow without blocking.
+            // Returns 1 while open, 0 once both ways are done, -1 on error
+            int pump();
+            bool wants_read(int fd);
+            bool wants_write(int fd);
+            relay_stats stats();
+            int client;
+            int upstream;
+            relay_direction up;
+            relay_direction down;
+            // What the reactor currently watches on each socket
+            uint8_t interest[2] = {0, 0};
+        private:
+            static int move(relay_direction &way, int from, int to);
+    };
+}
@@ -0,0 +1,210 @@
+#include "scatter.h"
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <cstring>
+#include <print>
+#include <poll.h>
+#ifdef __linux__
+#include <linux/errqueue.h>
+#include <netinet/in.h>
+#endif
+
+void netlib::scatter_buffer::reference(const char *data, size_t size)
+{
+    if (inline_data.consumed_size > (int)inline_mark)
+        segments.push_back({nullptr, inline_mark, inline_data.consumed_size - inline_mark});
+    inline_mark = inline_data.consumed_size;
+    segments.push_back({data, 0, size});
+    external_size += size;
+}
+
+std::vector<iovec> netlib::scatter_buffer::iov()
+{
+    if (inline_data.consumed_size > (int)inline_mark)
+        segments.push_back({nullptr, inline_mark, inline_data.consumed_size - inline_mark});
+    inline_mark = inline_data.consumed_size;
+
+    std::vector<iovec> ret;
+    ret.reserve(segments.size());
+    for (auto &segment : segments)
+    {
+        const char *base = segment.external ? segment.external : inline_data.start_data + segment.offset;
+        ret.push_back({(void *)base, segment.size});
+    }
+    return ret;
+}
+
+// Keeps calling sendmsg until every segment is out, iov is consumed in place.
+// -1 if any call fails, calls still counts the ones that sent something
+static ssize_t send_all(int sock, iovec *iov, int count, int flags, int *calls)
+{
+    ssize_t total = 0;
+    msghdr msg = {};
+
+    while (count > 0)
+    {
+        msg.msg_iov = iov;
+        msg.msg_iovlen = count > IOV_MAX ? IOV_MAX : count;
+        ssize_t sent = sendmsg(sock, &msg, flags);
+        if (sent < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            // Reactor sockets are non blocking, wait for room like send does
+            if ((errno == EAGAIN || errno == EWOULDBLOCK) && wait_socket(sock, POLLOUT))
+                continue;
+            // Whatever went out already, the stream is cut short
+            return -1;
+        }
+        if (calls)
+            (*calls)++;
+        total += sent;
+        while (count > 0 && (size_t)sent >= iov->iov_len)
+        {
+            sent -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0)
+        {
+            iov->iov_base = (char *)iov->iov_base + sent;
+            iov->iov_len -= sent;
+        }
+    }
+    return total;
+}
+
+int netlib::send_iov(int sock, iovec *iov, int count, int flags)
+{
+    ssize_t ret = send_all(sock, iov, count, flags, nullptr);
+    if (ret < 0)
+        std::println("sendmsg: {}", strerror(errno));
+    return ret;
+}
+
+netlib::zerocopy_socket::zerocopy_socket(int sockfd, size_t threshold)
+{
+    fd = sockfd;
+    zerocopy_threshold = threshold;
+    next_seq = 0;
+    completed = 0;
+    enabled = false;
+#if defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+    int one = 1;
+    if (setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0)
+        enabled = true;
+    else
+        std::println("SO_ZEROCOPY unavailable, copying instead: {}", strerror(errno));
+#endif
+}
+
+netlib::zerocopy_socket::~zerocopy_socket()
+{
+    // Bounded, a peer that stopped reading holds the completions back
+    if (!retained.empty())
+        wait(retained.back().first, ZEROCOPY_LINGER_MS);
+    for (auto &[ticket, buffer] : retained)
+        free(buffer);
+}
+
+void netlib::zerocopy_socket::retain(int64_t ticket, char *buffer)
+{
+    retained.push_back({ticket, buffer});
+}
+
+// Tickets count zerocopy sendmsg calls, 0 means nothing to wait for
+int64_t netlib::zerocopy_socket::send(iovec *iov, int count, size_t size)
+{
+    if (!enabled || size < zerocopy_threshold)
+    {
+        if (send_iov(fd, iov, count) < 0)
+            return -1;
+        return 0;
+    }
+#if defined(MSG_ZEROCOPY)
+    int calls = 0;
+    ssize_t ret = send_all(fd, iov, count, MSG_ZEROCOPY, &calls);
+    next_seq += calls;
+    if (ret < 0)
+    {
+        std::println("sendmsg zerocopy: {}", strerror(errno));
+        return -1;
+    }
+    return next_seq;
+#else
+    return 0;
+#endif
+}
+
+// Reads completion notifications off the error queue without blocking
+void netlib::zerocopy_socket::reap()
+{
+#if defined(__linux__) && defined(SO_EE_ORIGIN_ZEROCOPY)
+    while (true)
+    {
+        char control[128];
+        msghdr msg = {};
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+            break;
+
+        for (cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm))
+        {
+            if (!((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) || (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR)))
+                continue;
+            sock_extended_err *err = (sock_extended_err *)CMSG_DATA(cm);
+            if (err->ee_errno != 0 || err->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+                continue;
+            // ee_info..ee_data is the inclusive range of finished calls
+            if ((int64_t)err->ee_data + 1 > completed)
+                completed = (int64_t)err->ee_data + 1;
+        }
+    }
+#endif
+    while (!retained.empty() && retained.front().first <= completed)
+    {
+        free(retained.front().second);
+        retained.pop_front();
+    }
+}
+
+bool netlib::zerocopy_socket::done(int64_t ticket)
+{
+    if (ticket <= completed)
+        return true;
+    reap();
+    return ticket <= completed;
+}
+
+// timeout_ms -1 waits until done, false if the time ran out or the socket failed
+bool netlib::zerocopy_socket::wait(int64_t ticket, int timeout_ms)
+{
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+    while (!done(ticket))
+    {
+#ifdef __linux__
+        int wait_ms = 100;
+        if (timeout_ms >= 0)
+        {
+            auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+            if (left <= 0)
+                return false;
+            wait_ms = std::min<int64_t>(wait_ms, left);
+        }
+        // Error queue readiness shows up as POLLERR
+        pollfd pfd = {fd, 0, 0};
+        int status = poll(&pfd, 1, wait_ms);
+        if (status < 0 && errno != EINTR)
+            return false;
+        // Completions of a connection that is gone are already queued
+        if (status > 0 && (pfd.revents & (POLLHUP | POLLNVAL)))
+            return done(ticket);
+#else
+        return false;
+#endif
+    }
+    return true;
+}
@@ -0,0 +1,226 @@
+#pragma once
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <vector>
+#include <deque>
+#include <string>
+#include "comp_time_write.h"
+#include "varlen.h"
+#include "aggregate.h"
+
+#define SCATTER_THRESHOLD 1024
+#define ZEROCOPY_THRESHOLD 16384
+// How long closing waits for the kernel to finish with zerocopy sends
+#ifndef ZEROCOPY_LINGER_MS
+#define ZEROCOPY_LINGER_MS 1000
+#endif
+
+namespace netlib
+{
+    // external is null for bytes living in inline_data, offsets are resolved
+    // only at the end since inline_data moves when it grows
+    struct scatter_segment
+    {
+        const char *external;
+        size_t offset;
+        size_t size;
+    };
+
+    // Small fields are packed inline like send_packet does, payloads of at
+    // least threshold bytes are referenced where they are and must outlive the send
+    struct scatter_buffer
+    {
+        scatter_buffer(size_t payload_threshold = SCATTER_THRESHOLD)
+        {
+            char *buffer = (char *)malloc(1024 * sizeof(char));
+            inline_data = {buffer, 0, 1024, buffer};
+            inline_mark = 0;
+            threshold = payload_threshold;
+            external_size = 0;
+        }
+        ~scatter_buffer()
+        {
+            free(inline_data.start_data);
+        }
+        scatter_buffer(const scatter_buffer &) = delete;
+        scatter_buffer &operator=(const scatter_buffer &) = delete;
+        char_size inline_data;
+        std::vector<scatter_segment> segments;
+        size_t inline_mark;
+        size_t threshold;
+        size_t external_size;
+        void reference(const char *data, size_t size);
+        std::vector<iovec> iov();
+        size_t size() { return inline_data.consumed_size + external_size; }
+    };
+
+    template<typename T, typename Order = wire_order>
+    struct scatter_var
+    {
+        static void call(scatter_buffer *v, const T &value)
+        {
+            write_var<T, Order>::call(&v->inline_data, value);
+        }
+    };
+
+    template<typename Order>
+    struct scatter_var<std::string, Order>
+    {
+        static void call(scatter_buffer *v, const std::string &value)
+        {
+            if (value.size() >= v->threshold)
+                v->reference(value.data(), value.size());
+            else
+                write_var<std::string, Order>::call(&v->inline_data, value);
+        }
+    };
+
+    template<typename Order>
+    struct scatter_var<char_size, Order>
+    {
+        static void call(scatter_buffer *v, const char_size &value)
+        {
+            if ((size_t)value.consumed_size >= v->threshold)
+                v->reference(value.data, value.consumed_size);
+            else
+                write_var<char_size, Order>::call(&v->inline_data, value);
+        }
+    };
+
+    template<typename T, typename Order>
+    struct scatter_var<std::vector<T, std::allocator<T>>, Order>
+    {
+        static void call(scatter_buffer *v, const std::vector<T, std::allocator<T>> &value)
+        {
+            // Only single byte elements are their own wire encoding
+            if constexpr (arithmetic<T> && sizeof(T) == 1)
+            {
+                if (value.size() >= v->threshold)
+                {
+                    v->reference((const char *)value.data(), value.size());
+                    return;
+                }
+            }
+            for (const auto &val : value)
+                scatter_var<T, Order>::call(v, val);
+        }
+    };
+
+    // Views and prefixed strings keep the prefix inline, the bytes in place
+    template<byte_view T, typename Order>
+    struct scatter_var<T, Order>
+    {
+        static void call(scatter_buffer *v, const T &value)
+        {
+            scatter_var<prefixed<T>, Order>::call(v, {value});
+        }
+    };
+
+    template<typename T, typename Length, size_t Max, typename Order>
+    struct scatter_var<prefixed<T, Length, Max>, Order>
+    {
+        static void call(scatter_buffer *v, const prefixed<T, Length, Max> &value)
+        {
+            if constexpr (byte_view<T> || std::is_same_v<T, std::string>)
+            {
+                if (value.value.size() >= v->threshold)
+                {
+                    if (write_length<Length, Max, Order>(&v->inline_data, value.value.size()))
+                        v->reference((const char *)value.value.data(), value.value.size());
+                    return;
+                }
+            }
+            write_var<prefixed<T, Length, Max>, Order>::call(&v->inline_data, value);
+        }
+    };
+
+    template<typename Order, typename ...T>
+    struct scatter_var<std::tuple<T...>, Order>
+    {
+        static void call(scatter_buffer *v, const std::tuple<T...> &value)
+        {
+            const_for<sizeof...(T)>([&](auto i){scatter_var<std::remove_cvref_t<std::tuple_element_t<i.value, std::tuple<T...>>>, Order>::call(v, std::get<i.value>(value));});
+        }
+    };
+
+    template<wire_struct S, typename Order>
+    struct scatter_var<S, Order>
+    {
+        static void call(scatter_buffer *v, const S &value)
+        {
+            if constexpr (same_layout<S, Order>())
+                write_struct<S, Order>(&v->inline_data, value);
+            else
+            {
+                auto fields = field_tie(value);
+                scatter_var<std::remove_cvref_t<decltype(fields)>, Order>::call(v, fields);
+            }
+        }
+    };
+
+    // false when a field couldn't be encoded, buff is unusable then
+    template<typename Order = wire_order, typename ...T>
+    bool encode_scatter(scatter_buffer &buff, const std::tuple<T...> &packet)
+    {
+        scatter_var<std::tuple<T...>, Order>::call(&buff, packet);
+        return !buff.inline_data.failed;
+    }
+
+    int send_iov(int sock, iovec *iov, int count, int flags = 0);
+
+    // Like send_packet but large payloads go to sendmsg in place, no memcpy
+    template<typename Order = wire_order, typename ...T>
+    int send_scatter(const std::tuple<T...> &packet, int sock, size_t threshold = SCATTER_THRESHOLD)
+    {
+        scatter_buffer buff(threshold);
+        if (!encode_scatter<Order>(buff, packet))
+            return -1;
+        std::vector<iovec> iov = buff.iov();
+        return send_iov(sock, iov.data(), iov.size());
+    }
+
+    // MSG_ZEROCOPY sender (Linux 4.14+). The kernel reads the payloads after
+    // send returns, so they must stay alive until done(ticket). Packets under
+    // the threshold or on systems without zerocopy are sent normally and
+    // their ticket is done right away
+    class zerocopy_socket
+    {
+        public:
+            zerocopy_socket(int sockfd, size_t threshold = ZEROCOPY_THRESHOLD);
+            ~zerocopy_socket();
+            template<typename Order = wire_order, typename ...T>
+            int64_t send_packet(const std::tuple<T...> &packet);
+            int64_t send(iovec *iov, int count, size_t size);
+            bool done(int64_t ticket);
+            bool wait(int64_t ticket, int timeout_ms = -1);
+            void reap();
+            int fd;
+        private:
+            void retain(int64_t ticket, char *buffer);
+            // inline bytes of packets still pinned by the kernel
+            std::deque<std::pair<int64_t, char *>> retained;
+            bool enabled;
+            size_t zerocopy_threshold;
+            uint32_t next_seq;
+            int64_t completed;
+    };
+
+    template<typename Order, typename ...T>
+    inline int64_t zerocopy_socket::send_packet(const std::tuple<T...> &packet)
+    {
+        scatter_buffer buff;
+        if (!encode_scatter<Order>(buff, packet))
+            return -1;
+        std::vector<iovec> iov = buff.iov();
+        uint32_t issued = next_seq;
+        int64_t ticket = send(iov.data(), iov.size(), buff.size());
+        // A send that failed part way still left the kernel reading the
+        // buffer for the calls it made
+        if (next_seq != issued)
+        {
+            retain(next_seq, buff.inline_data.start_data);
+            buff.inline_data.start_data = nullptr;
+        }
+        return ticket;
+    }
+}
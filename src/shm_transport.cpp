@@ -0,0 +1,713 @@
+#include "shm_transport.h"
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <errno.h>
+#include <cstring>
+#include <chrono>
+#include <new>
+#include <print>
+#include "handoff.h"
+#if defined(__linux__)
+#include <sys/eventfd.h>
+#endif
+
+// Starts every segment, the two rings follow
+struct alignas(64) shm_segment
+{
+    uint32_t magic;
+    uint64_t capacity;
+};
+
+static size_t segment_size(size_t capacity)
+{
+    return sizeof(shm_segment) + 2 * (sizeof(netlib::shm_ring) + capacity);
+}
+
+static int create_memory()
+{
+    #if defined(__linux__)
+    return memfd_create("netlib-shm", MFD_CLOEXEC);
+    #else
+    static std::atomic<int> next = 0;
+    std::string name = "/netlib-" + std::to_string(getpid()) + "-" + std::to_string(next++);
+    int memory = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (memory != -1)
+        shm_unlink(name.c_str());
+    return memory;
+    #endif
+}
+
+// A doorbell per side: the side waits on its own and rings the peer's.
+// One eventfd serves both ends on Linux, elsewhere they are a pipe's
+static bool open_bells(int &own_wait, int &own_ring, int &peer_wait, int &peer_ring)
+{
+    #if defined(__linux__)
+    own_wait = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    peer_wait = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (own_wait == -1 || peer_wait == -1)
+    {
+        if (own_wait != -1)
+            close(own_wait);
+        return false;
+    }
+    peer_ring = own_wait;
+    own_ring = peer_wait;
+    #else
+    int own[2];
+    int peer[2];
+    if (pipe(own) == -1)
+        return false;
+    if (pipe(peer) == -1)
+    {
+        close(own[0]);
+        close(own[1]);
+        return false;
+    }
+    for (int end : {own[0], own[1], peer[0], peer[1]})
+        fcntl(end, F_SETFL, fcntl(end, F_GETFL) | O_NONBLOCK);
+    own_wait = own[0];
+    peer_ring = own[1];
+    peer_wait = peer[0];
+    own_ring = peer[1];
+    #endif
+    return true;
+}
+
+// Maps memory and points the link at its rings, the client writes the first
+static bool map_segment(netlib::shm_link &link, int memory, bool client, size_t capacity)
+{
+    size_t size = segment_size(capacity);
+    if (client && ftruncate(memory, size) == -1)
+        return false;
+    if (!client)
+    {
+        struct stat info;
+        if (fstat(memory, &info) == -1 || (size_t)info.st_size < sizeof(shm_segment))
+            return false;
+        size = info.st_size;
+    }
+    void *base = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, memory, 0);
+    if (base == MAP_FAILED)
+        return false;
+    link.base = base;
+    link.mapped = size;
+    shm_segment *header = (shm_segment *)base;
+    if (client)
+    {
+        new (header) shm_segment{SHM_MAGIC, capacity};
+    }
+    else
+    {
+        capacity = header->capacity;
+        // A peer may be anything, everything it wrote is checked
+        if (header->magic != SHM_MAGIC || capacity == 0 || (capacity & (capacity - 1)) || size != segment_size(capacity))
+            return false;
+    }
+    char *to_server = (char *)base + sizeof(shm_segment);
+    char *to_client = to_server + sizeof(netlib::shm_ring) + capacity;
+    if (client)
+    {
+        new (to_server) netlib::shm_ring{};
+        new (to_client) netlib::shm_ring{};
+    }
+    link.in = (netlib::shm_ring *)(client ? to_client : to_server);
+    link.out = (netlib::shm_ring *)(client ? to_server : to_client);
+    link.in_data = (char *)(link.in + 1);
+    link.out_data = (char *)(link.out + 1);
+    link.mask = capacity - 1;
+    return true;
+}
+
+netlib::shm_link::~shm_link()
+{
+    for (auto &pending : handshakes)
+        if (pending.memory != -1)
+            ::close(pending.memory);
+    if (base)
+        munmap(base, mapped);
+    for (int descriptor : {fd, bell_wait, bell_ring})
+        if (descriptor != -1)
+            ::close(descriptor);
+    if (listening)
+        unlink(path.c_str());
+}
+
+size_t netlib::shm_link::read(char *buffer, size_t size, bool peek)
+{
+    uint64_t head = in->head.load(std::memory_order_relaxed);
+    if (seen_tail - head < size)
+        seen_tail = in->tail.load(std::memory_order_acquire);
+    // The peer can write anything to its side of the mapping, more than a
+    // ring's worth is treated like it crashed rather than read out of bounds
+    if (seen_tail - head > mask + 1)
+    {
+        hangup = true;
+        return 0;
+    }
+    size_t count = std::min<uint64_t>(size, seen_tail - head);
+    if (count == 0)
+        return 0;
+    size_t at = head & mask;
+    size_t first = std::min<size_t>(count, mask + 1 - at);
+    memcpy(buffer, in_data + at, first);
+    memcpy(buffer + first, in_data, count - first);
+    if (peek)
+        return count;
+    in->head.store(head + count, std::memory_order_release);
+    // Either the writer sees the space or this sees it asleep
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (in->writer_sleeping.load(std::memory_order_relaxed))
+        ring();
+    return count;
+}
+
+size_t netlib::shm_link::write(const char *data, size_t size)
+{
+    uint64_t tail = out->tail.load(std::memory_order_relaxed);
+    if (mask + 1 - (tail - seen_head) < size)
+        seen_head = out->head.load(std::memory_order_acquire);
+    if (tail - seen_head > mask + 1)
+    {
+        hangup = true;
+        return 0;
+    }
+    size_t count = std::min<uint64_t>(size, mask + 1 - (tail - seen_head));
+    if (count == 0)
+        return 0;
+    size_t at = tail & mask;
+    size_t first = std::min<size_t>(count, mask + 1 - at);
+    memcpy(out_data + at, data, first);
+    memcpy(out_data, data + first, count - first);
+    out->tail.store(tail + count, std::memory_order_release);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (out->reader_sleeping.load(std::memory_order_relaxed))
+        ring();
+    return count;
+}
+
+size_t netlib::shm_link::pending()
+{
+    uint64_t count = in->tail.load(std::memory_order_acquire) - in->head.load(std::memory_order_relaxed);
+    if (count > mask + 1)
+    {
+        hangup = true;
+        return 0;
+    }
+    return count;
+}
+
+size_t netlib::shm_link::space()
+{
+    uint64_t used = out->tail.load(std::memory_order_relaxed) - out->head.load(std::memory_order_acquire);
+    if (used > mask + 1)
+    {
+        hangup = true;
+        return 0;
+    }
+    return mask + 1 - used;
+}
+
+bool netlib::shm_link::peer_gone()
+{
+    return in->closed.load(std::memory_order_acquire) || hangup;
+}
+
+void netlib::shm_link::ring()
+{
+    #if defined(__linux__)
+    uint64_t one = 1;
+    ::write(bell_ring, &one, sizeof(one));
+    #else
+    char one = 1;
+    ::write(bell_ring, &one, sizeof(one));
+    #endif
+}
+
+void netlib::shm_link::drain()
+{
+    #if defined(__linux__)
+    uint64_t rings = 0;
+    ::read(bell_wait, &rings, sizeof(rings));
+    #else
+    char rings[64];
+    while (::read(bell_wait, rings, sizeof(rings)) > 0)
+        ;
+    #endif
+}
+
+// The socket only turns readable once the peer is gone
+void netlib::shm_link::sleep()
+{
+    pollfd fds[2] = {{bell_wait, POLLIN, 0}, {fd, POLLIN, 0}};
+    if (poll(fds, 2, -1) > 0 && fds[1].revents)
+        hangup = true;
+    drain();
+}
+
+netlib::shm_transport::shm_transport(size_t ring_size)
+{
+    capacity = 4096;
+    while (capacity < ring_size)
+        capacity <<= 1;
+}
+
+netlib::shm_transport::~shm_transport()
+{
+    std::lock_guard<std::mutex> lock(sync);
+    links.clear();
+}
+
+std::shared_ptr<netlib::shm_link> netlib::shm_transport::find(int fd)
+{
+    std::lock_guard<std::mutex> lock(sync);
+    auto link_test = links.find(fd);
+    if (link_test == links.end())
+        return nullptr;
+    return link_test->second;
+}
+
+std::string netlib::shm_transport::socket_path(const std::string &address, short port)
+{
+    return std::string(SHM_SOCKET_DIR) + "/netlib-" + address + "-" + std::to_string((uint16_t)port) + ".sock";
+}
+
+std::unique_ptr<netlib::poller> netlib::shm_transport::open_poller(const latency_profile &profile)
+{
+    return std::make_unique<shm_poller>(*this, profile);
+}
+
+int netlib::shm_transport::listen(const std::string &address, short port, const latency_profile &profile)
+{
+    std::string path = socket_path(address, port);
+    int sock = listen_unix(path, SOMAXCONN);
+    if (sock == -1)
+        return -1;
+    // Accepting runs on a reactor, it takes what is waiting and never blocks
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+    auto link = std::make_shared<shm_link>();
+    link->fd = sock;
+    link->listening = true;
+    link->path = path;
+    std::lock_guard<std::mutex> lock(sync);
+    links[sock] = link;
+    return sock;
+}
+
+// Takes the descriptors that arrived so far without waiting. 1 once all
+// three did and the segment is mapped, 0 while some are missing, -1 if the
+// client sent something else or went away
+int netlib::shm_transport::handshake(shm_handshake &pending)
+{
+    shm_link &link = *pending.link;
+    while (pending.received < 3)
+    {
+        int *slot = pending.received == 0 ? &pending.memory : pending.received == 1 ? &link.bell_wait : &link.bell_ring;
+        char tag = 0;
+        errno = 0;
+        if (!recv_fd(link.fd, *slot, &tag, 1, MSG_DONTWAIT))
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        if (*slot == -1)
+            return -1;
+        pending.received++;
+    }
+    bool mapped = map_segment(link, pending.memory, false, 0);
+    ::close(pending.memory);
+    pending.memory = -1;
+    return mapped ? 1 : -1;
+}
+
+// The client sends the segment and both doorbells right after connecting.
+// They are picked up as they arrive, the handshaking sockets wake the poller
+// as the listener does, so this returns -1 with EAGAIN until one is complete
+int netlib::shm_transport::accept(int listener, uint32_t &ip)
+{
+    std::shared_ptr<shm_link> server = find(listener);
+    if (!server || !server->listening)
+    {
+        errno = EBADF;
+        return -1;
+    }
+    shm_poller *watcher = server->watcher;
+    int sock = ::accept(listener, nullptr, nullptr);
+    if (sock != -1)
+    {
+        shm_handshake pending;
+        pending.link = std::make_shared<shm_link>();
+        pending.link->fd = sock;
+        pending.deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(SHM_HANDSHAKE_MS);
+        server->handshakes.push_back(std::move(pending));
+        if (watcher)
+            watcher->watch_handshake(sock, listener, true);
+    }
+    auto now = std::chrono::steady_clock::now();
+    for (auto pending = server->handshakes.begin(); pending != server->handshakes.end();)
+    {
+        int status = handshake(*pending);
+        if (status == 0 && now < pending->deadline)
+        {
+            pending++;
+            continue;
+        }
+        std::shared_ptr<shm_link> link = pending->link;
+        pending = server->handshakes.erase(pending);
+        if (watcher)
+            watcher->watch_handshake(link->fd, listener, false);
+        if (status != 1)
+        {
+            std::println("Shm handshake failed!");
+            continue;
+        }
+        // The rest stay readable, they come up on the next wait
+        ip = htonl(INADDR_LOOPBACK);
+        std::lock_guard<std::mutex> lock(sync);
+        links[link->fd] = link;
+        return link->fd;
+    }
+    errno = EAGAIN;
+    return -1;
+}
+
+int netlib::shm_transport::connect(const std::string &address, short port, const latency_profile &profile)
+{
+    int sock = connect_unix(socket_path(address, port));
+    if (sock == -1)
+    {
+        std::println("Connect failed!");
+        return -1;
+    }
+    auto link = std::make_shared<shm_link>();
+    link->fd = sock;
+    int memory = create_memory();
+    int peer_wait = -1;
+    int peer_ring = -1;
+    if (memory == -1 || !open_bells(link->bell_wait, link->bell_ring, peer_wait, peer_ring))
+    {
+        std::println("Shm setup failed! {}", strerror(errno));
+        if (memory != -1)
+            ::close(memory);
+        return -1;
+    }
+    char tag = 0;
+    bool ready = map_segment(*link, memory, true, capacity) && send_fd(sock, memory, &tag, 1) && send_fd(sock, peer_wait, &tag, 1) && send_fd(sock, peer_ring, &tag, 1);
+    ::close(memory);
+    // With eventfds the peer's ends are the same descriptors as ours
+    if (peer_wait != link->bell_ring)
+        ::close(peer_wait);
+    if (peer_ring != link->bell_wait)
+        ::close(peer_ring);
+    if (!ready)
+    {
+        std::println("Connect failed!");
+        return -1;
+    }
+    std::lock_guard<std::mutex> lock(sync);
+    links[sock] = link;
+    return sock;
+}
+
+ssize_t netlib::shm_transport::recv(int fd, void *buffer, size_t size, int flags, uint64_t *kernel_ns)
+{
+    if (kernel_ns)
+        *kernel_ns = 0;
+    std::shared_ptr<shm_link> link = find(fd);
+    if (!link || link->listening)
+    {
+        errno = EBADF;
+        return -1;
+    }
+    while (true)
+    {
+        size_t count = link->read((char *)buffer, size, flags & MSG_PEEK);
+        if (count > 0)
+            return count;
+        // Whatever was sent before closing is read first
+        if (link->peer_gone())
+            return link->read((char *)buffer, size, flags & MSG_PEEK);
+        if (flags & MSG_DONTWAIT)
+        {
+            errno = EAGAIN;
+            return -1;
+        }
+        link->in->reader_sleeping.store(1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (link->pending() == 0 && !link->peer_gone())
+            link->sleep();
+        link->in->reader_sleeping.store(0, std::memory_order_relaxed);
+    }
+}
+
+ssize_t netlib::shm_transport::send(int fd, const void *data, size_t size, int flags)
+{
+    std::shared_ptr<shm_link> link = find(fd);
+    if (!link || link->listening)
+    {
+        errno = EBADF;
+        return -1;
+    }
+    while (true)
+    {
+        if (link->peer_gone())
+        {
+            errno = EPIPE;
+            return -1;
+        }
+        size_t count = link->write((const char *)data, size);
+        if (count > 0 || size == 0)
+            return count;
+        if (flags & MSG_DONTWAIT)
+        {
+            errno = EAGAIN;
+            return -1;
+        }
+        link->out->writer_sleeping.store(1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (link->space() == 0 && !link->peer_gone())
+            link->sleep();
+        link->out->writer_sleeping.store(0, std::memory_order_relaxed);
+    }
+}
+
+// The peer reads what is left in the ring, then the end of stream
+void netlib::shm_transport::close(int fd)
+{
+    std::unique_lock<std::mutex> lock(sync);
+    auto link_test = links.find(fd);
+    if (link_test == links.end())
+        return;
+    std::shared_ptr<shm_link> link = link_test->second;
+    links.erase(link_test);
+    lock.unlock();
+    if (shm_poller *watcher = link->watcher.exchange(nullptr))
+        watcher->forget(fd);
+    if (!link->listening)
+    {
+        link->out->closed.store(1, std::memory_order_release);
+        link->ring();
+    }
+}
+
+size_t netlib::shm_transport::available(int fd)
+{
+    std::shared_ptr<shm_link> link = find(fd);
+    if (!link || link->listening)
+        return 0;
+    return link->pending();
+}
+
+netlib::shm_poller::shm_poller(shm_transport &network, const latency_profile &profile)
+:owner(network), spin_us(profile.spin_us)
+{
+    // The spinning happens on the rings, not in epoll
+    latency_profile quiet = profile;
+    quiet.spin_us = 0;
+    inner = default_transport().open_poller(quiet);
+}
+
+void netlib::shm_poller::watch(int fd, int interest)
+{
+    std::shared_ptr<shm_link> link = owner.find(fd);
+    if (interest == 0 || !link)
+    {
+        shm_poller *self = this;
+        if (link)
+            link->watcher.compare_exchange_strong(self, nullptr);
+        forget(fd);
+        return;
+    }
+    link->watcher = this;
+    std::lock_guard<std::mutex> lock(sync);
+    auto &entry = watched[fd];
+    bool fresh = !entry.link;
+    entry = {link, interest};
+    if (!fresh)
+        return;
+    if (link->listening)
+    {
+        inner->watch(fd, TRANSPORT_READ);
+        inner_fds[fd] = fd;
+        return;
+    }
+    inner->watch(link->bell_wait, TRANSPORT_READ);
+    inner_fds[link->bell_wait] = fd;
+    if (!link->hangup)
+    {
+        inner->watch(fd, TRANSPORT_READ);
+        inner_fds[fd] = fd;
+    }
+}
+
+void netlib::shm_poller::forget(int fd)
+{
+    std::lock_guard<std::mutex> lock(sync);
+    auto entry = watched.find(fd);
+    if (entry == watched.end())
+        return;
+    shm_link &link = *entry->second.link;
+    for (int inner_fd : {link.fd, link.bell_wait})
+    {
+        auto inner_test = inner_fds.find(inner_fd);
+        if (inner_test != inner_fds.end() && inner_test->second == fd)
+        {
+            inner->watch(inner_fd, 0);
+            inner_fds.erase(inner_test);
+        }
+    }
+    // Sockets of a listener's unfinished handshakes
+    if (link.listening)
+    {
+        for (auto inner_test = inner_fds.begin(); inner_test != inner_fds.end();)
+        {
+            if (inner_test->second != fd)
+            {
+                inner_test++;
+                continue;
+            }
+            inner->watch(inner_test->first, 0);
+            inner_test = inner_fds.erase(inner_test);
+        }
+    }
+    watched.erase(entry);
+}
+
+// A handshaking socket wakes the poller as its listener until it is done
+void netlib::shm_poller::watch_handshake(int sock, int listener, bool watching)
+{
+    std::lock_guard<std::mutex> lock(sync);
+    if (watching)
+    {
+        inner->watch(sock, TRANSPORT_READ);
+        inner_fds[sock] = listener;
+        return;
+    }
+    auto inner_test = inner_fds.find(sock);
+    if (inner_test == inner_fds.end() || inner_test->second != listener)
+        return;
+    inner->watch(sock, 0);
+    inner_fds.erase(inner_test);
+}
+
+// Called with sync held, never makes a syscall
+int netlib::shm_poller::scan(transport_event *events, int max_events)
+{
+    int count = 0;
+    for (int listener : listeners_ready)
+        if (count < max_events && watched.contains(listener))
+            events[count++] = {listener, true, false, false};
+    listeners_ready.clear();
+    for (auto &[fd, entry] : watched)
+    {
+        if (count == max_events)
+            break;
+        shm_link &link = *entry.link;
+        if (link.listening)
+            continue;
+        bool hangup = link.peer_gone();
+        bool readable = (entry.interest & TRANSPORT_READ) && (hangup || link.pending() > 0);
+        bool writable = (entry.interest & TRANSPORT_WRITE) && (hangup || link.space() > 0);
+        if (readable || writable)
+            events[count++] = {fd, readable, writable, hangup};
+    }
+    return count;
+}
+
+// Called without sync. Drains the doorbells that rang, notes listeners
+// with connections waiting and peers that are gone
+int netlib::shm_poller::poll_inner(int wait_ms)
+{
+    transport_event fired[64];
+    int events_ready = inner->wait(fired, 64, wait_ms);
+    std::lock_guard<std::mutex> lock(sync);
+    for (int i = 0; i < events_ready; i++)
+    {
+        auto inner_test = inner_fds.find(fired[i].fd);
+        if (inner_test == inner_fds.end())
+            continue;
+        auto entry = watched.find(inner_test->second);
+        if (entry == watched.end())
+            continue;
+        shm_link &link = *entry->second.link;
+        if (link.listening)
+            listeners_ready.push_back(link.fd);
+        else if (fired[i].fd == link.bell_wait)
+            link.drain();
+        else
+        {
+            link.hangup = true;
+            inner->watch(fired[i].fd, 0);
+            inner_fds.erase(inner_test);
+        }
+    }
+    return events_ready;
+}
+
+// Called with sync held
+void netlib::shm_poller::set_sleeping(uint32_t sleeping)
+{
+    for (auto &[fd, entry] : watched)
+    {
+        shm_link &link = *entry.link;
+        if (link.listening)
+            continue;
+        if (!sleeping || (entry.interest & TRANSPORT_READ))
+            link.in->reader_sleeping.store(sleeping, std::memory_order_relaxed);
+        if (!sleeping || (entry.interest & TRANSPORT_WRITE))
+            link.out->writer_sleeping.store(sleeping, std::memory_order_relaxed);
+    }
+}
+
+// Looks at the rings first, spins on them for spin_us, then says it sleeps,
+// looks once more and sleeps on the doorbells
+int netlib::shm_poller::wait(transport_event *events, int max_events, int wait_ms)
+{
+    if (++rounds % SHM_POLL_EVERY == 0)
+        poll_inner(0);
+    auto start = std::chrono::steady_clock::now();
+    auto spin_end = start + std::chrono::microseconds(spin_us);
+    auto deadline = start + std::chrono::milliseconds(wait_ms < 0 ? 0 : wait_ms);
+    while (true)
+    {
+        std::unique_lock<std::mutex> lock(sync);
+        int count = scan(events, max_events);
+        if (count > 0)
+            return count;
+        lock.unlock();
+        if (woken.exchange(false))
+            return 0;
+        auto now = std::chrono::steady_clock::now();
+        if (now < spin_end && (wait_ms < 0 || now < deadline))
+            continue;
+        lock.lock();
+        set_sleeping(1);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        count = scan(events, max_events);
+        lock.unlock();
+        int events_ready = 0;
+        if (count == 0)
+        {
+            int remaining = -1;
+            if (wait_ms >= 0)
+                remaining = std::max<int64_t>(0, std::chrono::duration_cast<std::chrono::milliseconds>(deadline - now).count());
+            events_ready = poll_inner(remaining);
+        }
+        lock.lock();
+        set_sleeping(0);
+        if (count == 0)
+            count = scan(events, max_events);
+        if (count > 0)
+            return count;
+        // Nothing rang before the timeout or wake, or waiting failed
+        if (events_ready <= 0 || woken.exchange(false) || (wait_ms >= 0 && std::chrono::steady_clock::now() >= deadline))
+            return events_ready == -1 ? -1 : 0;
+    }
+}
+
+void netlib::shm_poller::wake()
+{
+    woken = true;
+    inner->wake();
+}
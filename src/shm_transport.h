@@ -0,0 +1,161 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <memory>
+#include <map>
+#include <vector>
+#include <mutex>
+#include "transport.h"
+
+// Bytes each direction of a connection holds, rounded up to a power of two
+#ifndef SHM_RING_SIZE
+#define SHM_RING_SIZE (1024 * 1024)
+#endif
+// Where listeners put the socket clients find them by
+#ifndef SHM_SOCKET_DIR
+#define SHM_SOCKET_DIR "/tmp"
+#endif
+// While rings keep having data the doorbells and listeners are only
+// looked at every this many waits
+#ifndef SHM_POLL_EVERY
+#define SHM_POLL_EVERY 64
+#endif
+// Accepted clients that haven't sent their segment and doorbells by then
+// are dropped
+#ifndef SHM_HANDSHAKE_MS
+#define SHM_HANDSHAKE_MS 1000
+#endif
+#define SHM_MAGIC 0x4e4c5348
+
+namespace netlib
+{
+    // One direction in shared memory, the data follows it. Each side only
+    // writes its own cache line: the reader head and reader_sleeping, the
+    // writer tail, writer_sleeping and closed. A side that sleeps says so
+    // first, the other only rings its doorbell then
+    struct shm_ring
+    {
+        alignas(64) std::atomic<uint64_t> head;
+        std::atomic<uint32_t> reader_sleeping;
+        alignas(64) std::atomic<uint64_t> tail;
+        std::atomic<uint32_t> writer_sleeping;
+        std::atomic<uint32_t> closed;
+    };
+    static_assert(std::atomic<uint64_t>::is_always_lock_free, "shm rings need lock free atomics");
+
+    class shm_poller;
+    struct shm_link;
+
+    // An accepted connection whose client hasn't sent its segment and both
+    // doorbells yet, memory is the segment until it is mapped
+    struct shm_handshake
+    {
+        std::shared_ptr<shm_link> link;
+        int memory = -1;
+        int received = 0;
+        std::chrono::steady_clock::time_point deadline;
+    };
+
+    // This process' side of a connection: the mapping, the ring it reads and
+    // the one it writes, its own doorbell and the peer's. fd is the AF_UNIX
+    // socket the connection was set up over, it carries nothing afterwards
+    // and only ends when the peer is gone, crashed or not
+    struct shm_link
+    {
+        ~shm_link();
+        size_t read(char *buffer, size_t size, bool peek);
+        size_t write(const char *data, size_t size);
+        size_t pending();
+        size_t space();
+        bool peer_gone();
+        void ring();
+        void drain();
+        // Waits on the doorbell and the socket, sleeping must be set first
+        void sleep();
+        int fd = -1;
+        bool listening = false;
+        std::string path;
+        // Listeners only, touched by whoever calls accept
+        std::vector<shm_handshake> handshakes;
+        void *base = nullptr;
+        size_t mapped = 0;
+        shm_ring *in = nullptr;
+        shm_ring *out = nullptr;
+        char *in_data = nullptr;
+        char *out_data = nullptr;
+        uint64_t mask = 0;
+        // Last seen positions of the other side, saves touching its line
+        uint64_t seen_tail = 0;
+        uint64_t seen_head = 0;
+        int bell_wait = -1;
+        int bell_ring = -1;
+        std::atomic_bool hangup = false;
+        std::atomic<shm_poller *> watcher = nullptr;
+    };
+
+    // Connects processes of the same host through a lock free single
+    // producer single consumer ring per direction in shared memory (memfd
+    // on Linux, an unlinked shm_open elsewhere). Sending and receiving are
+    // plain loads, stores and copies, a doorbell (eventfd, a pipe elsewhere)
+    // is only written when the other side went to sleep. Spinning with
+    // latency_profile::spin_us keeps both sides awake for sub microsecond
+    // round trips. Address and port only name the listener's socket
+    class shm_transport : public transport
+    {
+        public:
+            shm_transport(size_t ring_size = SHM_RING_SIZE);
+            ~shm_transport();
+            std::unique_ptr<poller> open_poller(const latency_profile &profile) override;
+            int listen(const std::string &address, short port, const latency_profile &profile) override;
+            int accept(int listener, uint32_t &ip) override;
+            int connect(const std::string &address, short port, const latency_profile &profile) override;
+            ssize_t recv(int fd, void *buffer, size_t size, int flags, uint64_t *kernel_ns = nullptr) override;
+            ssize_t send(int fd, const void *data, size_t size, int flags) override;
+            void close(int fd) override;
+            size_t available(int fd) override;
+        private:
+            friend class shm_poller;
+            std::shared_ptr<shm_link> find(int fd);
+            std::string socket_path(const std::string &address, short port);
+            int handshake(shm_handshake &pending);
+            std::mutex sync;
+            std::map<int, std::shared_ptr<shm_link>> links;
+            size_t capacity;
+    };
+
+    // Finds ready rings by looking at them, only sleeps in epoll/kqueue on
+    // the doorbells, listeners and sockets when nothing is ready
+    class shm_poller : public poller
+    {
+        public:
+            shm_poller(shm_transport &network, const latency_profile &profile);
+            void watch(int fd, int interest) override;
+            int wait(transport_event *events, int max_events, int wait_ms) override;
+            void wake() override;
+        private:
+            friend class shm_transport;
+            struct watched_link
+            {
+                std::shared_ptr<shm_link> link;
+                int interest;
+            };
+            void forget(int fd);
+            void watch_handshake(int sock, int listener, bool watching);
+            int scan(transport_event *events, int max_events);
+            int poll_inner(int wait_ms);
+            void set_sleeping(uint32_t sleeping);
+            shm_transport &owner;
+            std::unique_ptr<poller> inner;
+            uint64_t spin_us;
+            std::mutex sync;
+            std::map<int, watched_link> watched;
+            // Doorbells and sockets watched in inner, to their connection
+            std::map<int, int> inner_fds;
+            std::vector<int> listeners_ready;
+            std::atomic_bool woken = false;
+            unsigned rounds = 0;
+    };
+}
@@ -0,0 +1,187 @@
+#include "timer_wheel.h"
+#include <algorithm>
+
+void netlib::timer_node::unlink()
+{
+    if (!next)
+        return;
+    prev->next = next;
+    next->prev = prev;
+    prev = nullptr;
+    next = nullptr;
+    if (owner_count)
+        (*owner_count)--;
+    owner_count = nullptr;
+}
+
+netlib::timer_wheel::timer_wheel(uint64_t tick)
+{
+    tick_ms = tick == 0 ? 1 : tick;
+    count = 0;
+    for (int level = 0; level < WHEEL_LEVELS; level++)
+    {
+        for (int slot = 0; slot < WHEEL_SLOTS; slot++)
+        {
+            slots[level][slot].prev = &slots[level][slot];
+            slots[level][slot].next = &slots[level][slot];
+        }
+    }
+    current_tick = now_ms() / tick_ms;
+}
+
+netlib::timer_wheel::~timer_wheel()
+{
+    // The timers may outlive us (they live inside users), detach them so their
+    // destructors dont touch our slots
+    for (int level = 0; level < WHEEL_LEVELS; level++)
+    {
+        for (int slot = 0; slot < WHEEL_SLOTS; slot++)
+        {
+            timer_node *head = &slots[level][slot];
+            timer_node *timer = head->next;
+            while (timer != head)
+            {
+                timer_node *next = timer->next;
+                timer->prev = nullptr;
+                timer->next = nullptr;
+                timer->owner_count = nullptr;
+                timer = next;
+            }
+            head->prev = nullptr;
+            head->next = nullptr;
+        }
+    }
+}
+
+uint64_t netlib::timer_wheel::now_ms()
+{
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void netlib::timer_wheel::place(timer_node *timer)
+{
+    uint64_t expires = timer->expires;
+    int level = 0;
+
+    // A timer goes in the lowest level where it is less than a full turn away,
+    // comparing block numbers so it gets cascaded exactly when its block comes
+    while (level < WHEEL_LEVELS - 1 && (expires >> (WHEEL_BITS * level)) - (current_tick >> (WHEEL_BITS * level)) >= WHEEL_SLOTS)
+        level++;
+    if ((expires >> (WHEEL_BITS * level)) - (current_tick >> (WHEEL_BITS * level)) >= WHEEL_SLOTS)
+    {
+        expires = ((current_tick >> (WHEEL_BITS * level)) + WHEEL_SLOTS - 1) << (WHEEL_BITS * level);
+        timer->expires = expires;
+    }
+    timer_node *head = &slots[level][(expires >> (WHEEL_BITS * level)) & WHEEL_MASK];
+    timer->prev = head->prev;
+    timer->next = head;
+    head->prev->next = timer;
+    head->prev = timer;
+}
+
+void netlib::timer_wheel::arm(timer_node *timer, uint64_t delay_ms)
+{
+    timer->unlink();
+    // Nothing is pending so the reactor may have slept for a while, catch up
+    if (count == 0)
+        current_tick = now_ms() / tick_ms;
+    uint64_t ticks = (delay_ms + tick_ms - 1) / tick_ms;
+    if (ticks == 0)
+        ticks = 1;
+    // current_tick only moves in advance, it lags behind while the reactor
+    // sleeps with other timers pending. Counting from it would fire early
+    uint64_t now_tick = std::max(current_tick, now_ms() / tick_ms);
+    timer->expires = now_tick + ticks;
+    place(timer);
+    timer->owner_count = &count;
+    count++;
+}
+
+void netlib::timer_wheel::cancel(timer_node *timer)
+{
+    timer->unlink();
+}
+
+void netlib::timer_wheel::cascade(int level, int slot)
+{
+    timer_node *head = &slots[level][slot];
+    timer_node *timer = head->next;
+
+    head->prev = head;
+    head->next = head;
+    while (timer != head)
+    {
+        timer_node *next = timer->next;
+        place(timer);
+        timer = next;
+    }
+}
+
+void netlib::timer_wheel::advance(uint64_t now)
+{
+    uint64_t target = now / tick_ms;
+
+    if (count == 0)
+    {
+        if (target > current_tick)
+            current_tick = target;
+        return;
+    }
+    while (current_tick < target)
+    {
+        current_tick++;
+        int index = current_tick & WHEEL_MASK;
+        for (int level = 1; index == 0 && level < WHEEL_LEVELS; level++)
+        {
+            index = (current_tick >> (WHEEL_BITS * level)) & WHEEL_MASK;
+            cascade(level, index);
+        }
+
+        // Move the slot out first, callbacks are free to re-arm their own timer
+        timer_node *head = &slots[0][current_tick & WHEEL_MASK];
+        if (head->next == head)
+            continue;
+        timer_node expired;
+        expired.next = head->next;
+        expired.prev = head->prev;
+        expired.next->prev = &expired;
+        expired.prev->next = &expired;
+        head->prev = head;
+        head->next = head;
+        while (expired.next != &expired)
+        {
+            timer_node *timer = expired.next;
+            timer->unlink();
+            if (timer->callback)
+                timer->callback();
+        }
+        if (count == 0)
+        {
+            current_tick = target;
+            return;
+        }
+    }
+}
+
+int netlib::timer_wheel::next_timeout(uint64_t now)
+{
+    if (count == 0)
+        return -1;
+    uint64_t elapsed = now > current_tick * tick_ms ? now - current_tick * tick_ms : 0;
+    uint64_t ticks = WHEEL_SLOTS;
+    for (uint64_t i = 1; i < WHEEL_SLOTS; i++)
+    {
+        uint64_t tick = current_tick + i;
+        timer_node *head = &slots[0][tick & WHEEL_MASK];
+        // A level 0 wrap means a cascade is due, wake up for it too
+        if (head->next != head || (tick & WHEEL_MASK) == 0)
+        {
+            ticks = i;
+            break;
+        }
+    }
+    uint64_t wait = ticks * tick_ms;
+    if (elapsed >= wait)
+        return 0;
+    return wait - elapsed;
+}
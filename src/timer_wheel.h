@@ -0,0 +1,68 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <chrono>
+#include <functional>
+
+#define WHEEL_LEVELS 4
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+
+namespace netlib
+{
+    // Intrusive timer, embed it where it is needed (users, servers...).
+    // Arming and cancelling only relink the node so both are O(1)
+    struct timer_node
+    {
+        timer_node()
+        {
+            prev = nullptr;
+            next = nullptr;
+            expires = 0;
+            owner_count = nullptr;
+        }
+        ~timer_node()
+        {
+            unlink();
+        }
+        timer_node(const timer_node &) = delete;
+        timer_node &operator=(const timer_node &) = delete;
+        timer_node *prev;
+        timer_node *next;
+        uint64_t expires;
+        size_t *owner_count;
+        std::function<void()> callback;
+        bool armed() const { return next != nullptr; }
+        void unlink();
+    };
+
+    struct scheduled_timer
+    {
+        timer_node timer;
+        std::function<void()> callback;
+    };
+
+    // Hierarchical timer wheel, 4 levels of 64 slots. With the default 1ms tick
+    // it covers ~4.6 hours, longer delays are clamped to the wheel range.
+    // Not thread safe, the owner reactor guards it with its own lock
+    class timer_wheel
+    {
+        public:
+            timer_wheel(uint64_t tick = 1);
+            ~timer_wheel();
+            void arm(timer_node *timer, uint64_t delay_ms);
+            void cancel(timer_node *timer);
+            void advance(uint64_t now);
+            int next_timeout(uint64_t now);
+            uint64_t now_ms();
+            size_t size() { return count; }
+        private:
+            void place(timer_node *timer);
+            void cascade(int level, int slot);
+            timer_node slots[WHEEL_LEVELS][WHEEL_SLOTS];
+            uint64_t tick_ms;
+            uint64_t current_tick;
+            size_t count;
+    };
+}
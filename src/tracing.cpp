@@ -0,0 +1,211 @@
+#include "tracing.h"
+#include <sys/socket.h>
+#include <time.h>
+#include <cstring>
+#include <algorithm>
+#include <cmath>
+#include <print>
+#include <errno.h>
+#if defined(__linux__)
+#include <linux/net_tstamp.h>
+#include <linux/errqueue.h>
+#endif
+
+size_t netlib::latency_histogram::bucket_of(uint64_t ns)
+{
+    if (ns < (1ull << TRACE_SUB_BITS))
+        return ns;
+    int exponent = 63 - __builtin_clzll(ns);
+    if (exponent >= TRACE_MAX_BITS)
+        return TRACE_BUCKETS - 1;
+    size_t sub = (ns >> (exponent - TRACE_SUB_BITS + 1)) - (1 << (TRACE_SUB_BITS - 1));
+    return (1 << TRACE_SUB_BITS) + (exponent - TRACE_SUB_BITS) * (1 << (TRACE_SUB_BITS - 1)) + sub;
+}
+
+uint64_t netlib::latency_histogram::bucket_top(size_t index)
+{
+    if (index < (1 << TRACE_SUB_BITS))
+        return index;
+    size_t offset = index - (1 << TRACE_SUB_BITS);
+    int exponent = TRACE_SUB_BITS + offset / (1 << (TRACE_SUB_BITS - 1));
+    uint64_t sub = (1 << (TRACE_SUB_BITS - 1)) + offset % (1 << (TRACE_SUB_BITS - 1));
+    int shift = exponent - TRACE_SUB_BITS + 1;
+    return (sub << shift) + (1ull << shift) - 1;
+}
+
+void netlib::latency_histogram::record(uint64_t ns)
+{
+    buckets[bucket_of(ns)].fetch_add(1, std::memory_order_relaxed);
+    total.fetch_add(1, std::memory_order_relaxed);
+    sum.fetch_add(ns, std::memory_order_relaxed);
+    uint64_t seen = lowest.load(std::memory_order_relaxed);
+    while (ns < seen && !lowest.compare_exchange_weak(seen, ns, std::memory_order_relaxed))
+        ;
+    seen = highest.load(std::memory_order_relaxed);
+    while (ns > seen && !highest.compare_exchange_weak(seen, ns, std::memory_order_relaxed))
+        ;
+}
+
+uint64_t netlib::latency_histogram::percentile(double percent) const
+{
+    uint64_t recorded = count();
+    if (recorded == 0)
+        return 0;
+    uint64_t wanted = std::max<uint64_t>(1, std::ceil(percent / 100 * recorded));
+    uint64_t seen = 0;
+    for (size_t i = 0; i < TRACE_BUCKETS; i++)
+    {
+        seen += buckets[i].load(std::memory_order_relaxed);
+        if (seen >= wanted)
+            return std::min(bucket_top(i), highest.load(std::memory_order_relaxed));
+    }
+    return highest.load(std::memory_order_relaxed);
+}
+
+netlib::latency_summary netlib::latency_histogram::summary() const
+{
+    uint64_t recorded = count();
+    if (recorded == 0)
+        return {0, 0, 0, 0, 0, 0, 0, 0};
+    return {recorded, lowest.load(std::memory_order_relaxed), percentile(50), percentile(90), percentile(99), percentile(99.9),
+        highest.load(std::memory_order_relaxed), (double)sum.load(std::memory_order_relaxed) / recorded};
+}
+
+void netlib::latency_histogram::reset()
+{
+    for (auto &bucket : buckets)
+        bucket.store(0, std::memory_order_relaxed);
+    total = 0;
+    sum = 0;
+    lowest = UINT64_MAX;
+    highest = 0;
+}
+
+bool netlib::latency_tracer::enable_timestamps(int fd)
+{
+    #if defined(__linux__)
+    int flags = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE;
+    if (setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)) == -1)
+    #else
+    int one = 1;
+    if (setsockopt(fd, SOL_SOCKET, SO_TIMESTAMP, &one, sizeof(one)) == -1)
+    #endif
+    {
+        std::println("Receive timestamps unavailable {}", strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+ssize_t netlib::latency_tracer::recv_stamped(int fd, void *buffer, size_t size, uint64_t &kernel_ns, int flags)
+{
+    kernel_ns = 0;
+    iovec iov = {buffer, size};
+    #if defined(__linux__)
+    char control[CMSG_SPACE(sizeof(scm_timestamping))];
+    #else
+    char control[CMSG_SPACE(sizeof(timeval))];
+    #endif
+    msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    ssize_t status = recvmsg(fd, &msg, flags);
+    if (status <= 0)
+        return status;
+    for (cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+    {
+        if (cmsg->cmsg_level != SOL_SOCKET)
+            continue;
+        #if defined(__linux__)
+        if (cmsg->cmsg_type == SCM_TIMESTAMPING)
+        {
+            scm_timestamping stamp;
+            memcpy(&stamp, CMSG_DATA(cmsg), sizeof(stamp));
+            kernel_ns = stamp.ts[0].tv_sec * 1000000000ull + stamp.ts[0].tv_nsec;
+        }
+        #else
+        if (cmsg->cmsg_type == SCM_TIMESTAMP)
+        {
+            timeval stamp;
+            memcpy(&stamp, CMSG_DATA(cmsg), sizeof(stamp));
+            kernel_ns = stamp.tv_sec * 1000000000ull + stamp.tv_usec * 1000ull;
+        }
+        #endif
+    }
+    return status;
+}
+
+uint64_t netlib::latency_tracer::now_ns()
+{
+    timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+static uint64_t elapsed(uint64_t from, uint64_t to)
+{
+    return to > from ? to - from : 0;
+}
+
+void netlib::latency_tracer::received(trace_state &trace, size_t bytes, uint64_t kernel_ns)
+{
+    uint64_t now = now_ns();
+    trace.received += bytes;
+    if (kernel_ns)
+        kernel_to_reactor.record(elapsed(kernel_ns, now));
+    if (trace.stamps.size() >= TRACE_MAX_SEGMENTS)
+    {
+        trace.stamps.back().end = trace.received;
+        return;
+    }
+    trace.stamps.push_back({trace.received, kernel_ns, now, 0});
+}
+
+// The stamps not ready yet are always the newest ones
+void netlib::latency_tracer::ready(trace_state &trace)
+{
+    uint64_t now = now_ns();
+    for (auto stamp = trace.stamps.rbegin(); stamp != trace.stamps.rend() && stamp->ready_ns == 0; stamp++)
+    {
+        stamp->ready_ns = now;
+        reactor_to_ready.record(elapsed(stamp->reactor_ns, now));
+    }
+}
+
+void netlib::latency_tracer::consumed(trace_state &trace, size_t bytes)
+{
+    uint64_t now = now_ns();
+    trace.consumed += bytes;
+    while (!trace.stamps.empty() && trace.stamps.front().end <= trace.consumed)
+    {
+        segment_stamp &stamp = trace.stamps.front();
+        ready_to_consumed.record(elapsed(stamp.ready_ns ? stamp.ready_ns : stamp.reactor_ns, now));
+        trace.stamps.pop_front();
+    }
+}
+
+void netlib::latency_tracer::frame_ready(uint64_t kernel_ns, uint64_t reactor_ns, uint64_t ready_ns)
+{
+    if (kernel_ns)
+        kernel_to_reactor.record(elapsed(kernel_ns, reactor_ns));
+    reactor_to_ready.record(elapsed(reactor_ns, ready_ns));
+}
+
+void netlib::latency_tracer::frame_consumed(uint64_t ready_ns)
+{
+    ready_to_consumed.record(elapsed(ready_ns, now_ns()));
+}
+
+netlib::latency_report netlib::latency_tracer::report() const
+{
+    return {kernel_to_reactor.summary(), reactor_to_ready.summary(), ready_to_consumed.summary()};
+}
+
+void netlib::latency_tracer::reset()
+{
+    kernel_to_reactor.reset();
+    reactor_to_ready.reset();
+    ready_to_consumed.reset();
+}
@@ -0,0 +1,109 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+#include <deque>
+#include <sys/types.h>
+
+// Values under 2^TRACE_SUB_BITS ns are exact, every power of two above is
+// split in 2^(TRACE_SUB_BITS - 1) buckets, so a bucket is within ~3% of its
+// values. Anything past 2^TRACE_MAX_BITS ns (~18 minutes) lands in the last
+#ifndef TRACE_SUB_BITS
+#define TRACE_SUB_BITS 6
+#endif
+#ifndef TRACE_MAX_BITS
+#define TRACE_MAX_BITS 40
+#endif
+#define TRACE_BUCKETS ((1 << TRACE_SUB_BITS) + (TRACE_MAX_BITS - TRACE_SUB_BITS) * (1 << (TRACE_SUB_BITS - 1)))
+// Stamps kept per connection, later reads are merged into the last one
+#ifndef TRACE_MAX_SEGMENTS
+#define TRACE_MAX_SEGMENTS 1024
+#endif
+
+namespace netlib
+{
+    struct latency_summary
+    {
+        uint64_t count;
+        uint64_t min_ns;
+        uint64_t p50_ns;
+        uint64_t p90_ns;
+        uint64_t p99_ns;
+        uint64_t p999_ns;
+        uint64_t max_ns;
+        double mean_ns;
+    };
+
+    // Log-linear histogram in the HDR style. Recording is a few relaxed
+    // atomics so the reactor and the application may both record into it
+    class latency_histogram
+    {
+        public:
+            void record(uint64_t ns);
+            uint64_t count() const { return total.load(std::memory_order_relaxed); }
+            // Upper bound of the bucket holding the percentile, 0 when empty
+            uint64_t percentile(double percent) const;
+            latency_summary summary() const;
+            void reset();
+        private:
+            static size_t bucket_of(uint64_t ns);
+            static uint64_t bucket_top(size_t index);
+            std::array<std::atomic<uint64_t>, TRACE_BUCKETS> buckets{};
+            std::atomic<uint64_t> total = 0;
+            std::atomic<uint64_t> sum = 0;
+            std::atomic<uint64_t> lowest = UINT64_MAX;
+            std::atomic<uint64_t> highest = 0;
+    };
+
+    // Received bytes up to stream position end, with when the kernel got
+    // them, when the reactor read them and when they were made readable.
+    // Times are CLOCK_REALTIME ns like the kernel's, 0 when unknown
+    struct segment_stamp
+    {
+        uint64_t end;
+        uint64_t kernel_ns;
+        uint64_t reactor_ns;
+        uint64_t ready_ns;
+    };
+
+    // Per connection, guarded by the connection's own lock
+    struct trace_state
+    {
+        std::deque<segment_stamp> stamps;
+        uint64_t received = 0;
+        uint64_t consumed = 0;
+    };
+
+    struct latency_report
+    {
+        latency_summary kernel_to_reactor;
+        latency_summary reactor_to_ready;
+        latency_summary ready_to_consumed;
+    };
+
+    // Where received bytes spend their time: in the kernel before the reactor
+    // reads them, buffered until the connection is readable (a whole frame,
+    // line or target), then until the application consumes them
+    class latency_tracer
+    {
+        public:
+            // Software receive timestamps on fd, false where there are none.
+            // The stages after the kernel are traced either way
+            static bool enable_timestamps(int fd);
+            // recv that also gives the kernel's receive time, 0 if it had none
+            static ssize_t recv_stamped(int fd, void *buffer, size_t size, uint64_t &kernel_ns, int flags = 0);
+            static uint64_t now_ns();
+            void received(trace_state &trace, size_t bytes, uint64_t kernel_ns);
+            void ready(trace_state &trace);
+            void consumed(trace_state &trace, size_t bytes);
+            // For whole frames that are ready as soon as they are read
+            void frame_ready(uint64_t kernel_ns, uint64_t reactor_ns, uint64_t ready_ns);
+            void frame_consumed(uint64_t ready_ns);
+            latency_report report() const;
+            void reset();
+            latency_histogram kernel_to_reactor;
+            latency_histogram reactor_to_ready;
+            latency_histogram ready_to_consumed;
+    };
+}
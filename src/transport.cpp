@@ -0,0 +1,577 @@
+#include "transport.h"
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <cstring>
+#include <chrono>
+#include <vector>
+#include <print>
+#include "command_queue.h"
+#include "tracing.h"
+#if defined(__APPLE__) || defined(__FreeBSD__)
+#include <sys/event.h>
+#include <sys/uio.h>
+#elif defined(__linux__)
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#endif
+
+ssize_t netlib::transport::send_file(int fd, int file_fd, uint64_t offset, size_t length)
+{
+    char staged[TRANSPORT_FILE_CHUNK];
+    ssize_t status = pread(file_fd, staged, std::min(length, sizeof(staged)), offset);
+    if (status <= 0)
+        return status;
+    return send(fd, staged, status, MSG_DONTWAIT);
+}
+
+namespace
+{
+    class socket_poller : public netlib::poller
+    {
+        public:
+            socket_poller(const netlib::latency_profile &profile)
+            :latency(profile)
+            {
+                #if defined(__APPLE__) || defined(__FreeBSD__)
+                epfd = kqueue();
+                #elif defined(__linux__)
+                epfd = epoll_create1(0);
+                #endif
+                wakeup.open(epfd);
+            }
+            ~socket_poller()
+            {
+                close(epfd);
+            }
+            void watch(int fd, int interest) override;
+            int wait(netlib::transport_event *events, int max_events, int wait_ms) override;
+            void wake() override
+            {
+                wakeup.wake();
+            }
+        private:
+            int epfd;
+            netlib::waker wakeup;
+            netlib::latency_profile latency;
+            #if defined(__APPLE__) || defined(__FreeBSD__)
+            // kqueue filters are added and deleted one by one, so the
+            // current interest is kept to know which ones change
+            std::map<int, int> watched;
+            std::mutex sync;
+            std::vector<struct kevent> raw;
+            #elif defined(__linux__)
+            std::vector<epoll_event> raw;
+            #endif
+    };
+}
+
+#if defined(__APPLE__) || defined(__FreeBSD__)
+void socket_poller::watch(int fd, int interest)
+{
+    std::lock_guard<std::mutex> lock(sync);
+    int current = 0;
+    auto watched_test = watched.find(fd);
+    if (watched_test != watched.end())
+        current = watched_test->second;
+    struct kevent ev;
+    if ((current ^ interest) & TRANSPORT_READ)
+    {
+        EV_SET(&ev, fd, EVFILT_READ, interest & TRANSPORT_READ ? EV_ADD | EV_ENABLE : EV_DELETE, 0, 0, 0);
+        kevent(epfd, &ev, 1, NULL, 0, NULL);
+    }
+    if ((current ^ interest) & TRANSPORT_WRITE)
+    {
+        EV_SET(&ev, fd, EVFILT_WRITE, interest & TRANSPORT_WRITE ? EV_ADD : EV_DELETE, 0, 0, 0);
+        kevent(epfd, &ev, 1, NULL, 0, NULL);
+    }
+    if (interest == 0)
+        watched.erase(fd);
+    else
+        watched[fd] = interest;
+}
+
+// Waits at most 500ms at a time, as the kqueue reactors always did
+int socket_poller::wait(netlib::transport_event *events, int max_events, int wait_ms)
+{
+    if (wait_ms == -1 || wait_ms > 500)
+        wait_ms = 500;
+    struct timespec timeout;
+    timeout.tv_sec = wait_ms / 1000;
+    timeout.tv_nsec = (wait_ms % 1000) * 1000000;
+    raw.resize(max_events);
+    int events_ready = kevent(epfd, NULL, 0, raw.data(), max_events, &timeout);
+    int count = 0;
+    for (int i = 0; i < events_ready; i++)
+    {
+        if (raw[i].filter == EVFILT_USER)
+            continue;
+        events[count++] = {(int)raw[i].ident, raw[i].filter == EVFILT_READ, raw[i].filter == EVFILT_WRITE, (raw[i].flags & (EV_EOF | EV_ERROR)) != 0};
+    }
+    return events_ready == -1 ? -1 : count;
+}
+#elif defined(__linux__)
+void socket_poller::watch(int fd, int interest)
+{
+    if (interest == 0)
+    {
+        epoll_ctl(epfd, EPOLL_CTL_DEL, fd, nullptr);
+        return;
+    }
+    epoll_event event;
+    event.data.fd = fd;
+    event.events = (interest & TRANSPORT_READ ? EPOLLIN : 0) | (interest & TRANSPORT_WRITE ? EPOLLOUT : 0);
+    if (epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &event) == -1 && errno == ENOENT)
+        epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &event);
+}
+
+int socket_poller::wait(netlib::transport_event *events, int max_events, int wait_ms)
+{
+    raw.resize(max_events);
+    int events_ready = netlib::wait_events(epfd, raw.data(), max_events, wait_ms, latency);
+    int count = 0;
+    for (int i = 0; i < events_ready; i++)
+    {
+        if (raw[i].data.fd == wakeup.fd)
+        {
+            wakeup.drain();
+            continue;
+        }
+        uint32_t flags = raw[i].events;
+        events[count++] = {raw[i].data.fd, (flags & (EPOLLIN | EPOLLHUP | EPOLLERR)) != 0, (flags & EPOLLOUT) != 0, (flags & (EPOLLHUP | EPOLLERR)) != 0};
+    }
+    return events_ready == -1 ? -1 : count;
+}
+#endif
+
+std::unique_ptr<netlib::poller> netlib::socket_transport::open_poller(const latency_profile &profile)
+{
+    return std::make_unique<socket_poller>(profile);
+}
+
+static bool socket_address(const std::string &address, short port, sockaddr_in &addr)
+{
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, address.c_str(), &(addr.sin_addr)) == -1)
+    {
+        std::println("Inet pton failed! {}", strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+int netlib::socket_transport::listen(const std::string &address, short port, const latency_profile &profile)
+{
+    sockaddr_in addr;
+    if (!socket_address(address, port, addr))
+        return -1;
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (bind(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) == -1)
+    {
+        std::println("Bind failed! {}", strerror(errno));
+        ::close(fd);
+        return -1;
+    }
+    // Buffer sizes have to be on the listener to take effect before the handshake
+    tune_socket(fd, profile);
+    if (::listen(fd, 10) == -1)
+    {
+        std::println("Listen failed!");
+        ::close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int netlib::socket_transport::accept(int listener, uint32_t &ip)
+{
+    sockaddr_in addr = {0};
+    socklen_t addr_size = sizeof(addr);
+    // Non blocking so send_file can hand the socket to sendfile, the blocking
+    // helpers (send_packet and co) wait for room themselves
+    #if defined(__linux__)
+    int fd = ::accept4(listener, (sockaddr *)&addr, &addr_size, SOCK_NONBLOCK);
+    #else
+    int fd = ::accept(listener, (sockaddr *)&addr, &addr_size);
+    if (fd != -1)
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    #endif
+    ip = addr.sin_addr.s_addr;
+    return fd;
+}
+
+int netlib::socket_transport::connect(const std::string &address, short port, const latency_profile &profile)
+{
+    sockaddr_in addr;
+    if (!socket_address(address, port, addr))
+        return -1;
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    tune_socket(fd, profile);
+    if (::connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) == -1)
+    {
+        std::println("Connect failed!");
+        ::close(fd);
+        return -1;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    return fd;
+}
+
+ssize_t netlib::socket_transport::recv(int fd, void *buffer, size_t size, int flags, uint64_t *kernel_ns)
+{
+    if (kernel_ns)
+        return latency_tracer::recv_stamped(fd, buffer, size, *kernel_ns, flags);
+    return ::recv(fd, buffer, size, flags);
+}
+
+ssize_t netlib::socket_transport::send(int fd, const void *data, size_t size, int flags)
+{
+    return ::send(fd, data, size, flags | MSG_NOSIGNAL);
+}
+
+// Kernel to socket copy, the file never enters user space. sendfile has no
+// MSG_DONTWAIT, the sockets accept and connect make are non blocking already.
+// Blocking ones from elsewhere get the file staged and sent with MSG_DONTWAIT
+ssize_t netlib::socket_transport::send_file(int fd, int file_fd, uint64_t offset, size_t length)
+{
+    if (!(fcntl(fd, F_GETFL) & O_NONBLOCK))
+        return transport::send_file(fd, file_fd, offset, length);
+    #if defined(__linux__)
+    off_t position = offset;
+    ssize_t status = sendfile(fd, file_fd, &position, length);
+    #elif defined(__APPLE__)
+    off_t sent = length;
+    int result = sendfile(file_fd, fd, offset, &sent, NULL, 0);
+    ssize_t status = (result == -1 && sent == 0) ? -1 : sent;
+    #elif defined(__FreeBSD__)
+    off_t sent = 0;
+    int result = sendfile(file_fd, fd, offset, length, NULL, &sent, 0);
+    ssize_t status = (result == -1 && sent == 0) ? -1 : sent;
+    #endif
+    return status;
+}
+
+void netlib::socket_transport::close(int fd)
+{
+    ::close(fd);
+}
+
+size_t netlib::socket_transport::available(int fd)
+{
+    int count = 0;
+    ioctl(fd, FIONREAD, &count);
+    return count;
+}
+
+void netlib::socket_transport::tune(int fd, const latency_profile &profile)
+{
+    tune_socket(fd, profile);
+}
+
+void netlib::socket_transport::after_read(int fd, const latency_profile &profile)
+{
+    rearm_quickack(fd, profile);
+}
+
+bool netlib::socket_transport::enable_timestamps(int fd)
+{
+    return latency_tracer::enable_timestamps(fd);
+}
+
+// Shared by every reactor, never destroyed
+netlib::transport &netlib::default_transport()
+{
+    static socket_transport *sockets = new socket_transport;
+    return *sockets;
+}
+
+netlib::loopback_poller::loopback_poller(loopback_transport &network)
+:owner(network)
+{
+}
+
+netlib::loopback_poller::~loopback_poller()
+{
+    std::lock_guard<std::mutex> lock(owner.sync);
+    for (auto &[fd, point] : owner.endpoints)
+        if (point.watcher == this)
+            point.watcher = nullptr;
+}
+
+void netlib::loopback_poller::watch(int fd, int interest)
+{
+    std::lock_guard<std::mutex> lock(owner.sync);
+    auto point_test = owner.endpoints.find(fd);
+    if (point_test == owner.endpoints.end())
+        return;
+    auto &point = point_test->second;
+    if (interest == 0)
+    {
+        if (point.watcher == this)
+            point.watcher = nullptr;
+        candidates.erase(fd);
+        return;
+    }
+    point.watcher = this;
+    point.interest = interest;
+    candidates.insert(fd);
+    ready.notify_one();
+}
+
+// Reports the candidates that are ready and keeps them for the next wait,
+// drops the ones that aren't until they change again
+int netlib::loopback_poller::wait(transport_event *events, int max_events, int wait_ms)
+{
+    std::unique_lock<std::mutex> lock(owner.sync);
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(wait_ms);
+    while (true)
+    {
+        int count = 0;
+        for (auto fd = candidates.begin(); fd != candidates.end() && count < max_events;)
+        {
+            auto point_test = owner.endpoints.find(*fd);
+            if (point_test == owner.endpoints.end() || point_test->second.watcher != this)
+            {
+                fd = candidates.erase(fd);
+                continue;
+            }
+            auto &point = point_test->second;
+            bool hangup = point.peer == -1 && !point.listening;
+            bool readable = point.listening ? !point.backlog.empty() : point.pending() > 0 || hangup;
+            // Listeners have no peer, looking one up would make an endpoint -1
+            bool writable = hangup;
+            if (!point.listening && !hangup)
+            {
+                auto peer_test = owner.endpoints.find(point.peer);
+                writable = peer_test == owner.endpoints.end() || peer_test->second.pending() < LOOPBACK_BUFFER_SIZE;
+            }
+            readable = readable && (point.interest & TRANSPORT_READ);
+            writable = writable && (point.interest & TRANSPORT_WRITE);
+            if (!readable && !writable)
+            {
+                fd = candidates.erase(fd);
+                continue;
+            }
+            events[count++] = {*fd, readable, writable, hangup};
+            fd++;
+        }
+        if (count > 0 || woken)
+        {
+            woken = false;
+            return count;
+        }
+        if (wait_ms == 0)
+            return 0;
+        if (wait_ms < 0)
+            ready.wait(lock);
+        else if (ready.wait_until(lock, deadline) == std::cv_status::timeout)
+            return 0;
+    }
+}
+
+void netlib::loopback_poller::wake()
+{
+    std::lock_guard<std::mutex> lock(owner.sync);
+    woken = true;
+    ready.notify_one();
+}
+
+netlib::loopback_transport::~loopback_transport()
+{
+    std::lock_guard<std::mutex> lock(sync);
+    endpoints.clear();
+}
+
+std::unique_ptr<netlib::poller> netlib::loopback_transport::open_poller(const latency_profile &profile)
+{
+    return std::make_unique<loopback_poller>(*this);
+}
+
+// Called with sync held
+int netlib::loopback_transport::open_endpoint()
+{
+    int fd = next_fd++;
+    endpoints[fd];
+    return fd;
+}
+
+// Called with sync held, wakes whoever waits on fd
+void netlib::loopback_transport::notify(int fd)
+{
+    auto point_test = endpoints.find(fd);
+    if (point_test != endpoints.end() && point_test->second.watcher)
+    {
+        point_test->second.watcher->candidates.insert(fd);
+        point_test->second.watcher->ready.notify_one();
+    }
+    changed.notify_all();
+}
+
+int netlib::loopback_transport::listen(const std::string &address, short port, const latency_profile &profile)
+{
+    std::lock_guard<std::mutex> lock(sync);
+    std::string name = address + ":" + std::to_string(port);
+    if (listeners.contains(name))
+    {
+        errno = EADDRINUSE;
+        std::println("Bind failed! {}", strerror(errno));
+        return -1;
+    }
+    int fd = open_endpoint();
+    endpoints[fd].listening = true;
+    endpoints[fd].name = name;
+    listeners[name] = fd;
+    return fd;
+}
+
+int netlib::loopback_transport::accept(int listener, uint32_t &ip)
+{
+    std::lock_guard<std::mutex> lock(sync);
+    auto point_test = endpoints.find(listener);
+    if (point_test == endpoints.end() || point_test->second.backlog.empty())
+    {
+        errno = EAGAIN;
+        return -1;
+    }
+    int fd = point_test->second.backlog.front();
+    point_test->second.backlog.pop_front();
+    ip = htonl(INADDR_LOOPBACK);
+    return fd;
+}
+
+int netlib::loopback_transport::connect(const std::string &address, short port, const latency_profile &profile)
+{
+    std::lock_guard<std::mutex> lock(sync);
+    auto listener = listeners.find(address + ":" + std::to_string(port));
+    if (listener == listeners.end())
+    {
+        errno = ECONNREFUSED;
+        std::println("Connect failed!");
+        return -1;
+    }
+    int client = open_endpoint();
+    int server = open_endpoint();
+    endpoints[client].peer = server;
+    endpoints[server].peer = client;
+    endpoints[listener->second].backlog.push_back(server);
+    notify(listener->second);
+    return client;
+}
+
+ssize_t netlib::loopback_transport::recv(int fd, void *buffer, size_t size, int flags, uint64_t *kernel_ns)
+{
+    if (kernel_ns)
+        *kernel_ns = 0;
+    std::unique_lock<std::mutex> lock(sync);
+    while (true)
+    {
+        auto point_test = endpoints.find(fd);
+        if (point_test == endpoints.end())
+        {
+            errno = EBADF;
+            return -1;
+        }
+        auto &point = point_test->second;
+        size_t count = std::min(size, point.pending());
+        if (count > 0)
+        {
+            memcpy(buffer, point.inbox.data() + point.read_at, count);
+            if (flags & MSG_PEEK)
+                return count;
+            point.read_at += count;
+            if (point.read_at == point.inbox.size())
+            {
+                point.inbox.clear();
+                point.read_at = 0;
+            }
+            else if (point.read_at > point.inbox.size() / 2)
+            {
+                point.inbox.erase(0, point.read_at);
+                point.read_at = 0;
+            }
+            if (point.peer != -1)
+                notify(point.peer);
+            return count;
+        }
+        if (point.peer == -1)
+            return 0;
+        if (flags & MSG_DONTWAIT)
+        {
+            errno = EAGAIN;
+            return -1;
+        }
+        changed.wait(lock);
+    }
+}
+
+ssize_t netlib::loopback_transport::send(int fd, const void *data, size_t size, int flags)
+{
+    std::unique_lock<std::mutex> lock(sync);
+    while (true)
+    {
+        auto point_test = endpoints.find(fd);
+        if (point_test == endpoints.end() || point_test->second.peer == -1)
+        {
+            errno = point_test == endpoints.end() ? EBADF : EPIPE;
+            return -1;
+        }
+        auto &peer = endpoints[point_test->second.peer];
+        size_t count = std::min(size, LOOPBACK_BUFFER_SIZE - peer.pending());
+        if (count > 0)
+        {
+            peer.inbox.append((const char *)data, count);
+            notify(point_test->second.peer);
+            return count;
+        }
+        if (flags & MSG_DONTWAIT)
+        {
+            errno = EAGAIN;
+            return -1;
+        }
+        changed.wait(lock);
+    }
+}
+
+// Called with sync held
+void netlib::loopback_transport::close_endpoint(int fd)
+{
+    auto point_test = endpoints.find(fd);
+    if (point_test == endpoints.end())
+        return;
+    auto &point = point_test->second;
+    if (point.listening)
+    {
+        // Connections nobody accepted are refused
+        for (int pending : point.backlog)
+            close_endpoint(pending);
+        listeners.erase(point.name);
+    }
+    if (point.peer != -1)
+    {
+        endpoints[point.peer].peer = -1;
+        notify(point.peer);
+    }
+    if (point.watcher)
+        point.watcher->candidates.erase(fd);
+    endpoints.erase(point_test);
+}
+
+void netlib::loopback_transport::close(int fd)
+{
+    std::lock_guard<std::mutex> lock(sync);
+    close_endpoint(fd);
+    changed.notify_all();
+}
+
+size_t netlib::loopback_transport::available(int fd)
+{
+    std::lock_guard<std::mutex> lock(sync);
+    auto point_test = endpoints.find(fd);
+    return point_test == endpoints.end() ? 0 : point_test->second.pending();
+}
@@ -0,0 +1,167 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <memory>
+#include <map>
+#include <set>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <sys/types.h>
+#include "latency.h"
+
+// What a poller watches a descriptor for
+#define TRANSPORT_READ 1
+#define TRANSPORT_WRITE 2
+
+// Bytes a loopback connection holds each way before send would block
+#ifndef LOOPBACK_BUFFER_SIZE
+#define LOOPBACK_BUFFER_SIZE (256 * 1024)
+#endif
+// Loopback descriptors start here so they can't be mistaken for real ones
+#define LOOPBACK_FD_BASE (1 << 24)
+// Largest read send_file stages when the transport can't splice files
+// or the socket is a blocking one
+#ifndef TRANSPORT_FILE_CHUNK
+#define TRANSPORT_FILE_CHUNK (16 * 1024)
+#endif
+
+namespace netlib
+{
+    // readable also covers hangups and errors, like EPOLLIN | EPOLLHUP | EPOLLERR
+    struct transport_event
+    {
+        int fd;
+        bool readable;
+        bool writable;
+        bool hangup;
+    };
+
+    // Level triggered readiness for the descriptors of one transport.
+    // wake may be called from any thread and ends the current wait
+    class poller
+    {
+        public:
+            virtual ~poller() = default;
+            // Replaces what fd is watched for, 0 stops watching it
+            virtual void watch(int fd, int interest) = 0;
+            // -1 on error with errno, wait_ms -1 waits until something happens
+            virtual int wait(transport_event *events, int max_events, int wait_ms) = 0;
+            virtual void wake() = 0;
+    };
+
+    // Everything the reactors do to the network. Calls behave like the
+    // socket calls they replace: -1 with errno on failure, EAGAIN where a non
+    // blocking socket would give it, and recv returns 0 at the end of stream
+    class transport
+    {
+        public:
+            virtual ~transport() = default;
+            virtual std::unique_ptr<poller> open_poller(const latency_profile &profile) = 0;
+            virtual int listen(const std::string &address, short port, const latency_profile &profile) = 0;
+            // ip in network order
+            virtual int accept(int listener, uint32_t &ip) = 0;
+            virtual int connect(const std::string &address, short port, const latency_profile &profile) = 0;
+            // flags may have MSG_PEEK and MSG_DONTWAIT. With kernel_ns the
+            // receive timestamp is returned too, 0 when there is none
+            virtual ssize_t recv(int fd, void *buffer, size_t size, int flags, uint64_t *kernel_ns = nullptr) = 0;
+            // flags may have MSG_DONTWAIT and MSG_MORE
+            virtual ssize_t send(int fd, const void *data, size_t size, int flags) = 0;
+            // Never blocks, 0 when the file ended early. The default reads the
+            // file and sends it like any other data
+            virtual ssize_t send_file(int fd, int file_fd, uint64_t offset, size_t length);
+            virtual void close(int fd) = 0;
+            // Bytes that can be read right away
+            virtual size_t available(int fd) = 0;
+            // Socket options, nothing to do where there are no sockets
+            virtual void tune(int, const latency_profile &) {}
+            virtual void after_read(int, const latency_profile &) {}
+            virtual bool enable_timestamps(int) { return false; }
+            // Descriptors are real sockets, which handoff and relays need
+            virtual bool sockets() const { return false; }
+    };
+
+    // TCP over epoll or kqueue, what every reactor uses unless told otherwise
+    class socket_transport : public transport
+    {
+        public:
+            std::unique_ptr<poller> open_poller(const latency_profile &profile) override;
+            int listen(const std::string &address, short port, const latency_profile &profile) override;
+            int accept(int listener, uint32_t &ip) override;
+            int connect(const std::string &address, short port, const latency_profile &profile) override;
+            ssize_t recv(int fd, void *buffer, size_t size, int flags, uint64_t *kernel_ns = nullptr) override;
+            ssize_t send(int fd, const void *data, size_t size, int flags) override;
+            ssize_t send_file(int fd, int file_fd, uint64_t offset, size_t length) override;
+            void close(int fd) override;
+            size_t available(int fd) override;
+            void tune(int fd, const latency_profile &profile) override;
+            void after_read(int fd, const latency_profile &profile) override;
+            bool enable_timestamps(int fd) override;
+            bool sockets() const override { return true; }
+    };
+
+    transport &default_transport();
+
+    class loopback_poller;
+
+    // Connects servers and clients of the same process through memory, no
+    // syscalls involved. Addresses are just names: connect finds the listener
+    // by the exact address and port it was opened with. One lock covers the
+    // whole transport, it is there to measure the library, not to scale
+    class loopback_transport : public transport
+    {
+        public:
+            ~loopback_transport();
+            std::unique_ptr<poller> open_poller(const latency_profile &profile) override;
+            int listen(const std::string &address, short port, const latency_profile &profile) override;
+            int accept(int listener, uint32_t &ip) override;
+            int connect(const std::string &address, short port, const latency_profile &profile) override;
+            ssize_t recv(int fd, void *buffer, size_t size, int flags, uint64_t *kernel_ns = nullptr) override;
+            ssize_t send(int fd, const void *data, size_t size, int flags) override;
+            void close(int fd) override;
+            size_t available(int fd) override;
+        private:
+            friend class loopback_poller;
+            struct endpoint
+            {
+                // -1 once the other side closed
+                int peer = -1;
+                bool peer_closed = false;
+                std::string inbox;
+                size_t read_at = 0;
+                bool listening = false;
+                std::string name;
+                std::deque<int> backlog;
+                loopback_poller *watcher = nullptr;
+                int interest = 0;
+                size_t pending() const { return inbox.size() - read_at; }
+            };
+            int open_endpoint();
+            void close_endpoint(int fd);
+            void notify(int fd);
+            std::mutex sync;
+            // Blocking recv and send wait on it
+            std::condition_variable changed;
+            std::map<int, endpoint> endpoints;
+            std::map<std::string, int> listeners;
+            int next_fd = LOOPBACK_FD_BASE;
+    };
+
+    class loopback_poller : public poller
+    {
+        public:
+            loopback_poller(loopback_transport &network);
+            ~loopback_poller();
+            void watch(int fd, int interest) override;
+            int wait(transport_event *events, int max_events, int wait_ms) override;
+            void wake() override;
+        private:
+            friend class loopback_transport;
+            loopback_transport &owner;
+            std::condition_variable ready;
+            // Descriptors whose state changed since they were last found idle
+            std::set<int> candidates;
+            bool woken = false;
+    };
+}
@@ -1,4 +1,7 @@
 #include "utils.h"
+#include <sys/socket.h>
+#include <poll.h>
+#include <errno.h>
 
 double read_double(char *buf)
 {
@@ -29,4 +32,34 @@ char *mem_dup(char *buf, int size)
 	char *ret = (char *)calloc(size + 1, sizeof(char));
 	memcpy(ret, buf, (size));
 	return ret;
-}
\ No newline at end of file
+}
+
+ssize_t send_whole(int sock, const char *data, size_t size, int flags)
+{
+	size_t sent = 0;
+	while (sent < size)
+	{
+		ssize_t status = send(sock, data + sent, size - sent, flags);
+		if (status == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		{
+			if (!wait_socket(sock, POLLOUT))
+				return -1;
+			continue;
+		}
+		if (status == -1 && errno == EINTR)
+			continue;
+		if (status == -1)
+			return -1;
+		sent += status;
+	}
+	return sent;
+}
+
+bool wait_socket(int sock, short events)
+{
+	pollfd pfd = {sock, events, 0};
+	while (poll(&pfd, 1, -1) == -1)
+		if (errno != EINTR)
+			return false;
+	return true;
+}
@@ -2,6 +2,7 @@
 #include <cstring>
 #include <string>
 #include <cstdint>
+#include <sys/types.h>
 #ifdef __FreeBSD__
 #include <sys/endian.h>
 #endif
@@ -30,6 +31,8 @@ struct char_size
     int consumed_size;
     int max_size;
     char *start_data;
+    // Set by writers that had to give up on a field, the bytes are unusable
+    bool failed = false;
 };
 
 struct packet
@@ -61,4 +64,9 @@ struct packet
 
 double read_double(char *buf);
 float read_float(char *buf);
-char *mem_dup(char *buf, int size);
\ No newline at end of file
+char *mem_dup(char *buf, int size);
+// Sends all of data, waiting for room when a non blocking socket is full.
+// The reactors' sockets are non blocking. Returns size, or -1 with errno set
+ssize_t send_whole(int sock, const char *data, size_t size, int flags = 0);
+// Blocks until sock is ready for events (POLLIN, POLLOUT), false on error
+bool wait_socket(int sock, short events);
@@ -0,0 +1,139 @@
+#pragma once
+#include <bit>
+#include <concepts>
+#include <cstdint>
+#include <limits>
+#include <type_traits>
+#include "comp_time_read.h"
+#include "comp_time_write.h"
+#include "varlen.h"
+#ifdef __BMI2__
+#include <immintrin.h>
+#endif
+
+// LEB128 integers, 7 bits per byte with the high bit set on all but the last,
+// least significant group first whatever the wire byte order.
+// Signed values are zigzagged first so small negatives stay short. Wrap a
+// field to use it, the value is in .value:
+//
+//     std::tuple<netlib::varint<uint64_t>, netlib::varint<int32_t>> pos;
+namespace netlib
+{
+    template<std::integral T>
+    struct varint
+    {
+        using netlib_codec = void;
+        T value;
+    };
+
+    template<std::integral T>
+    constexpr size_t varint_max_size = (sizeof(T) * 8 + 6) / 7;
+
+    template<std::integral T>
+    constexpr std::make_unsigned_t<T> zigzag_encode(T value)
+    {
+        using U = std::make_unsigned_t<T>;
+        if constexpr (std::is_signed_v<T>)
+            return ((U)value << 1) ^ (U)(value >> (sizeof(T) * 8 - 1));
+        else
+            return value;
+    }
+
+    template<std::integral T>
+    constexpr T zigzag_decode(std::make_unsigned_t<T> value)
+    {
+        if constexpr (std::is_signed_v<T>)
+            return (T)((value >> 1) ^ (~(value & 1) + 1));
+        else
+            return value;
+    }
+
+    constexpr size_t varint_size(uint64_t value)
+    {
+        // 1 + (index of the top set bit) / 7, without a loop
+        return 1 + (63 - std::countl_zero(value | 1)) / 7;
+    }
+
+    // out needs room for varint_max_size bytes, returns how many were written
+    inline size_t encode_varint(char *out, uint64_t value)
+    {
+        size_t size = 0;
+        while (value >= 0x80)
+        {
+            out[size++] = (char)(value | 0x80);
+            value >>= 7;
+        }
+        out[size++] = (char)value;
+        return size;
+    }
+
+    // Returns the bytes read, 0 if data is truncated or longer than max_size
+    inline size_t decode_varint(const char *data, size_t available, uint64_t &value, size_t max_size = 10)
+    {
+#ifdef __BMI2__
+        if constexpr (std::endian::native == std::endian::little)
+        {
+            if (available >= 8)
+            {
+                uint64_t word;
+                std::memcpy(&word, data, 8);
+                uint64_t stops = ~word & 0x8080808080808080ull;
+                if (stops)
+                {
+                    size_t size = (std::countr_zero(stops) >> 3) + 1;
+                    if (size > max_size)
+                        return 0;
+                    uint64_t keep = stops ^ (stops - 1);
+                    value = _pext_u64(word & keep, 0x7f7f7f7f7f7f7f7full);
+                    return size;
+                }
+            }
+        }
+#endif
+        uint64_t result = 0;
+        size_t limit = available < max_size ? available : max_size;
+        for (size_t i = 0; i < limit; i++)
+        {
+            uint8_t byte = data[i];
+            result |= (uint64_t)(byte & 0x7f) << (7 * i);
+            if (!(byte & 0x80))
+            {
+                value = result;
+                return i + 1;
+            }
+        }
+        return 0;
+    }
+}
+
+template<std::integral T, typename Order>
+struct write_var<netlib::varint<T>, Order>
+{
+    static void call(char_size *v, const netlib::varint<T> &value)
+    {
+        netlib::reserve(v, netlib::varint_max_size<T>);
+        size_t size = netlib::encode_varint(v->data, netlib::zigzag_encode(value.value));
+        v->data += size;
+        v->consumed_size += size;
+    }
+};
+
+template<std::integral T, typename Order>
+struct read_var<netlib::varint<T>, Order>
+{
+    static netlib::varint<T> call(char_size *v)
+    {
+        using U = std::make_unsigned_t<T>;
+        uint64_t raw = 0;
+        size_t available = v->consumed_size < v->max_size ? v->max_size - v->consumed_size : 0;
+        size_t size = netlib::decode_varint(v->data, available, raw, netlib::varint_max_size<T>);
+        if (!size || raw > std::numeric_limits<U>::max())
+        {
+            netlib::read_failed(v);
+            return {};
+        }
+        v->data += size;
+        v->consumed_size += size;
+        return {netlib::zigzag_decode<T>((U)raw)};
+    }
+};
@@ -0,0 +1,205 @@
+#pragma once
+#include <cstddef>
+#include <limits>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "comp_time_read.h"
+#include "comp_time_write.h"
+
+#ifndef MAX_FIELD_SIZE
+#define MAX_FIELD_SIZE 65536
+#endif
+
+// Length prefixed fields: [Length][bytes] for strings and byte spans,
+// [Length][elements] for vectors. std::string_view and std::span<const std::byte>
+// are always prefixed (uint32_t, MAX_FIELD_SIZE) and decode without copying,
+// they point into the packet being read and are valid as long as its buffer.
+// Plain std::string and std::vector keep their unprefixed encoding, wrap them
+// in prefixed<> to get a length and to choose the prefix width and limit:
+//
+//     std::tuple<uint16_t, netlib::prefixed<std::string_view, uint8_t, 255>> chat;
+//
+// A length above the limit or past the end of the packet yields an empty
+// field and consumes the rest of the packet, so the following fields are empty too
+namespace netlib
+{
+    template<typename T, typename Length = uint32_t, size_t Max = MAX_FIELD_SIZE>
+    struct prefixed
+    {
+        static_assert(std::is_unsigned_v<Length>, "length prefix must be unsigned");
+        using netlib_codec = void;
+        using length_type = Length;
+        static constexpr size_t max_length = Max;
+        T value;
+    };
+
+    template<typename T>
+    concept byte_view = std::is_same_v<T, std::string_view> || std::is_same_v<T, std::span<const std::byte>>;
+
+    inline void read_failed(char_size *v)
+    {
+        v->data = v->start_data + v->max_size;
+        v->consumed_size = v->max_size;
+    }
+
+    inline void reserve(char_size *v, size_t size)
+    {
+        while (v->consumed_size + size >= (size_t)v->max_size)
+        {
+            v->start_data = (char *)realloc(v->start_data, v->max_size + 1024 + size);
+            v->max_size += 1024 + size;
+            v->data = v->start_data + v->consumed_size;
+        }
+    }
+
+    // Reads and checks a prefix for length elements of element_size bytes
+    template<typename Length, size_t Max, typename Order>
+    bool read_length(char_size *v, size_t element_size, size_t &length)
+    {
+        if (sizeof(Length) + v->consumed_size > (size_t)v->max_size)
+        {
+            read_failed(v);
+            return false;
+        }
+        length = read_type<Length, Order>(v->data);
+        if (length > Max || sizeof(Length) + length * element_size + v->consumed_size > (size_t)v->max_size)
+        {
+            read_failed(v);
+            return false;
+        }
+        v->data += sizeof(Length);
+        v->consumed_size += sizeof(Length);
+        return true;
+    }
+
+    template<typename Length, size_t Max, typename Order>
+    bool write_length(char_size *v, size_t length)
+    {
+        if (length > Max || length > (size_t)std::numeric_limits<Length>::max())
+        {
+            std::println("Field of {} elements doesn't fit its length prefix", length);
+            v->failed = true;
+            return false;
+        }
+        reserve(v, sizeof(Length));
+        write_type<Length, Order>(v->data, (Length)length);
+        v->data += sizeof(Length);
+        v->consumed_size += sizeof(Length);
+        return true;
+    }
+
+    template<typename T, typename Length, size_t Max>
+    struct prefixed_codec;
+
+    template<byte_view T, typename Length, size_t Max>
+    struct prefixed_codec<T, Length, Max>
+    {
+        template<typename Order>
+        static T read(char_size *v)
+        {
+            size_t length;
+            if (!read_length<Length, Max, Order>(v, 1, length))
+                return T{};
+            T ret((const typename T::value_type *)v->data, length);
+            v->data += length;
+            v->consumed_size += length;
+            return ret;
+        }
+        template<typename Order>
+        static void write(char_size *v, const T &value)
+        {
+            if (!write_length<Length, Max, Order>(v, value.size()))
+                return;
+            reserve(v, value.size());
+            std::memcpy(v->data, value.data(), value.size());
+            v->data += value.size();
+            v->consumed_size += value.size();
+        }
+    };
+
+    template<typename Length, size_t Max>
+    struct prefixed_codec<std::string, Length, Max>
+    {
+        template<typename Order>
+        static std::string read(char_size *v)
+        {
+            return std::string(prefixed_codec<std::string_view, Length, Max>::template read<Order>(v));
+        }
+        template<typename Order>
+        static void write(char_size *v, const std::string &value)
+        {
+            prefixed_codec<std::string_view, Length, Max>::template write<Order>(v, value);
+        }
+    };
+
+    template<arithmetic T, typename Length, size_t Max>
+    struct prefixed_codec<std::vector<T>, Length, Max>
+    {
+        template<typename Order>
+        static std::vector<T> read(char_size *v)
+        {
+            size_t length;
+            if (!read_length<Length, Max, Order>(v, sizeof(T), length))
+                return {};
+            std::vector<T> ret(length);
+            for (size_t i = 0; i < length; i++)
+            {
+                ret[i] = read_type<T, Order>(v->data);
+                v->data += sizeof(T);
+            }
+            v->consumed_size += length * sizeof(T);
+            return ret;
+        }
+        template<typename Order>
+        static void write(char_size *v, const std::vector<T> &value)
+        {
+            if (!write_length<Length, Max, Order>(v, value.size()))
+                return;
+            reserve(v, value.size() * sizeof(T));
+            for (const auto &val : value)
+            {
+                write_type<T, Order>(v->data, val);
+                v->data += sizeof(T);
+            }
+            v->consumed_size += value.size() * sizeof(T);
+        }
+    };
+}
+
+template<netlib::byte_view T, typename Order>
+struct read_var<T, Order>
+{
+    static T call(char_size *v)
+    {
+        return netlib::prefixed_codec<T, uint32_t, MAX_FIELD_SIZE>::template read<Order>(v);
+    }
+};
+
+template<netlib::byte_view T, typename Order>
+struct write_var<T, Order>
+{
+    static void call(char_size *v, const T &value)
+    {
+        netlib::prefixed_codec<T, uint32_t, MAX_FIELD_SIZE>::template write<Order>(v, value);
+    }
+};
+
+template<typename T, typename Length, size_t Max, typename Order>
+struct read_var<netlib::prefixed<T, Length, Max>, Order>
+{
+    static netlib::prefixed<T, Length, Max> call(char_size *v)
+    {
+        return {netlib::prefixed_codec<T, Length, Max>::template read<Order>(v)};
+    }
+};
+
+template<typename T, typename Length, size_t Max, typename Order>
+struct write_var<netlib::prefixed<T, Length, Max>, Order>
+{
+    static void call(char_size *v, const netlib::prefixed<T, Length, Max> &value)
+    {
+        netlib::prefixed_codec<T, Length, Max>::template write<Order>(v, value.value);
+    }
+};